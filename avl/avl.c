@@ -36,8 +36,175 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "avl.h"
+#include "avl_btree.h"
+#include "avl_compact.h"
+#include "avl_mapped.h"
+#include "avl_frozen.h"
+#include "avl_small.h"
+
+/* bits for avl_tree.flags */
+#define AVL_TREE_INTRUSIVE      0x0001U /* nodes are embedded in the keys */
+#define AVL_TREE_ENGINE         0x0002U /* keys live in an engine, not in avl_node */
+#define AVL_TREE_SNAPSHOT       0x0004U /* a read only view, see avl_snapshot() */
+#define AVL_TREE_SMALL          0x0008U /* keys in a sorted array for now, see avl_tree_new_small() */
+
+/*
+ * An engine keeps the keys of a tree in its own structure.  Trees with
+ * an engine have no avl_node, the key and index based functions call
+ * into the engine instead.
+ */
+struct _avl_engine {
+  /* NULL for engines that set themselves up some other way */
+  void *        (*create) (void);
+  void          (*destroy) (avl_tree * tree, avl_free_key_fun_type free_key_fun);
+  /* equal keys go in front of the ones already there */
+  int           (*insert) (avl_tree * tree, void * key);
+  /* takes out the first key equal to <key> */
+  int           (*remove) (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun);
+  unsigned long (*bound) (avl_tree * tree, void * key, int upper, void ** at, void ** before);
+  int           (*get_by_index) (avl_tree * tree, unsigned long index, void ** value_address);
+  int           (*iterate_inorder) (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg);
+  int           (*iterate_index_range) (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                    unsigned long low, unsigned long high, void * iter_arg);
+  int           (*iterate_index_inorder) (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                    unsigned long low, unsigned long high, void * iter_arg);
+  int           (*verify) (avl_tree * tree);
+  void          (*print) (avl_tree * tree, avl_key_printer_fun_type key_printer);
+};
+
+#define AVL_ENGINE(tree) ((tree)->engine_ops)
+
+static const struct _avl_engine avl_btree_engine = {
+  avl_btree_new,
+  avl_btree_free,
+  avl_btree_insert,
+  avl_btree_delete,
+  avl_btree_bound,
+  avl_btree_get_by_index,
+  avl_btree_iterate_inorder,
+  avl_btree_iterate_index_range,
+  avl_btree_iterate_index_inorder,
+  avl_btree_verify,
+  avl_btree_print
+};
+
+static const struct _avl_engine avl_compact_engine = {
+  avl_compact_new,
+  avl_compact_free,
+  avl_compact_insert,
+  avl_compact_delete,
+  avl_compact_bound,
+  avl_compact_get_by_index,
+  avl_compact_iterate_inorder,
+  avl_compact_iterate_index_range,
+  avl_compact_iterate_index_inorder,
+  avl_compact_verify,
+  avl_compact_print
+};
+
+static const struct _avl_engine avl_mapped_engine = {
+  NULL,
+  avl_mapped_free,
+  avl_mapped_insert,
+  avl_mapped_delete,
+  avl_mapped_bound,
+  avl_mapped_get_by_index,
+  avl_mapped_iterate_inorder,
+  avl_mapped_iterate_index_range,
+  avl_mapped_iterate_index_inorder,
+  avl_mapped_verify,
+  avl_mapped_print
+};
+
+static const struct _avl_engine avl_frozen_engine = {
+  NULL,
+  avl_frozen_free,
+  avl_frozen_insert,
+  avl_frozen_delete,
+  avl_frozen_bound,
+  avl_frozen_get_by_index,
+  avl_frozen_iterate_inorder,
+  avl_frozen_iterate_index_range,
+  avl_frozen_iterate_index_inorder,
+  avl_frozen_verify,
+  avl_frozen_print
+};
+
+static const struct _avl_engine avl_small_engine = {
+  avl_small_new,
+  avl_small_free,
+  avl_small_insert,
+  avl_small_delete,
+  avl_small_bound,
+  avl_small_get_by_index,
+  avl_small_iterate_inorder,
+  avl_small_iterate_index_range,
+  avl_small_iterate_index_inorder,
+  avl_small_verify,
+  avl_small_print
+};
+
+/*
+ * Small trees move their keys into avl_node once they grow too big or
+ * anything that hands out or takes nodes is called, true if that fails.
+ */
+#define AVL_PROMOTE_FAILED(tree) (((tree)->flags & AVL_TREE_SMALL) && avl_promote (tree) != 0)
+
+static int avl_promote (avl_tree * tree);
+
+#define AVL_POOL_DEFAULT_SLAB (256)
+#define AVL_POOL_FIRST_SLAB (16)
+
+typedef struct avl_node_slab_tag {
+  struct avl_node_slab_tag *    next;
+  /* avl_node's follow */
+} avl_node_slab;
+
+struct _avl_node_pool {
+  /* changed under <lock>, read without it, see AVL_POOL_SHARED() */
+  unsigned int          refc;
+  unsigned int          nodes_per_slab;
+  /* slabs start small and double in size up to <nodes_per_slab> */
+  unsigned int          next_slab;
+  avl_node_slab *       slabs;
+  /* freed nodes, linked through their <right> pointer */
+  avl_node *            free_list;
+  /* nodes in the newest slab that were never handed out */
+  avl_node *            fresh;
+  unsigned int          fresh_left;
+#ifndef NO_THREAD
+  spin_t                lock;
+#endif
+};
+
+/*
+ * A pool private to one tree is protected by that tree's lock, only
+ * shared ones need their own.  A pool with one reference can only get
+ * another one from its owner, so it cannot become shared under us.  The
+ * acquire pairs with the release of the last avl_node_pool_free() of
+ * another user, whose nodes we then see put back.
+ */
+#define AVL_POOL_SHARED(pool) (__atomic_load_n (&(pool)->refc, __ATOMIC_ACQUIRE) > 1)
+
+static void
+avl_node_init (avl_node * node, void * key, avl_node * parent)
+{
+  node->parent = parent;
+  node->key = key;
+  node->left = NULL;
+  node->right = NULL;
+  node->rank_and_balance = 0;
+  AVL_SET_BALANCE (node, 0);
+  AVL_SET_RANK (node, 1);
+  node->generation = 0;
+#ifdef HAVE_AVL_NODE_LOCK
+  thread_rwlock_create(&node->rwlock);
+#endif
+}
 
 avl_node *
 avl_node_new (void *        key,
@@ -48,428 +215,2760 @@ avl_node_new (void *        key,
   if (!node) {
     return NULL;
   } else {
-    node->parent = parent;
-    node->key = key;
-    node->left = NULL;
-    node->right = NULL;
-    node->rank_and_balance = 0;
-    AVL_SET_BALANCE (node, 0);
-    AVL_SET_RANK (node, 1);
-#ifdef HAVE_AVL_NODE_LOCK
-    thread_rwlock_create(&node->rwlock);
-#endif
+    avl_node_init (node, key, parent);
     return node;
   }
 }         
 
-avl_tree *
-avl_tree_new (avl_key_compare_fun_type compare_fun,
-          void * compare_arg)
+avl_node_pool *
+avl_node_pool_new (unsigned int nodes_per_slab)
 {
-  avl_tree * t = (avl_tree *) malloc (sizeof (avl_tree));
+  avl_node_pool * pool = (avl_node_pool *) calloc (1, sizeof (avl_node_pool));
 
-  if (!t) {
+  if (!pool)
     return NULL;
+
+  pool->refc = 1;
+  pool->nodes_per_slab = nodes_per_slab ? nodes_per_slab : AVL_POOL_DEFAULT_SLAB;
+  pool->next_slab = pool->nodes_per_slab < AVL_POOL_FIRST_SLAB ? pool->nodes_per_slab : AVL_POOL_FIRST_SLAB;
+  thread_spin_create (&pool->lock);
+
+  return pool;
+}
+
+static void
+avl_node_pool_destroy (avl_node_pool * pool)
+{
+  avl_node_slab * slab = pool->slabs;
+
+  while (slab) {
+    avl_node_slab * next = slab->next;
+    free (slab);
+    slab = next;
+  }
+  thread_spin_destroy (&pool->lock);
+  free (pool);
+}
+
+static void
+avl_node_pool_ref (avl_node_pool * pool)
+{
+  thread_spin_lock (&pool->lock);
+  __atomic_add_fetch (&pool->refc, 1, __ATOMIC_RELEASE);
+  thread_spin_unlock (&pool->lock);
+}
+
+void
+avl_node_pool_free (avl_node_pool * pool)
+{
+  unsigned int refc;
+
+  if (!pool)
+    return;
+
+  thread_spin_lock (&pool->lock);
+  refc = __atomic_sub_fetch (&pool->refc, 1, __ATOMIC_ACQ_REL);
+  thread_spin_unlock (&pool->lock);
+
+  if (!refc)
+    avl_node_pool_destroy (pool);
+}
+
+static avl_node *
+avl_node_pool_get (avl_node_pool * pool)
+{
+  avl_node * node;
+  int shared = AVL_POOL_SHARED (pool);
+
+  if (shared)
+    thread_spin_lock (&pool->lock);
+
+  if (pool->free_list) {
+    node = pool->free_list;
+    pool->free_list = node->right;
   } else {
-    avl_node * root = avl_node_new((void *)NULL, (avl_node *) NULL);
-    if (!root) {
-      free (t);
-      return NULL;
-    } else {
-      t->root = root;
-      t->height = 0;
-      t->length = 0;
-      t->compare_fun = compare_fun;
-      t->compare_arg = compare_arg;
-      thread_rwlock_create(&t->rwlock);
-      return t;
+    if (!pool->fresh_left) {
+      avl_node_slab * slab = (avl_node_slab *) malloc (sizeof (avl_node_slab) + sizeof (avl_node) * pool->next_slab);
+      if (!slab) {
+        if (shared)
+          thread_spin_unlock (&pool->lock);
+        return NULL;
+      }
+      slab->next = pool->slabs;
+      pool->slabs = slab;
+      pool->fresh = (avl_node *) (slab + 1);
+      pool->fresh_left = pool->next_slab;
+      if (pool->next_slab < pool->nodes_per_slab) {
+        pool->next_slab *= 2;
+        if (pool->next_slab > pool->nodes_per_slab)
+          pool->next_slab = pool->nodes_per_slab;
+      }
     }
+    node = pool->fresh++;
+    pool->fresh_left--;
   }
+
+  if (shared)
+    thread_spin_unlock (&pool->lock);
+
+  return node;
 }
-  
+
 static void
-avl_tree_free_helper (avl_node * node, avl_free_key_fun_type free_key_fun)
+avl_node_pool_put (avl_node_pool * pool, avl_node * node)
 {
-  if (node->left) {
-    avl_tree_free_helper (node->left, free_key_fun);
+  int shared = AVL_POOL_SHARED (pool);
+
+  if (shared)
+    thread_spin_lock (&pool->lock);
+  node->right = pool->free_list;
+  pool->free_list = node;
+  if (shared)
+    thread_spin_unlock (&pool->lock);
+}
+
+/*
+ * Subtree aggregates, see avl_tree_new_augmented().
+ *
+ * Each node of such a tree carries the aggregate of its subtree right
+ * behind it.  Whatever changes links fixes the nodes that a rotation
+ * moved down first and then the path from where it changed the tree up
+ * to the root, just like the ranks.
+ */
+
+struct _avl_aggregates {
+  avl_augment           ops;
+  /* room for one value, for writers only */
+  void *                scratch;
+};
+
+#define AVL_AGGREGATE(node) ((void *) ((node) + 1))
+
+/* redo the aggregate of <x> from its key and its children */
+
+static void
+avl_aggregate_node (avl_tree * tree, avl_node * x)
+{
+  const avl_augment * ops = &tree->aggregates->ops;
+  void * value = AVL_AGGREGATE (x);
+
+  if (x->left) {
+    memcpy (value, AVL_AGGREGATE (x->left), ops->size);
+    ops->lift (ops->arg, tree->aggregates->scratch, x->key);
+    ops->combine (ops->arg, value, tree->aggregates->scratch);
+  } else {
+    ops->lift (ops->arg, value, x->key);
   }
-  if (free_key_fun)
-      free_key_fun (node->key);
-  if (node->right) {
-    avl_tree_free_helper (node->right, free_key_fun);
+  if (x->right)
+    ops->combine (ops->arg, value, AVL_AGGREGATE (x->right));
+}
+
+/* <x> and everything above it */
+
+static void
+avl_aggregate_path (avl_tree * tree, avl_node * x)
+{
+  if (!tree->aggregates)
+    return;
+  for (; x && x != tree->root; x = x->parent)
+    avl_aggregate_node (tree, x);
+}
+
+static void
+avl_aggregate_subtree (avl_tree * tree, avl_node * x)
+{
+  if (!x)
+    return;
+  avl_aggregate_subtree (tree, x->left);
+  avl_aggregate_subtree (tree, x->right);
+  avl_aggregate_node (tree, x);
+}
+
+/* deleted key that waits for the snapshots that may see it */
+typedef struct avl_cow_key_tag {
+  struct avl_cow_key_tag *  next;
+  void *                key;
+  avl_free_key_fun_type     free_key_fun;
+  unsigned int          generation;
+} avl_cow_key;
+
+/* snapshot state, the fields are used differently by a tree and a snapshot */
+typedef struct _avl_cow {
+  /* a tree: the generation of new nodes, a snapshot: the one it shows */
+  unsigned int          generation;
+  /* a tree: its first snapshot, a snapshot: the next one of the same tree */
+  avl_tree *            snapshots;
+  /* a snapshot: the tree it was taken of */
+  avl_tree *            origin;
+  /* a tree: nodes that were replaced by copies, linked through their
+   * <parent> and tagged with the generation they left the tree in
+   */
+  avl_node *            retired;
+  avl_node **           retired_tail;
+  avl_cow_key *         keys;
+  avl_cow_key **        keys_tail;
+  /* a tree: fresh nodes set aside for the copies a write is going to make */
+  avl_node *            reserve;
+} avl_cow;
+
+#define AVL_COW_ACTIVE(tree) ((tree)->cow && (tree)->cow->snapshots)
+#define AVL_COW_GENERATION(tree) ((tree)->cow ? (tree)->cow->generation : 0)
+
+static void avl_cow_reclaim (avl_tree * tree);
+
+/* allocate and release the nodes of <tree> */
+
+static avl_node *
+avl_tree_node_new (avl_tree * tree, void * key, avl_node * parent)
+{
+  avl_node * node;
+
+  if (tree->aggregates) {
+    /* room for the aggregate behind the node */
+    node = (avl_node *) malloc (sizeof (avl_node) + tree->aggregates->ops.size);
+    if (node)
+      avl_node_init (node, key, parent);
+  } else if (!tree->pool) {
+    node = avl_node_new (key, parent);
+  } else {
+    node = avl_node_pool_get (tree->pool);
+    if (node)
+      avl_node_init (node, key, parent);
   }
+  if (node)
+    node->generation = AVL_COW_GENERATION (tree);
+  return node;
+}
+
+static void
+avl_tree_node_free (avl_tree * tree, avl_node * node)
+{
 #ifdef HAVE_AVL_NODE_LOCK
   thread_rwlock_destroy (&node->rwlock);
 #endif
-  free (node);
+  if (tree->flags & AVL_TREE_INTRUSIVE) {
+    /* the node belongs to the key */
+  } else if (tree->pool) {
+    avl_node_pool_put (tree->pool, node);
+  } else {
+    free (node);
+  }
 }
-  
-void
-avl_tree_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+
+/*
+ * Counters, see avl_tree_set_stats().
+ *
+ * A tree that counts has AVL_STATS_SHARDS records of counters.  Every
+ * thread is handed a shard number the first time it counts, the same
+ * for all trees, so a thread mostly has a record to itself and the few
+ * threads sharing one do not fight over a lock.  The adds are atomic,
+ * which also lets avl_tree_get_stats() add up the records while threads
+ * keep counting.
+ */
+
+enum {
+  AVL_STAT_LOOKUPS,
+  AVL_STAT_COMPARES,
+  AVL_STAT_INSERTS,
+  AVL_STAT_DELETES,
+  AVL_STAT_ROTATIONS,
+  AVL_STAT_MAX_DEPTH,
+  AVL_STAT_LOCK_WAITS,
+  AVL_STAT_LOCK_WAIT_NS,
+  AVL_STAT_COUNT
+};
+
+#ifndef NO_THREAD
+#define AVL_STATS_SHARDS (16)
+#else
+#define AVL_STATS_SHARDS (1)
+#endif
+
+/* eight counters make one cache line on 64 bit systems */
+typedef struct {
+  unsigned long         counter[AVL_STAT_COUNT];
+} avl_stats_record;
+
+struct _avl_stats {
+  avl_stats_record      record[AVL_STATS_SHARDS];
+};
+
+#define AVL_STATS_ADD(rec,i,n) \
+  __atomic_fetch_add (&(rec)->counter[i], (n), __ATOMIC_RELAXED)
+
+static void
+avl_stats_max (avl_stats_record * rec, int i, unsigned long n)
 {
-  if (tree->length) {
-    avl_tree_free_helper (tree->root->right, free_key_fun);
+  unsigned long old = __atomic_load_n (&rec->counter[i], __ATOMIC_RELAXED);
+
+  while (n > old
+         && !__atomic_compare_exchange_n (&rec->counter[i], &old, n, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+#ifndef NO_THREAD
+/* one key for the whole process, it holds the shard number plus one */
+static pthread_once_t avl_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t avl_stats_key;
+static int avl_stats_key_ok;
+static unsigned long avl_stats_threads;
+
+static void
+avl_stats_init (void)
+{
+  avl_stats_key_ok = pthread_key_create (&avl_stats_key, NULL) == 0;
+}
+
+static avl_stats_record *
+avl_stats_record_get (struct _avl_stats * stats)
+{
+  unsigned long shard;
+
+  pthread_once (&avl_stats_once, avl_stats_init);
+  /* without a key all threads share the first record */
+  if (!avl_stats_key_ok)
+    return &stats->record[0];
+
+  shard = (unsigned long) pthread_getspecific (avl_stats_key);
+  if (!shard) {
+    shard = __atomic_fetch_add (&avl_stats_threads, 1, __ATOMIC_RELAXED) % AVL_STATS_SHARDS + 1;
+    pthread_setspecific (avl_stats_key, (void *) shard);
   }
-  if (tree->root) {
-#ifdef HAVE_AVL_NODE_LOCK
-    thread_rwlock_destroy(&tree->root->rwlock);
+  return &stats->record[shard - 1];
+}
+#else
+#define avl_stats_record_get(stats) (&(stats)->record[0])
 #endif
-    free (tree->root);
+
+/* a search that called compare_fun <compares> times and got to <depth> */
+
+static void
+avl_stats_lookup (avl_tree * tree, unsigned long compares, unsigned long depth)
+{
+  avl_stats_record * rec = avl_stats_record_get (tree->stats);
+
+  AVL_STATS_ADD (rec, AVL_STAT_LOOKUPS, 1);
+  AVL_STATS_ADD (rec, AVL_STAT_COMPARES, compares);
+  avl_stats_max (rec, AVL_STAT_MAX_DEPTH, depth);
+}
+
+/* <counter> is AVL_STAT_INSERTS or _DELETES, <depth> is 0 for deletes */
+
+static void
+avl_stats_change (avl_tree * tree, int counter, unsigned long depth, unsigned long rotations)
+{
+  avl_stats_record * rec = avl_stats_record_get (tree->stats);
+
+  AVL_STATS_ADD (rec, counter, 1);
+  AVL_STATS_ADD (rec, AVL_STAT_ROTATIONS, rotations);
+  avl_stats_max (rec, AVL_STAT_MAX_DEPTH, depth);
+}
+
+static unsigned long
+avl_node_depth (avl_tree * tree, avl_node * x)
+{
+  unsigned long depth = 0;
+
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  /* other writers may be rotating above the nodes we hold */
+  return 0;
+#endif
+  for (; x != tree->root; x = x->parent)
+    depth++;
+  return depth;
+}
+
+#ifndef NO_THREAD
+/* take the tree lock, clocking how long we wait if it is taken */
+
+static void
+avl_stats_lock (avl_tree * tree, int write)
+{
+  struct timespec start, end;
+  avl_stats_record * rec;
+
+  if ((write ? thread_rwlock_trywlock (&tree->rwlock) : thread_rwlock_tryrlock (&tree->rwlock)) == 0)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if (write) {
+    thread_rwlock_wlock (&tree->rwlock);
+  } else {
+    thread_rwlock_rlock (&tree->rwlock);
   }
-  thread_rwlock_destroy(&tree->rwlock);
-  free (tree);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  rec = avl_stats_record_get (tree->stats);
+  AVL_STATS_ADD (rec, AVL_STAT_LOCK_WAITS, 1);
+  AVL_STATS_ADD (rec, AVL_STAT_LOCK_WAIT_NS,
+                 (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec);
+}
+#endif
+
+static void
+avl_stats_free (avl_tree * tree)
+{
+  struct _avl_stats * stats = tree->stats;
+
+  if (!stats)
+    return;
+  tree->stats = NULL;
+  free (stats);
 }
 
 int
-avl_insert (avl_tree * ob,
-           void * key)
+avl_tree_set_stats (avl_tree * tree, int enable)
 {
-  if (!(ob->root->right)) {
-    avl_node * node = avl_node_new (key, ob->root);
-    if (!node) {
-      return -1;
-    } else {
-      ob->root->right = node;
-      ob->length = ob->length + 1;
-      return 0;
-    }
-  } else { /* not self.right == None */
-    avl_node *t, *p, *s, *q, *r;
-    int a;
+  if (enable && AVL_PROMOTE_FAILED (tree))
+    return -1;
+  if (tree->flags & AVL_TREE_ENGINE)
+    return -1;
 
-    t = ob->root;
-    s = p = t->right;
+  avl_stats_free (tree);
+  if (!enable)
+    return 0;
 
-    while (1) {
-      if (ob->compare_fun (ob->compare_arg, key, p->key) < 1) {
-    /* move left */
-    AVL_SET_RANK (p, (AVL_GET_RANK (p) + 1));
-    q = p->left;
-    if (!q) {
-      /* insert */
-      avl_node * q_node = avl_node_new (key, p);
-      if (!q_node) {
-        return (-1);
-      } else {
-        q = q_node;
-        p->left = q;
-        break;
-      }
-    } else if (AVL_GET_BALANCE(q)) {
-      t = p;
-      s = q;
-    }
-    p = q;
-      } else {
-    /* move right */
-    q = p->right;
-    if (!q) {
-      /* insert */
-      avl_node * q_node = avl_node_new (key, p);
-      if (!q_node) {
-        return -1;
+  tree->stats = (struct _avl_stats *) calloc (1, sizeof (struct _avl_stats));
+  if (!tree->stats)
+    return -1;
+  return 0;
+}
+
+int
+avl_tree_get_stats (avl_tree * tree, avl_tree_stats * stats)
+{
+  unsigned long sum[AVL_STAT_COUNT];
+  int shard, i;
+
+  if (!tree->stats)
+    return -1;
+
+  memset (sum, 0, sizeof (sum));
+  for (shard = 0; shard < AVL_STATS_SHARDS; shard++) {
+    avl_stats_record * rec = &tree->stats->record[shard];
+
+    for (i = 0; i < AVL_STAT_COUNT; i++) {
+      unsigned long v = __atomic_load_n (&rec->counter[i], __ATOMIC_RELAXED);
+
+      if (i == AVL_STAT_MAX_DEPTH) {
+        if (v > sum[i])
+          sum[i] = v;
       } else {
-        q = q_node;
-        p->right = q;
-        break;
-      }
-    } else if (AVL_GET_BALANCE(q)) {
-      t = p;
-      s = q;
-    }
-    p = q;
+        sum[i] += v;
       }
     }
-    
-    ob->length = ob->length + 1;
-    
-    /* adjust balance factors */
-    if (ob->compare_fun (ob->compare_arg, key, s->key) < 1) {
-      r = p = s->left;
-    } else {
-      r = p = s->right;
-    }
-    while (p != q) {
-      if (ob->compare_fun (ob->compare_arg, key, p->key) < 1) {
-    AVL_SET_BALANCE (p, -1);
-    p = p->left;
-      } else {
-    AVL_SET_BALANCE (p, +1);
-    p = p->right;
-      }
-    }
-    
-    /* balancing act */
-    
-    if (ob->compare_fun (ob->compare_arg, key, s->key) < 1) {
-      a = -1;
-    } else {
-      a = +1;
-    }
-    
-    if (AVL_GET_BALANCE (s) == 0) {
-      AVL_SET_BALANCE (s, a);
-      ob->height = ob->height + 1;
-      return 0;
-    } else if (AVL_GET_BALANCE (s) == -a) {
-      AVL_SET_BALANCE (s, 0);
-      return 0;
-    } else if (AVL_GET_BALANCE(s) == a) {
-      if (AVL_GET_BALANCE (r) == a) {
-    /* single rotation */
-    p = r;
-    if (a == -1) {
-      s->left = r->right;
-      if (r->right) {
-        r->right->parent = s;
-      }
-      r->right = s;
-      s->parent = r;
-      AVL_SET_RANK (s, (AVL_GET_RANK (s) - AVL_GET_RANK (r)));
-    } else {
-      s->right = r->left;
-      if (r->left) {
-        r->left->parent = s;
-      }
-      r->left = s;
-      s->parent = r;
-      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (s)));
-    }
-    AVL_SET_BALANCE (s, 0);
-    AVL_SET_BALANCE (r, 0);
-      } else if (AVL_GET_BALANCE (r) == -a) {
-    /* double rotation */
-    if (a == -1) {
-      p = r->right;
-      r->right = p->left;
-      if (p->left) {
-        p->left->parent = r;
-      }
-      p->left = r;
-      r->parent = p;
-      s->left = p->right;
-      if (p->right) {
-        p->right->parent = s;
-      }
-      p->right = s;
-      s->parent = p;
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) + AVL_GET_RANK (r)));
-      AVL_SET_RANK (s, (AVL_GET_RANK (s) - AVL_GET_RANK (p)));
-    } else {
-      p = r->left;
-      r->left = p->right;
-      if (p->right) {
-        p->right->parent = r;
-      }
-      p->right = r;
-      r->parent = p;
-      s->right = p->left;
-      if (p->left) {
-        p->left->parent = s;
-      }
-      p->left = s;
-      s->parent = p;
-      AVL_SET_RANK (r, (AVL_GET_RANK (r) - AVL_GET_RANK (p)));
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) + AVL_GET_RANK (s)));
-    }
-    if (AVL_GET_BALANCE (p) == a) {
-      AVL_SET_BALANCE (s, -a);
-      AVL_SET_BALANCE (r, 0);
-    } else if (AVL_GET_BALANCE (p) == -a) {
-      AVL_SET_BALANCE (s, 0);
-      AVL_SET_BALANCE (r, a);
-    } else {
-      AVL_SET_BALANCE (s, 0);
-      AVL_SET_BALANCE (r, 0);
-    }
-    AVL_SET_BALANCE (p, 0);
-      }
-      /* finishing touch */
-      if (s == t->right) {
-    t->right = p;
-      } else {
-    t->left = p;
-      }
-      p->parent = t;
-    }
   }
+
+  stats->lookups = sum[AVL_STAT_LOOKUPS];
+  stats->compares = sum[AVL_STAT_COMPARES];
+  stats->inserts = sum[AVL_STAT_INSERTS];
+  stats->deletes = sum[AVL_STAT_DELETES];
+  stats->rotations = sum[AVL_STAT_ROTATIONS];
+  stats->max_depth = sum[AVL_STAT_MAX_DEPTH];
+  stats->height = tree->height;
+  stats->lock_waits = sum[AVL_STAT_LOCK_WAITS];
+  stats->lock_wait_ns = sum[AVL_STAT_LOCK_WAIT_NS];
   return 0;
 }
 
-int
-avl_get_by_index (avl_tree * tree,
-           unsigned long index,
-           void ** value_address)
+/*
+ * Lockless read mode.
+ *
+ * Writers still take the write lock.  They also bump <seq> to an odd
+ * value while they change the tree and back to even when done.  Readers
+ * do not lock at all, they run their search and retry if <seq> changed
+ * meanwhile.  A reader may thus walk over nodes that are being moved
+ * around or were just removed, so removed nodes and keys are only
+ * released once the epoch says no reader can see them anymore.
+ *
+ * Trees with deferred frees, see avl_tree_set_deferred_free(), use the
+ * same retire list for their keys, their readers hold on to keys only.
+ */
+
+#define AVL_RECLAIM_BATCH (64)
+/* more steps than any balanced tree can have, we got lost in a rotation */
+#define AVL_LOCKLESS_MAX_STEPS (128)
+
+#define AVL_LOAD(x) __atomic_load_n (&(x), __ATOMIC_RELAXED)
+
+#ifndef NO_THREAD
+typedef struct avl_retired_tag {
+  struct avl_retired_tag *    next;
+  avl_node *            node;
+  void *                key;
+  avl_free_key_fun_type     free_key_fun;
+  unsigned long         tag;
+} avl_retired;
+
+struct _avl_lockless {
+  unsigned long         seq;
+};
+
+/* what was removed and waits for the readers */
+struct _avl_reclaim {
+  thread_epoch_t *      epoch;
+  avl_retired *         retired;
+  unsigned int          retired_count;
+};
+
+static void
+avl_write_begin (avl_tree * tree)
 {
-  avl_node * p = tree->root->right;
-  unsigned long m = index + 1;
-  while (1) {
-    if (!p) {
-      return -1;
-    }
-    if (m < AVL_GET_RANK(p)) {
-      p = p->left;
-    } else if (m > AVL_GET_RANK(p)) {
-      m = m - AVL_GET_RANK(p);
-      p = p->right;
+  if (tree->lockless) {
+    __atomic_store_n (&tree->lockless->seq, tree->lockless->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+  }
+}
+
+static void
+avl_write_end (avl_tree * tree)
+{
+  if (tree->lockless) {
+    __atomic_store_n (&tree->lockless->seq, tree->lockless->seq + 1, __ATOMIC_RELEASE);
+  }
+}
+
+static unsigned long
+avl_read_begin (avl_tree * tree)
+{
+  unsigned long seq;
+
+  while ((seq = __atomic_load_n (&tree->lockless->seq, __ATOMIC_ACQUIRE)) & 1UL) {
+    /* a writer is busy */
+  }
+  return seq;
+}
+
+/* did the tree change since avl_read_begin() returned <seq>? */
+
+static int
+avl_read_retry (avl_tree * tree, unsigned long seq)
+{
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return __atomic_load_n (&tree->lockless->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static void
+avl_reclaim (avl_tree * tree, int all)
+{
+  avl_retired ** p = &tree->reclaim->retired;
+  unsigned long safe;
+
+  if (all) {
+    thread_epoch_synchronize (tree->reclaim->epoch);
+  }
+  safe = thread_epoch_safe (tree->reclaim->epoch);
+
+  while (*p) {
+    avl_retired * r = *p;
+    if (r->tag < safe) {
+      *p = r->next;
+      if (r->node)
+        avl_tree_node_free (tree, r->node);
+      if (r->free_key_fun)
+        r->free_key_fun (r->key);
+      free (r);
+      tree->reclaim->retired_count--;
     } else {
-      *value_address = p->key;
-      return 0;
+      p = &r->next;
     }
   }
 }
-           
-int
-avl_get_by_key (avl_tree * tree,
-         void * key,
-         void **value_address)
+
+/* hand <node> and <key> over for release once no reader can see them */
+
+static void
+avl_retire (avl_tree * tree, avl_node * node, void * key, avl_free_key_fun_type free_key_fun)
 {
-  avl_node * x = tree->root->right;
-  if (!x) {
-    return -1;
+  avl_retired * r = (avl_retired *) malloc (sizeof (avl_retired));
+
+  if (!r) {
+    /* no memory to remember it, wait for the readers instead */
+    thread_epoch_synchronize (tree->reclaim->epoch);
+    if (node)
+      avl_tree_node_free (tree, node);
+    if (free_key_fun)
+      free_key_fun (key);
+    return;
   }
-  while (1) {
-    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
-    if (compare_result < 0) {
-      if (x->left) {
-    x = x->left;
-      } else {
+
+  r->node = node;
+  r->key = key;
+  r->free_key_fun = free_key_fun;
+  r->tag = thread_epoch_current (tree->reclaim->epoch);
+  r->next = tree->reclaim->retired;
+  tree->reclaim->retired = r;
+
+  if (++tree->reclaim->retired_count >= AVL_RECLAIM_BATCH)
+    avl_reclaim (tree, 0);
+}
+
+/* set up the retire list with <epoch>, or keep the one there is */
+
+static int
+avl_reclaim_new (avl_tree * tree, thread_epoch_t * epoch)
+{
+  if (tree->reclaim)
+    return (!epoch || epoch == tree->reclaim->epoch) ? 0 : -1;
+
+  if (!epoch)
+    epoch = thread_epoch_default ();
+  if (!epoch)
     return -1;
-      }
-    } else if (compare_result > 0) {
-      if (x->right) {
-    x = x->right;
-      } else {
+
+  tree->reclaim = (struct _avl_reclaim *) calloc (1, sizeof (struct _avl_reclaim));
+  if (!tree->reclaim)
     return -1;
-      }
+  tree->reclaim->epoch = epoch;
+  return 0;
+}
+
+enum {
+  AVL_SEEK_EXACT,   /* the key itself */
+  AVL_SEEK_MOST,    /* the biggest one <= key */
+  AVL_SEEK_LEAST,   /* the smallest one >= key */
+  AVL_SEEK_AFTER,   /* the smallest one > key */
+  AVL_SEEK_FIRST    /* the smallest one in the tree */
+};
+
+/*
+ * One optimistic descent.  Writers may change the tree under our feet,
+ * so all we promise is not to loop forever.  The caller validates the
+ * result against the sequence counter.
+ */
+
+static avl_node *
+avl_lockless_descend (avl_tree * tree, void * key, int mode, int * lost, int * depth)
+{
+  avl_node * x = AVL_LOAD (tree->root->right);
+  avl_node * candidate = NULL;
+  int steps = 0;
+
+  *depth = 0;
+
+  while (x) {
+    int compare_result;
+
+    if (++steps > AVL_LOCKLESS_MAX_STEPS) {
+      *lost = 1;
+      return NULL;
+    }
+
+    if (mode == AVL_SEEK_FIRST) {
+      candidate = x;
+      x = AVL_LOAD (x->left);
+      continue;
+    }
+
+    *depth = steps;
+    compare_result = tree->compare_fun (tree->compare_arg, key, AVL_LOAD (x->key));
+    if (compare_result == 0 && mode != AVL_SEEK_AFTER) {
+      return x;
+    } else if (compare_result < 0) {
+      if (mode == AVL_SEEK_LEAST || mode == AVL_SEEK_AFTER)
+        candidate = x;
+      x = AVL_LOAD (x->left);
     } else {
-      *value_address = x->key;
-      return 0;
+      if (mode == AVL_SEEK_MOST)
+        candidate = x;
+      x = AVL_LOAD (x->right);
     }
   }
+  return candidate;
 }
 
-int avl_delete(avl_tree *tree, void *key, avl_free_key_fun_type free_key_fun)
+/* descend until we get a result no writer interfered with */
+
+static avl_node *
+avl_lockless_seek (avl_tree * tree, void * key, int mode, void ** key_address, unsigned long * seq_address)
 {
-  avl_node *x, *y, *p, *q, *r, *top, *x_child;
-  int shortened_side, shorter;
-  
-  x = tree->root->right;
-  if (!x) {
-    return -1;
-  }
+  unsigned long compares = 0;
+
   while (1) {
-    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
-    if (compare_result < 0) {
-      /* move left
-       * We will be deleting from the left, adjust this node's
-       * rank accordingly
-       */
-      AVL_SET_RANK (x, (AVL_GET_RANK(x) - 1));
-      if (x->left) {
-    x = x->left;
-      } else {
-    /* Oops! now we have to undo the rank changes
-     * all the way up the tree
-     */
-    AVL_SET_RANK(x, (AVL_GET_RANK (x) + 1));
-    while (x != tree->root->right) {
-      if (x->parent->left == x) {
-        AVL_SET_RANK(x->parent, (AVL_GET_RANK (x->parent) + 1));
+    unsigned long seq = avl_read_begin (tree);
+    int lost = 0, depth;
+    avl_node * x = avl_lockless_descend (tree, key, mode, &lost, &depth);
+    void * x_key = x ? AVL_LOAD (x->key) : NULL;
+
+    compares += depth;
+    if (lost || avl_read_retry (tree, seq))
+      continue;
+
+    if (tree->stats && mode != AVL_SEEK_FIRST)
+      avl_stats_lookup (tree, compares, depth);
+
+    if (key_address)
+      *key_address = x_key;
+    if (seq_address)
+      *seq_address = seq;
+    return x;
+  }
+}
+
+/* avl_get_next() with the loads and step limit of avl_lockless_descend() */
+
+static avl_node *
+avl_lockless_next (avl_node * node, int * lost)
+{
+  avl_node * x = AVL_LOAD (node->right);
+  int steps = 0;
+
+  if (x) {
+    avl_node * l;
+    while ((l = AVL_LOAD (x->left))) {
+      if (++steps > AVL_LOCKLESS_MAX_STEPS) {
+        *lost = 1;
+        return NULL;
       }
-      x = x->parent;
+      x = l;
     }
-    return -1;        /* key not in tree */
-      }
-    } else if (compare_result > 0) {
-      /* move right */
-      if (x->right) {
-    x = x->right;
-      } else {
-    AVL_SET_RANK(x, (AVL_GET_RANK (x) + 1));
-    while (x != tree->root->right) {
-      if (x->parent->left == x) {
-        AVL_SET_RANK(x->parent, (AVL_GET_RANK (x->parent) + 1));
-      }
-      x = x->parent;
+    return x;
+  }
+
+  while (1) {
+    avl_node * parent = AVL_LOAD (node->parent);
+    if (!parent || ++steps > AVL_LOCKLESS_MAX_STEPS) {
+      *lost = 1;
+      return NULL;
     }
-    return -1;        /* key not in tree */
-      }
-    } else {
+    if (AVL_LOAD (parent->left) == node)
       break;
-    }
+    node = parent;
   }
+  node = AVL_LOAD (node->parent);
+  /* the sentinel root has no key */
+  return AVL_LOAD (node->key) ? node : NULL;
+}
 
-  if (x->left && x->right) {
-    void * temp_key;
+/*
+ * In order walk without the lock.  As long as the tree did not change
+ * since we found the current node we simply step to its successor,
+ * otherwise we search for the key after the last one again.
+ */
 
-    /* The complicated case.
-     * reduce this to the simple case where we are deleting
-     * a node with at most one child.
-     */
-    
-    /* find the immediate predecessor <y> */
-    y = x->left;
-    while (y->right) {
-      y = y->right;
+static int
+avl_lockless_iterate (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  unsigned long seq;
+  void * key;
+  avl_node * x = avl_lockless_seek (tree, NULL, AVL_SEEK_FIRST, &key, &seq);
+
+  while (x) {
+    int result = iter_fun (key, iter_arg);
+    int lost = 0;
+    avl_node * next;
+    void * next_key = NULL;
+
+    if (result != 0)
+      return result;
+
+    next = avl_lockless_next (x, &lost);
+    if (next)
+      next_key = AVL_LOAD (next->key);
+    if (!lost && !avl_read_retry (tree, seq)) {
+      x = next;
+      key = next_key;
+    } else {
+      x = avl_lockless_seek (tree, key, AVL_SEEK_AFTER, &key, &seq);
     }
-    /* swap <x> with <y> */
-    temp_key = x->key;
-    x->key = y->key;
-    y->key = temp_key;
-    /* we know <x>'s left subtree lost a node because that's
-     * where we took it from
-     */
-    AVL_SET_RANK (x, (AVL_GET_RANK (x) - 1));
-    x = y;
   }
-  /* now <x> has at most one child
-   * scoot this child into the place of <x>
-   */
-  if (x->left) {
-    x_child = x->left;
-    x_child->parent = x->parent;
-  } else if (x->right) {
-    x_child = x->right;
-    x_child->parent = x->parent;
+  return 0;
+}
+#else
+#define avl_write_begin(tree) do{}while(0)
+#define avl_write_end(tree) do{}while(0)
+#endif
+
+/*
+ * Hash side index, see avl_tree_set_hash().
+ *
+ * Open addressing with linear probing over a power of two number of
+ * slots, at most half of them used.  A slot keeps the hash next to the
+ * key so probing only calls the compare function on a likely match.
+ * The index holds keys, not nodes, so nodes that are copied for a
+ * snapshot or relinked by a batch do not concern it.
+ */
+
+#define AVL_HASH_MIN_SLOTS (16)
+
+typedef struct {
+  unsigned long         hash;
+  void *                key;
+} avl_hash_slot;
+
+struct _avl_hash {
+  avl_key_hash_fun_type hash_fun;
+  unsigned long         mask;
+  unsigned long         count;
+  avl_hash_slot *       slots;
+};
+
+static void
+avl_hash_put (struct _avl_hash * hash, unsigned long h, void * key)
+{
+  unsigned long i = h & hash->mask;
+
+  while (hash->slots[i].key)
+    i = (i + 1) & hash->mask;
+  hash->slots[i].hash = h;
+  hash->slots[i].key = key;
+  hash->count++;
+}
+
+/* make room for <extra> more keys, the only step that can fail */
+
+static int
+avl_hash_reserve (avl_tree * tree, unsigned long extra)
+{
+  struct _avl_hash * hash = tree->hash;
+  avl_hash_slot * old;
+  unsigned long size, i, old_size;
+
+  /* a hash set on a small tree has no slots until the tree is promoted */
+  if (!hash || (hash->slots && (hash->count + extra) * 2 <= hash->mask + 1))
+    return 0;
+
+  for (size = AVL_HASH_MIN_SLOTS; size < (hash->count + extra) * 2; size *= 2)
+    ;
+  old = hash->slots;
+  old_size = old ? hash->mask + 1 : 0;
+  hash->slots = (avl_hash_slot *) calloc (size, sizeof (avl_hash_slot));
+  if (!hash->slots) {
+    hash->slots = old;
+    return -1;
+  }
+  hash->mask = size - 1;
+  hash->count = 0;
+  for (i = 0; i < old_size; i++) {
+    if (old[i].key)
+      avl_hash_put (hash, old[i].hash, old[i].key);
+  }
+  free (old);
+  return 0;
+}
+
+static void
+avl_hash_add (avl_tree * tree, void * key)
+{
+  if (tree->hash)
+    avl_hash_put (tree->hash, tree->hash->hash_fun (tree->compare_arg, key), key);
+}
+
+/* takes out <key> itself, not just any key that compares equal */
+
+static void
+avl_hash_remove (avl_tree * tree, void * key)
+{
+  struct _avl_hash * hash = tree->hash;
+  unsigned long i, j, home;
+
+  if (!hash)
+    return;
+
+  i = hash->hash_fun (tree->compare_arg, key) & hash->mask;
+  while (hash->slots[i].key != key) {
+    if (!hash->slots[i].key)
+      return;
+    i = (i + 1) & hash->mask;
+  }
+
+  /* move later keys of the run back so no probe stops at the hole */
+  for (j = (i + 1) & hash->mask; hash->slots[j].key; j = (j + 1) & hash->mask) {
+    home = hash->slots[j].hash & hash->mask;
+    if (((j - home) & hash->mask) >= ((j - i) & hash->mask)) {
+      hash->slots[i] = hash->slots[j];
+      i = j;
+    }
+  }
+  hash->slots[i].key = NULL;
+  hash->count--;
+}
+
+static void *
+avl_hash_find (avl_tree * tree, void * key)
+{
+  struct _avl_hash * hash = tree->hash;
+  unsigned long h = hash->hash_fun (tree->compare_arg, key);
+  unsigned long i = h & hash->mask;
+
+  if (!hash->slots)
+    return NULL;
+  for (; hash->slots[i].key; i = (i + 1) & hash->mask) {
+    if (hash->slots[i].hash == h
+        && tree->compare_fun (tree->compare_arg, key, hash->slots[i].key) == 0)
+      return hash->slots[i].key;
+  }
+  return NULL;
+}
+
+static void
+avl_hash_free (avl_tree * tree)
+{
+  if (tree->hash) {
+    free (tree->hash->slots);
+    free (tree->hash);
+    tree->hash = NULL;
+  }
+}
+
+static int
+avl_hash_add_iter (void * key, void * iter_arg)
+{
+  avl_hash_add ((avl_tree *) iter_arg, key);
+  return 0;
+}
+
+int
+avl_tree_set_hash (avl_tree * tree, avl_key_hash_fun_type hash_fun)
+{
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  /* lock coupled readers do not take the tree lock the index needs */
+  if (hash_fun)
+    return -1;
+#endif
+  if ((tree->flags & (AVL_TREE_INTRUSIVE | AVL_TREE_ENGINE | AVL_TREE_SNAPSHOT))
+      && !(tree->flags & AVL_TREE_SMALL))
+    return -1;
+  if (tree->lockless)
+    return -1;
+
+  avl_hash_free (tree);
+  if (!hash_fun)
+    return 0;
+
+  tree->hash = (struct _avl_hash *) calloc (1, sizeof (struct _avl_hash));
+  if (!tree->hash)
+    return -1;
+  tree->hash->hash_fun = hash_fun;
+  /* a small tree is searched quickly enough, avl_promote() fills the index */
+  if (tree->flags & AVL_TREE_SMALL)
+    return 0;
+  if (avl_hash_reserve (tree, tree->length ? tree->length : 1) != 0) {
+    avl_hash_free (tree);
+    return -1;
+  }
+  avl_iterate_inorder (tree, avl_hash_add_iter, tree);
+  return 0;
+}
+
+/* a tree without even the sentinel root, which is up to the caller */
+
+static avl_tree *
+avl_tree_new_bare (avl_key_compare_fun_type compare_fun,
+          void * compare_arg)
+{
+  avl_tree * t = (avl_tree *) malloc (sizeof (avl_tree));
+
+  if (!t)
+    return NULL;
+
+  t->root = NULL;
+  t->height = 0;
+  t->length = 0;
+  t->compare_fun = compare_fun;
+  t->compare_arg = compare_arg;
+  t->pool = NULL;
+  t->flags = 0;
+  t->lockless = NULL;
+  t->reclaim = NULL;
+  t->engine_ops = NULL;
+  t->engine = NULL;
+  t->cow = NULL;
+  t->hash = NULL;
+  t->stats = NULL;
+  t->aggregates = NULL;
+  thread_rwlock_create(&t->rwlock);
+  return t;
+}
+
+avl_tree *
+avl_tree_new (avl_key_compare_fun_type compare_fun,
+          void * compare_arg)
+{
+  avl_tree * t = avl_tree_new_bare (compare_fun, compare_arg);
+
+  if (!t) {
+    return NULL;
   } else {
-    x_child = NULL;
+    avl_node * root = avl_node_new((void *)NULL, (avl_node *) NULL);
+    if (!root) {
+      avl_tree_free (t, NULL);
+      return NULL;
+    } else {
+      t->root = root;
+      return t;
+    }
   }
+}
+
+avl_tree *
+avl_tree_new_with_pool (avl_key_compare_fun_type compare_fun,
+          void * compare_arg,
+          avl_node_pool * pool)
+{
+  avl_tree * t = avl_tree_new (compare_fun, compare_arg);
 
-  /* now tell <x>'s parent that a grandchild became a child */
-  if (x == x->parent->left) {
-    x->parent->left = x_child;
-    shortened_side = -1;
+  if (!t)
+    return NULL;
+
+  if (pool) {
+    avl_node_pool_ref (pool);
   } else {
-    x->parent->right = x_child;
-    shortened_side = +1;
+    pool = avl_node_pool_new (0);
+    if (!pool) {
+      avl_tree_free (t, NULL);
+      return NULL;
+    }
   }
+  t->pool = pool;
 
-  /*
-   * the height of the subtree <x>
-   * has now been shortened.  climb back up
-   * the tree, rotating when necessary to adjust
-   * for the change.
-   */
-  shorter = 1;
-  p = x->parent;
+  return t;
+}
+
+avl_tree *
+avl_tree_new_intrusive (avl_key_compare_fun_type compare_fun,
+          void * compare_arg)
+{
+  avl_tree * t = avl_tree_new (compare_fun, compare_arg);
+
+  if (t)
+    t->flags |= AVL_TREE_INTRUSIVE;
+
+  return t;
+}
+
+avl_tree *
+avl_tree_new_augmented (avl_key_compare_fun_type compare_fun,
+          void * compare_arg,
+          const avl_augment * augment)
+{
+  avl_tree * t;
+
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  /* every write would have to lock its path up to the root */
+  return NULL;
+#endif
+  if (!augment->size || !augment->lift || !augment->combine)
+    return NULL;
+
+  t = avl_tree_new (compare_fun, compare_arg);
+  if (!t)
+    return NULL;
+
+  t->aggregates = (struct _avl_aggregates *) malloc (sizeof (struct _avl_aggregates) + augment->size);
+  if (!t->aggregates) {
+    avl_tree_free (t, NULL);
+    return NULL;
+  }
+  t->aggregates->ops = *augment;
+  t->aggregates->scratch = t->aggregates + 1;
+
+  return t;
+}
+
+static avl_tree *
+avl_tree_new_engine (avl_key_compare_fun_type compare_fun,
+          void * compare_arg,
+          const struct _avl_engine * engine_ops)
+{
+  avl_tree * t = avl_tree_new (compare_fun, compare_arg);
+
+  if (!t)
+    return NULL;
+
+  t->engine = engine_ops->create ();
+  if (!t->engine) {
+    avl_tree_free (t, NULL);
+    return NULL;
+  }
+  t->engine_ops = engine_ops;
+  t->flags |= AVL_TREE_ENGINE;
+
+  return t;
+}
+
+avl_tree *
+avl_tree_new_btree (avl_key_compare_fun_type compare_fun,
+          void * compare_arg)
+{
+  avl_tree * t = avl_tree_new_engine (compare_fun, compare_arg, &avl_btree_engine);
+
+  if (t)
+    t->height = 1;
+
+  return t;
+}
+
+avl_tree *
+avl_tree_new_compact (avl_key_compare_fun_type compare_fun,
+          void * compare_arg)
+{
+  return avl_tree_new_engine (compare_fun, compare_arg, &avl_compact_engine);
+}
+
+avl_tree *
+avl_tree_new_small (avl_key_compare_fun_type compare_fun,
+          void * compare_arg)
+{
+  avl_tree * t = avl_tree_new_bare (compare_fun, compare_arg);
+
+  if (!t)
+    return NULL;
+
+  t->engine = avl_small_new ();
+  if (!t->engine) {
+    avl_tree_free (t, NULL);
+    return NULL;
+  }
+  t->engine_ops = &avl_small_engine;
+  t->flags |= AVL_TREE_ENGINE | AVL_TREE_SMALL;
+
+  return t;
+}
+
+avl_tree *
+avl_tree_new_mapped (int fd,
+          avl_key_compare_fun_type compare_fun,
+          void * compare_arg)
+{
+  avl_tree * t = avl_tree_new (compare_fun, compare_arg);
+
+  if (!t)
+    return NULL;
+
+  t->engine = avl_mapped_open (t, fd);
+  if (!t->engine) {
+    avl_tree_free (t, NULL);
+    return NULL;
+  }
+  t->engine_ops = &avl_mapped_engine;
+  t->flags |= AVL_TREE_ENGINE;
+
+  return t;
+}
+
+avl_tree *
+avl_freeze (avl_tree * tree)
+{
+  avl_tree * t = avl_tree_new (tree->compare_fun, tree->compare_arg);
+
+  if (!t)
+    return NULL;
+
+  t->engine = avl_frozen_new (t, tree);
+  if (!t->engine) {
+    avl_tree_free (t, NULL);
+    return NULL;
+  }
+  t->engine_ops = &avl_frozen_engine;
+  t->flags |= AVL_TREE_ENGINE;
+
+  return t;
+}
+
+int
+avl_tree_set_lockless (avl_tree * tree, struct thread_epoch_tag * epoch)
+{
+#ifndef NO_THREAD
+  if (tree->lockless)
+    return 0;
+  if (AVL_PROMOTE_FAILED (tree))
+    return -1;
+  if ((tree->flags & AVL_TREE_ENGINE) || tree->hash)
+    return -1;
+
+  if (avl_reclaim_new (tree, epoch) != 0)
+    return -1;
+  tree->lockless = (struct _avl_lockless *) calloc (1, sizeof (struct _avl_lockless));
+  if (!tree->lockless)
+    return -1;
+
+  return 0;
+#else
+  (void) tree;
+  (void) epoch;
+  return -1;
+#endif
+}
+
+int
+avl_tree_set_deferred_free (avl_tree * tree, struct thread_epoch_tag * epoch)
+{
+#ifndef NO_THREAD
+  if (AVL_PROMOTE_FAILED (tree))
+    return -1;
+  /* engines free their keys themselves */
+  if (tree->flags & (AVL_TREE_ENGINE | AVL_TREE_SNAPSHOT))
+    return -1;
+
+  return avl_reclaim_new (tree, epoch);
+#else
+  (void) tree;
+  (void) epoch;
+  return -1;
+#endif
+}
+
+void
+avl_tree_read_enter (avl_tree * tree)
+{
+#ifndef NO_THREAD
+  if (tree->lockless) {
+    thread_epoch_enter (tree->reclaim->epoch);
+    return;
+  }
+#endif
+  avl_tree_rlock (tree);
+}
+
+void
+avl_tree_read_leave (avl_tree * tree)
+{
+#ifndef NO_THREAD
+  if (tree->lockless) {
+    thread_epoch_leave (tree->reclaim->epoch);
+    return;
+  }
+#endif
+  avl_tree_unlock (tree);
+}
   
-  /* return the key and node to storage */
-  if (free_key_fun)
-      free_key_fun (x->key);
+static void
+avl_tree_free_helper (avl_tree * tree, avl_node * node, avl_free_key_fun_type free_key_fun, int release_nodes)
+{
+  avl_node * right = node->right;
+  void * key = node->key;
+
+  if (node->left) {
+    avl_tree_free_helper (tree, node->left, free_key_fun, release_nodes);
+  }
+  if (release_nodes) {
+    avl_tree_node_free (tree, node);
+  }
 #ifdef HAVE_AVL_NODE_LOCK
-  thread_rwlock_destroy (&x->rwlock);
+  else {
+    thread_rwlock_destroy (&node->rwlock);
+  }
 #endif
-  free (x);
+  if (free_key_fun)
+      free_key_fun (key);
+  if (right) {
+    avl_tree_free_helper (tree, right, free_key_fun, release_nodes);
+  }
+}
+  
+/* number of levels in a tree of <n> nodes built by avl_build_sorted() */
 
-  while (shorter && p->parent) {
-    
-    /* case 1: height unchanged */
-    if (AVL_GET_BALANCE(p) == 0) {
-      if (shortened_side == -1) {
-    /* we removed a left child, the tree is now heavier
-     * on the right
-     */
+static unsigned int
+avl_sorted_height (unsigned long n)
+{
+  unsigned int h = 0;
+
+  while (n) {
+    h++;
+    n >>= 1;
+  }
+  return h;
+}
+
+/*
+ * Build a perfectly balanced subtree out of <keys>[0..n-1].  The lower
+ * half goes to the left, so the right side is never shorter and the
+ * balance factor of every node is either 0 or +1.
+ */
+
+static avl_node *
+avl_build_sorted_helper (avl_tree * tree, void ** keys, unsigned long n, avl_node * parent)
+{
+  unsigned long num_left = (n - 1) / 2;
+  unsigned long num_right = n - 1 - num_left;
+  avl_node * node = avl_tree_node_new (tree, keys[num_left], parent);
+
+  if (!node)
+    return NULL;
+
+  AVL_SET_RANK (node, (num_left + 1));
+  AVL_SET_BALANCE (node, (int) (avl_sorted_height (num_right) - avl_sorted_height (num_left)));
+
+  if (num_left) {
+    node->left = avl_build_sorted_helper (tree, keys, num_left, node);
+    if (!node->left) {
+      avl_tree_node_free (tree, node);
+      return NULL;
+    }
+  }
+  if (num_right) {
+    node->right = avl_build_sorted_helper (tree, keys + num_left + 1, num_right, node);
+    if (!node->right) {
+      if (node->left)
+        avl_tree_free_helper (tree, node->left, NULL, 1);
+      avl_tree_node_free (tree, node);
+      return NULL;
+    }
+  }
+  return node;
+}
+
+/* fill the empty <tree> with the <n> sorted <keys> in O(n) */
+
+static int
+avl_build_sorted (avl_tree * tree, void ** keys, unsigned long n)
+{
+  avl_node * top;
+
+  if (tree->length)
+    return -1;
+  if (!n)
+    return 0;
+
+  top = avl_build_sorted_helper (tree, keys, n, tree->root);
+  if (!top)
+    return -1;
+
+  avl_write_begin (tree);
+  tree->root->right = top;
+  tree->length = n;
+  tree->height = avl_sorted_height (n);
+  avl_write_end (tree);
+  return 0;
+}
+
+/* turn the small <tree> into a real one, it is left alone if memory runs out */
+
+static int
+avl_promote (avl_tree * tree)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long n = tree->length, i;
+
+  if (avl_hash_reserve (tree, n) != 0)
+    return -1;
+  tree->root = avl_node_new (NULL, NULL);
+  if (!tree->root)
+    return -1;
+
+  tree->flags &= ~(AVL_TREE_ENGINE | AVL_TREE_SMALL);
+  tree->length = 0;
+  tree->height = 0;
+  if (avl_build_sorted (tree, keys, n) != 0) {
+#ifdef HAVE_AVL_NODE_LOCK
+    thread_rwlock_destroy(&tree->root->rwlock);
+#endif
+    free (tree->root);
+    tree->root = NULL;
+    tree->flags |= AVL_TREE_ENGINE | AVL_TREE_SMALL;
+    tree->length = n;
+    tree->height = n ? 1 : 0;
+    return -1;
+  }
+  for (i = 0; i < n; i++)
+    avl_hash_add (tree, keys[i]);
+  free (keys);
+  tree->engine = NULL;
+  tree->engine_ops = NULL;
+  return 0;
+}
+
+avl_tree *
+avl_tree_new_from_sorted (avl_key_compare_fun_type compare_fun,
+          void * compare_arg,
+          void ** keys,
+          unsigned long n)
+{
+  avl_tree * t;
+  unsigned long i;
+
+  for (i = 1; i < n; i++) {
+    if (compare_fun (compare_arg, keys[i - 1], keys[i]) > 0)
+      return NULL;
+  }
+
+  t = avl_tree_new (compare_fun, compare_arg);
+  if (!t)
+    return NULL;
+
+  if (avl_build_sorted (t, keys, n) != 0) {
+    avl_tree_free (t, NULL);
+    return NULL;
+  }
+
+  return t;
+}
+
+void
+avl_tree_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+{
+  /* If we are the only user of our pool the slabs go away in one go,
+   * there is no point in putting every single node back first.
+   */
+  int release_nodes = !tree->pool || AVL_POOL_SHARED (tree->pool);
+
+  if (tree->flags & AVL_TREE_SNAPSHOT) {
+    avl_snapshot_free (tree);
+    return;
+  }
+  if (tree->cow) {
+    avl_cow_reclaim (tree);
+    free (tree->cow);
+    tree->cow = NULL;
+  }
+  avl_hash_free (tree);
+  avl_stats_free (tree);
+  free (tree->aggregates);
+
+  if (tree->engine) {
+    AVL_ENGINE (tree)->destroy (tree, free_key_fun);
+    tree->length = 0;
+  }
+
+#ifndef NO_THREAD
+  if (tree->reclaim) {
+    avl_reclaim (tree, 1);
+    free (tree->reclaim);
+    tree->reclaim = NULL;
+  }
+  free (tree->lockless);
+  tree->lockless = NULL;
+#endif
+
+  if (tree->length) {
+    if (free_key_fun || release_nodes) {
+      avl_tree_free_helper (tree, tree->root->right, free_key_fun, release_nodes);
+    }
+#ifdef HAVE_AVL_NODE_LOCK
+    else {
+      avl_tree_free_helper (tree, tree->root->right, NULL, 0);
+    }
+#endif
+  }
+  if (tree->root) {
+#ifdef HAVE_AVL_NODE_LOCK
+    thread_rwlock_destroy(&tree->root->rwlock);
+#endif
+    free (tree->root);
+  }
+  if (tree->pool) {
+    avl_node_pool_free (tree->pool);
+  }
+  thread_rwlock_destroy(&tree->rwlock);
+  free (tree);
+}
+
+/* link the fresh <node> holding <key> into the tree */
+
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+/*
+ * Fine grained locking.
+ *
+ * Readers walk the tree hand over hand, holding the read lock of at
+ * most two neighbouring nodes at a time, so they only wait for writers
+ * working on the very same nodes.  Writers are still serialized by the
+ * tree lock.  Before changing anything a writer works out every node
+ * whose links it is going to touch and write locks all of them.  Readers
+ * may also walk upwards, so no lock order exists.  A writer waits for the
+ * topmost node of its set, which every reader coming down into the part
+ * of the tree it changes has to pass, and only tries the others.  If one
+ * is taken it drops all of them and starts over, readers never hold on
+ * to their locks for long.  Ranks and balance factors are not read by
+ * lock coupled readers and are updated without node locks.
+ */
+
+/* more than enough for the deepest possible tree */
+#define AVL_LOCK_SET_MAX (16 + 8 * 64)
+
+typedef struct {
+  unsigned int      count;
+  avl_node *        nodes[AVL_LOCK_SET_MAX];
+} avl_lock_set;
+
+static void
+avl_lock_set_add (avl_lock_set * set, avl_node * node)
+{
+  unsigned int i;
+
+  if (!node)
+    return;
+  for (i = 0; i < set->count; i++) {
+    if (set->nodes[i] == node)
+      return;
+  }
+  set->nodes[set->count++] = node;
+}
+
+/* writers are serialized, so the parent links can't change meanwhile */
+
+static unsigned int
+avl_lock_depth (avl_node * node)
+{
+  unsigned int depth = 0;
+
+  for (; node->parent; node = node->parent)
+    depth++;
+  return depth;
+}
+
+static void
+avl_lock_set_acquire (avl_lock_set * set)
+{
+  unsigned int depth[AVL_LOCK_SET_MAX];
+  unsigned int i, j;
+
+  if (!set->count)
+    return;
+
+  /* top down */
+  for (i = 0; i < set->count; i++) {
+    avl_node * node = set->nodes[i];
+    unsigned int d = avl_lock_depth (node);
+
+    for (j = i; j > 0 && depth[j - 1] > d; j--) {
+      depth[j] = depth[j - 1];
+      set->nodes[j] = set->nodes[j - 1];
+    }
+    depth[j] = d;
+    set->nodes[j] = node;
+  }
+
+  while (1) {
+    /* holding nothing else, so waiting here can't deadlock */
+    thread_rwlock_wlock (&set->nodes[0]->rwlock);
+    for (i = 1; i < set->count; i++) {
+      if (thread_rwlock_trywlock (&set->nodes[i]->rwlock) != 0)
+        break;
+    }
+    if (i == set->count)
+      return;
+    while (i--) {
+      thread_rwlock_unlock (&set->nodes[i]->rwlock);
+    }
+    thread_sleep (0);
+  }
+}
+
+static void
+avl_lock_set_release (avl_lock_set * set)
+{
+  unsigned int i;
+
+  for (i = 0; i < set->count; i++) {
+    thread_rwlock_unlock (&set->nodes[i]->rwlock);
+  }
+}
+
+/*
+ * <node> is about to become the <direction> child of <parent>.  Collect
+ * <parent> and, if the retrace is going to rotate, the nodes involved.
+ * This mirrors avl_link_node_ranked() on the unchanged tree.
+ */
+
+static void
+avl_lock_set_grow (avl_lock_set * set, avl_tree * tree, avl_node * parent, int direction, avl_node * node)
+{
+  avl_node *c, *p;
+  int side = direction < 0 ? -1 : +1;
+  int c_balance = 0;
+
+  avl_lock_set_add (set, parent);
+
+  c = node;
+  p = parent;
+  while (p != tree->root) {
+    if (AVL_GET_BALANCE (p) == 0) {
+      /* p grows towards <side> and we move on */
+      c_balance = side;
+      c = p;
+      p = p->parent;
+      side = (p->left == c) ? -1 : +1;
+    } else if (AVL_GET_BALANCE (p) == (- side)) {
+      return;
+    } else {
+      avl_node * inner = (side == -1) ? c->right : c->left;
+
+      avl_lock_set_add (set, p->parent);
+      avl_lock_set_add (set, p);
+      /* <node> is not linked yet and would spoil the top down order */
+      if (c != node)
+        avl_lock_set_add (set, c);
+      if (inner == node) {
+        /* not linked yet, nobody else can see it */
+        return;
+      }
+      avl_lock_set_add (set, inner);
+      if (c_balance != side && inner) {
+        /* double rotation, the children of <inner> move as well */
+        avl_lock_set_add (set, inner->left);
+        avl_lock_set_add (set, inner->right);
+      }
+      return;
+    }
+  }
+}
+
+/*
+ * Collect the nodes avl_unlink_node() is going to touch for <x>.  While
+ * working out the retrace we pretend the predecessor <y> already took
+ * the place of <x>, that's what the helpers below are for.
+ */
+
+static avl_node *
+avl_lock_virt_parent (avl_node * n, avl_node * x, avl_node * y)
+{
+  if (y && n == y)
+    return x->parent;
+  if (y && n->parent == x)
+    return y;
+  return n->parent;
+}
+
+static avl_node *
+avl_lock_virt_child (avl_node * n, int side, avl_node * x, avl_node * y)
+{
+  avl_node * c;
+
+  if (y && n == y) {
+    if (side == +1)
+      return x->right;
+    return (y == x->left) ? y->left : x->left;
+  }
+  c = (side == -1) ? n->left : n->right;
+  return (y && c == x) ? y : c;
+}
+
+static void
+avl_lock_set_unlink (avl_lock_set * set, avl_node * x)
+{
+  avl_node *y = NULL, *p, *top, *q, *inner;
+  int side, balance;
+
+  avl_lock_set_add (set, x->parent);
+  avl_lock_set_add (set, x);
+  avl_lock_set_add (set, x->left);
+  avl_lock_set_add (set, x->right);
+
+  if (x->left && x->right) {
+    /* <y> is moved up past the whole right spine of the left subtree,
+     * keep readers off it so they neither miss <y> nor see it twice
+     */
+    y = x->left;
+    while (y->right) {
+      avl_lock_set_add (set, y);
+      y = y->right;
+    }
+    avl_lock_set_add (set, y);
+    if (y == x->left) {
+      p = y;
+      side = -1;
+    } else {
+      avl_lock_set_add (set, y->parent);
+      avl_lock_set_add (set, y->left);
+      p = y->parent;
+      side = +1;
+    }
+  } else {
+    p = x->parent;
+    side = (x == p->left) ? -1 : +1;
+  }
+
+  while (avl_lock_virt_parent (p, x, y)) {
+    balance = (y && p == y) ? AVL_GET_BALANCE (x) : AVL_GET_BALANCE (p);
+    top = avl_lock_virt_parent (p, x, y);
+
+    if (balance == 0) {
+      return;
+    } else if (balance != side) {
+      q = avl_lock_virt_child (p, - side, x, y);
+      inner = (side == -1) ? q->left : q->right;
+      avl_lock_set_add (set, top);
+      avl_lock_set_add (set, p);
+      avl_lock_set_add (set, q);
+      avl_lock_set_add (set, inner);
+      if (AVL_GET_BALANCE (q) == 0) {
+        return;
+      } else if (AVL_GET_BALANCE (q) != balance && inner) {
+        avl_lock_set_add (set, inner->left);
+        avl_lock_set_add (set, inner->right);
+      }
+    }
+    side = (avl_lock_virt_child (top, -1, x, y) == p) ? -1 : +1;
+    p = top;
+  }
+}
+
+/* one hand over hand descent, returns the key found or NULL */
+
+static void *
+avl_coupled_seek (avl_tree * tree, void * key, int mode)
+{
+  avl_node * parent = tree->root;
+  avl_node * x;
+  void * candidate = NULL;
+  unsigned long depth = 0;
+
+  thread_rwlock_rlock (&parent->rwlock);
+  x = parent->right;
+  while (x) {
+    int compare_result;
+
+    thread_rwlock_rlock (&x->rwlock);
+    thread_rwlock_unlock (&parent->rwlock);
+    parent = x;
+    depth++;
+
+    compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (compare_result == 0) {
+      candidate = x->key;
+      break;
+    } else if (compare_result < 0) {
+      if (mode == AVL_SEEK_LEAST)
+        candidate = x->key;
+      x = x->left;
+    } else {
+      if (mode == AVL_SEEK_MOST)
+        candidate = x->key;
+      x = x->right;
+    }
+  }
+  thread_rwlock_unlock (&parent->rwlock);
+  if (tree->stats)
+    avl_stats_lookup (tree, depth, depth);
+  return candidate;
+}
+
+avl_node *
+avl_get_first_locked (avl_tree * tree)
+{
+  avl_node * x;
+
+  if (AVL_PROMOTE_FAILED (tree))
+    return NULL;
+  x = tree->root;
+  thread_rwlock_rlock (&x->rwlock);
+  if (!x->right) {
+    thread_rwlock_unlock (&x->rwlock);
+    return NULL;
+  }
+  /* the sentinel root only has a right child, from there go left */
+  do {
+    avl_node * next = (x == tree->root) ? x->right : x->left;
+    thread_rwlock_rlock (&next->rwlock);
+    thread_rwlock_unlock (&x->rwlock);
+    x = next;
+  } while (x->left);
+  return x;
+}
+
+avl_node *
+avl_get_next_locked (avl_node * node)
+{
+  avl_node * x = node->right;
+
+  if (x) {
+    thread_rwlock_rlock (&x->rwlock);
+    thread_rwlock_unlock (&node->rwlock);
+    while (x->left) {
+      avl_node * l = x->left;
+      thread_rwlock_rlock (&l->rwlock);
+      thread_rwlock_unlock (&x->rwlock);
+      x = l;
+    }
+    return x;
+  }
+
+  while (1) {
+    avl_node * p = node->parent;
+
+    thread_rwlock_rlock (&p->rwlock);
+    if (p->left == node) {
+      thread_rwlock_unlock (&node->rwlock);
+      return p;
+    }
+    thread_rwlock_unlock (&node->rwlock);
+    if (!p->parent) {
+      /* we came up the right side of the sentinel root */
+      thread_rwlock_unlock (&p->rwlock);
+      return NULL;
+    }
+    node = p;
+  }
+}
+#else
+avl_node *
+avl_get_first_locked (avl_tree * tree)
+{
+  return avl_get_first (tree);
+}
+
+avl_node *
+avl_get_next_locked (avl_node * node)
+{
+  return avl_get_next (node);
+}
+#endif
+
+/*
+ * Snapshots.
+ *
+ * A snapshot is a tree of its own that starts out with the root node of
+ * the tree, so it shares every node.  Taking one moves the tree on to
+ * the next generation, and a node from an older generation may be seen
+ * by a snapshot, so writers never change it.  They put a copy in its
+ * place instead, which means changing its parent, so that is copied as
+ * well, up to the first node of the current generation.  Only the tree
+ * follows parent links, a copy can simply take over the children of the
+ * original and become their parent.  The originals are retired and
+ * released once no snapshot from before their retirement is left.
+ *
+ * A write works out how many copies it may need and reserves the nodes
+ * first, so running out of memory leaves the tree as it was.
+ */
+
+static avl_cow *
+avl_cow_new (void)
+{
+  avl_cow * cow = (avl_cow *) calloc (1, sizeof (avl_cow));
+
+  if (!cow)
+    return NULL;
+  cow->retired_tail = &cow->retired;
+  cow->keys_tail = &cow->keys;
+  return cow;
+}
+
+/* may a snapshot see <node>? */
+
+static int
+avl_cow_shared (avl_tree * tree, avl_node * node)
+{
+  return node && node != tree->root && node->generation != tree->cow->generation;
+}
+
+static void
+avl_cow_unreserve (avl_tree * tree)
+{
+  while (tree->cow->reserve) {
+    avl_node * node = tree->cow->reserve;
+    tree->cow->reserve = node->right;
+    avl_tree_node_free (tree, node);
+  }
+}
+
+static int
+avl_cow_reserve (avl_tree * tree, unsigned long count)
+{
+  while (count--) {
+    avl_node * node = avl_tree_node_new (tree, NULL, NULL);
+    if (!node) {
+      avl_cow_unreserve (tree);
+      return -1;
+    }
+    node->right = tree->cow->reserve;
+    tree->cow->reserve = node;
+  }
+  return 0;
+}
+
+/* the number of copies avl_cow_touch() makes for <node> */
+
+static unsigned long
+avl_cow_path_shared (avl_tree * tree, avl_node * node)
+{
+  unsigned long count = 0;
+
+  /* the parents of a current node are current as well */
+  for (; avl_cow_shared (tree, node); node = node->parent)
+    count++;
+  return count;
+}
+
+/*
+ * Upper bound of the copies needed to unlink <x>: the path down to the
+ * node that actually leaves its place, and for every node on the way up
+ * the other child and its children, which a rotation may change.
+ */
+
+static unsigned long
+avl_cow_unlink_shared (avl_tree * tree, avl_node * x)
+{
+  avl_node * a, * c = x;
+  unsigned long count;
+
+  if (x->left && x->right) {
+    c = x->left;
+    while (c->right)
+      c = c->right;
+  }
+  count = avl_cow_path_shared (tree, c);
+  for (a = c->parent; a != tree->root; c = a, a = a->parent) {
+    avl_node * q = (a->left == c) ? a->right : a->left;
+    if (q)
+      count += avl_cow_shared (tree, q) + avl_cow_shared (tree, q->left) + avl_cow_shared (tree, q->right);
+  }
+  return count;
+}
+
+/*
+ * Make <node> safe to change.  If a snapshot may see it, a copy from the
+ * reserve takes its place, and the same happens to its parent first.
+ * Returns the node to change.
+ */
+
+static avl_node *
+avl_cow_touch (avl_tree * tree, avl_node * node)
+{
+  avl_cow * cow = tree->cow;
+  avl_node * parent, * copy;
+
+  if (!cow || !cow->snapshots || !avl_cow_shared (tree, node))
+    return node;
+
+  parent = avl_cow_touch (tree, node->parent);
+  copy = cow->reserve;
+  cow->reserve = copy->right;
+
+  copy->key = node->key;
+  copy->left = node->left;
+  copy->right = node->right;
+  copy->parent = parent;
+  copy->rank_and_balance = node->rank_and_balance;
+  copy->generation = cow->generation;
+  if (parent->left == node) {
+    parent->left = copy;
+  } else {
+    parent->right = copy;
+  }
+  if (copy->left)
+    copy->left->parent = copy;
+  if (copy->right)
+    copy->right->parent = copy;
+
+  /* snapshots do not look at <parent> or <generation> */
+  node->parent = NULL;
+  node->generation = cow->generation;
+  *cow->retired_tail = node;
+  cow->retired_tail = &node->parent;
+
+  return copy;
+}
+
+/* the most levels an avl tree of <n> nodes can have */
+
+static unsigned int
+avl_max_height (unsigned long n)
+{
+  /* fewest nodes a tree of <h> and <h> + 1 levels can have */
+  unsigned long fewest = 0, next = 1;
+  unsigned int h = 0;
+
+  while (next <= n) {
+    unsigned long more = fewest + next + 1;
+    fewest = next;
+    next = more;
+    h++;
+  }
+  return h;
+}
+
+/* release whatever only snapshots that are gone could still see */
+
+static void
+avl_cow_reclaim (avl_tree * tree)
+{
+  avl_cow * cow = tree->cow;
+  avl_tree * snapshot;
+  unsigned int oldest = cow->generation;
+
+  for (snapshot = cow->snapshots; snapshot; snapshot = snapshot->cow->snapshots) {
+    if (snapshot->cow->generation < oldest)
+      oldest = snapshot->cow->generation;
+  }
+
+  /* a snapshot of generation g was taken before anything retired in g + 1 */
+  while (cow->retired && (!cow->snapshots || cow->retired->generation <= oldest)) {
+    avl_node * node = cow->retired;
+    cow->retired = node->parent;
+    avl_tree_node_free (tree, node);
+  }
+  if (!cow->retired)
+    cow->retired_tail = &cow->retired;
+
+  while (cow->keys && (!cow->snapshots || cow->keys->generation <= oldest)) {
+    avl_cow_key * key = cow->keys;
+    cow->keys = key->next;
+#ifndef NO_THREAD
+    if (tree->reclaim)
+      avl_retire (tree, NULL, key->key, key->free_key_fun);
+    else
+#endif
+      key->free_key_fun (key->key);
+    free (key);
+  }
+  if (!cow->keys)
+    cow->keys_tail = &cow->keys;
+}
+
+avl_tree *
+avl_snapshot (avl_tree * tree)
+{
+  avl_tree * snapshot;
+
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  /* lock coupled readers would keep walking the nodes we replace */
+  return NULL;
+#endif
+  if (AVL_PROMOTE_FAILED (tree))
+    return NULL;
+  /* avl_cow_touch() does not carry the aggregates over */
+  if ((tree->flags & (AVL_TREE_INTRUSIVE | AVL_TREE_ENGINE | AVL_TREE_SNAPSHOT)) || tree->lockless
+      || tree->aggregates)
+    return NULL;
+
+  if (!tree->cow) {
+    tree->cow = avl_cow_new ();
+    if (!tree->cow)
+      return NULL;
+  }
+
+  snapshot = avl_tree_new (tree->compare_fun, tree->compare_arg);
+  if (!snapshot)
+    return NULL;
+  snapshot->cow = avl_cow_new ();
+  if (!snapshot->cow) {
+    avl_tree_free (snapshot, NULL);
+    return NULL;
+  }
+
+  snapshot->flags = AVL_TREE_SNAPSHOT;
+  snapshot->root->right = tree->root->right;
+  snapshot->length = tree->length;
+  snapshot->height = tree->height;
+  snapshot->cow->generation = tree->cow->generation;
+  snapshot->cow->origin = tree;
+  snapshot->cow->snapshots = tree->cow->snapshots;
+  tree->cow->snapshots = snapshot;
+  tree->cow->generation++;
+
+  return snapshot;
+}
+
+void
+avl_snapshot_free (avl_tree * snapshot)
+{
+  avl_tree * tree = snapshot->cow->origin;
+  avl_tree ** p = &tree->cow->snapshots;
+
+  while (*p != snapshot)
+    p = &(*p)->cow->snapshots;
+  *p = snapshot->cow->snapshots;
+  avl_cow_reclaim (tree);
+
+  /* all that is left is an empty tree */
+  free (snapshot->cow);
+  snapshot->cow = NULL;
+  snapshot->flags = 0;
+  snapshot->root->right = NULL;
+  snapshot->length = 0;
+  avl_tree_free (snapshot, NULL);
+}
+
+/* unlinking <x> changes the nodes around it, get copies of the shared ones */
+
+static avl_node *
+avl_cow_touch_unlink (avl_tree * tree, avl_node * x)
+{
+  avl_node * y;
+
+  if (avl_cow_reserve (tree, avl_cow_unlink_shared (tree, x)) != 0)
+    return NULL;
+
+  x = avl_cow_touch (tree, x);
+  if (x->left && x->right) {
+    y = x->left;
+    while (y->right)
+      y = y->right;
+    avl_cow_touch (tree, y);
+  }
+  return x;
+}
+
+/*
+ * Find the slot avl_insert_helper() is going to link <key> into.  The
+ * search starts at <from>, which must contain that slot in its subtree,
+ * or at the top for NULL.
+ */
+
+static avl_node *
+avl_insert_slot (avl_tree * tree, avl_node * from, void * key, int * direction)
+{
+  avl_node * p = tree->root;
+  avl_node * q = from ? from : p->right;
+
+  *direction = +1;
+  while (q) {
+    p = q;
+    if (tree->compare_fun (tree->compare_arg, key, p->key) < 1) {
+      *direction = -1;
+      q = p->left;
+    } else {
+      *direction = +1;
+      q = p->right;
+    }
+  }
+  return p;
+}
+
+/* returns how many rotations it took */
+
+static int
+avl_insert_helper (avl_tree * ob,
+           avl_node * node)
+{
+  void * key = node->key;
+  int rotations = 0;
+
+  if (!(ob->root->right)) {
+    node->parent = ob->root;
+    ob->root->right = node;
+    ob->length = ob->length + 1;
+    ob->height = 1;
+  } else { /* not self.right == None */
+    avl_node *t, *p, *s, *q, *r;
+    int a;
+
+    t = ob->root;
+    s = p = t->right;
+
+    while (1) {
+      if (ob->compare_fun (ob->compare_arg, key, p->key) < 1) {
+    /* move left */
+    AVL_SET_RANK (p, (AVL_GET_RANK (p) + 1));
+    q = p->left;
+    if (!q) {
+      /* insert */
+      q = node;
+      q->parent = p;
+      p->left = q;
+      break;
+    } else if (AVL_GET_BALANCE(q)) {
+      t = p;
+      s = q;
+    }
+    p = q;
+      } else {
+    /* move right */
+    q = p->right;
+    if (!q) {
+      /* insert */
+      q = node;
+      q->parent = p;
+      p->right = q;
+      break;
+    } else if (AVL_GET_BALANCE(q)) {
+      t = p;
+      s = q;
+    }
+    p = q;
+      }
+    }
+    
+    ob->length = ob->length + 1;
+    
+    /* adjust balance factors */
+    if (ob->compare_fun (ob->compare_arg, key, s->key) < 1) {
+      r = p = s->left;
+    } else {
+      r = p = s->right;
+    }
+    while (p != q) {
+      if (ob->compare_fun (ob->compare_arg, key, p->key) < 1) {
+    AVL_SET_BALANCE (p, -1);
+    p = p->left;
+      } else {
+    AVL_SET_BALANCE (p, +1);
+    p = p->right;
+      }
+    }
+    
+    /* balancing act */
+    
+    if (ob->compare_fun (ob->compare_arg, key, s->key) < 1) {
+      a = -1;
+    } else {
+      a = +1;
+    }
+    
+    if (AVL_GET_BALANCE (s) == 0) {
+      AVL_SET_BALANCE (s, a);
+      if (s == ob->root->right)
+        ob->height = ob->height + 1;
+      return 0;
+    } else if (AVL_GET_BALANCE (s) == -a) {
+      AVL_SET_BALANCE (s, 0);
+      return 0;
+    } else if (AVL_GET_BALANCE(s) == a) {
+      if (AVL_GET_BALANCE (r) == a) {
+    /* single rotation */
+    rotations = 1;
+    p = r;
+    if (a == -1) {
+      s->left = r->right;
+      if (r->right) {
+        r->right->parent = s;
+      }
+      r->right = s;
+      s->parent = r;
+      AVL_SET_RANK (s, (AVL_GET_RANK (s) - AVL_GET_RANK (r)));
+    } else {
+      s->right = r->left;
+      if (r->left) {
+        r->left->parent = s;
+      }
+      r->left = s;
+      s->parent = r;
+      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (s)));
+    }
+    AVL_SET_BALANCE (s, 0);
+    AVL_SET_BALANCE (r, 0);
+    if (ob->aggregates)
+      avl_aggregate_node (ob, s);
+      } else if (AVL_GET_BALANCE (r) == -a) {
+    /* double rotation */
+    rotations = 2;
+    if (a == -1) {
+      p = r->right;
+      r->right = p->left;
+      if (p->left) {
+        p->left->parent = r;
+      }
+      p->left = r;
+      r->parent = p;
+      s->left = p->right;
+      if (p->right) {
+        p->right->parent = s;
+      }
+      p->right = s;
+      s->parent = p;
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) + AVL_GET_RANK (r)));
+      AVL_SET_RANK (s, (AVL_GET_RANK (s) - AVL_GET_RANK (p)));
+    } else {
+      p = r->left;
+      r->left = p->right;
+      if (p->right) {
+        p->right->parent = r;
+      }
+      p->right = r;
+      r->parent = p;
+      s->right = p->left;
+      if (p->left) {
+        p->left->parent = s;
+      }
+      p->left = s;
+      s->parent = p;
+      AVL_SET_RANK (r, (AVL_GET_RANK (r) - AVL_GET_RANK (p)));
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) + AVL_GET_RANK (s)));
+    }
+    if (AVL_GET_BALANCE (p) == a) {
+      AVL_SET_BALANCE (s, -a);
+      AVL_SET_BALANCE (r, 0);
+    } else if (AVL_GET_BALANCE (p) == -a) {
+      AVL_SET_BALANCE (s, 0);
+      AVL_SET_BALANCE (r, a);
+    } else {
+      AVL_SET_BALANCE (s, 0);
+      AVL_SET_BALANCE (r, 0);
+    }
+    AVL_SET_BALANCE (p, 0);
+    if (ob->aggregates) {
+      avl_aggregate_node (ob, r);
+      avl_aggregate_node (ob, s);
+    }
+      }
+      /* finishing touch */
+      if (s == t->right) {
+    t->right = p;
+      } else {
+    t->left = p;
+      }
+      p->parent = t;
+    }
+  }
+  return rotations;
+}
+
+/* avl_insert_helper() plus whatever concurrent readers and snapshots need */
+
+static int
+avl_insert_publish (avl_tree * tree, avl_node * node)
+{
+  int rotations;
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  avl_lock_set set;
+  int direction;
+  avl_node * slot = avl_insert_slot (tree, NULL, node->key, &direction);
+
+  set.count = 0;
+  avl_lock_set_grow (&set, tree, slot, direction, node);
+  avl_lock_set_acquire (&set);
+#endif
+
+  if (AVL_COW_ACTIVE (tree)) {
+    /* copy the path down to the slot, then link in bottom up */
+    int direction;
+    avl_node * slot = avl_insert_slot (tree, NULL, node->key, &direction);
+
+    if (avl_cow_reserve (tree, avl_cow_path_shared (tree, slot)) != 0)
+      return -1;
+    avl_link_node (tree, avl_cow_touch (tree, slot), direction, node, node->key);
+    return 0;
+  }
+
+  avl_write_begin (tree);
+  rotations = avl_insert_helper (tree, node);
+  avl_aggregate_path (tree, node);
+  avl_write_end (tree);
+  if (tree->stats)
+    avl_stats_change (tree, AVL_STAT_INSERTS, avl_node_depth (tree, node), rotations);
+
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  avl_lock_set_release (&set);
+#endif
+  return 0;
+}
+
+int
+avl_insert (avl_tree * ob,
+           void * key)
+{
+  avl_node * node;
+
+  if (ob->flags & (AVL_TREE_INTRUSIVE | AVL_TREE_SNAPSHOT))
+    return -1;
+  if ((ob->flags & AVL_TREE_SMALL) && ob->length >= AVL_SMALL_MAX_KEYS && avl_promote (ob) != 0)
+    return -1;
+  if (ob->flags & AVL_TREE_ENGINE)
+    return AVL_ENGINE (ob)->insert (ob, key);
+
+  if (avl_hash_reserve (ob, 1) != 0)
+    return -1;
+  node = avl_tree_node_new (ob, key, NULL);
+  if (!node)
+    return -1;
+
+  if (avl_insert_publish (ob, node) != 0) {
+    avl_tree_node_free (ob, node);
+    return -1;
+  }
+  avl_hash_add (ob, key);
+  return 0;
+}
+
+int
+avl_insert_node (avl_tree * tree,
+           avl_node * node,
+           void * key)
+{
+  if (AVL_PROMOTE_FAILED (tree))
+    return -1;
+  /* <node> has no room for an aggregate */
+  if ((tree->flags & (AVL_TREE_ENGINE | AVL_TREE_SNAPSHOT)) || tree->aggregates)
+    return -1;
+
+  avl_node_init (node, key, NULL);
+  node->generation = AVL_COW_GENERATION (tree);
+  return avl_insert_publish (tree, node);
+}
+
+/*
+ * Rotations used by the bottom-up rebalancing code.  They fix up the
+ * parent links and ranks, balance factors are left to the caller.
+ */
+
+static void
+avl_replace_child (avl_node * parent, avl_node * old_child, avl_node * new_child)
+{
+  if (parent->left == old_child) {
+    parent->left = new_child;
+  } else {
+    parent->right = new_child;
+  }
+  new_child->parent = parent;
+}
+
+/* <p>'s right child takes its place */
+
+static avl_node *
+avl_rotate_left (avl_node * p)
+{
+  avl_node * r = p->right;
+
+  avl_replace_child (p->parent, p, r);
+  p->right = r->left;
+  if (r->left) {
+    r->left->parent = p;
+  }
+  r->left = p;
+  p->parent = r;
+  AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (p)));
+  return r;
+}
+
+/* <p>'s left child takes its place */
+
+static avl_node *
+avl_rotate_right (avl_node * p)
+{
+  avl_node * l = p->left;
+
+  avl_replace_child (p->parent, p, l);
+  p->left = l->right;
+  if (l->right) {
+    l->right->parent = p;
+  }
+  l->right = p;
+  p->parent = l;
+  AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (l)));
+  return l;
+}
+
+/*
+ * <c> is the child on side <side> of <p>, and that side is now two
+ * levels taller than the other one.  Rotate to fix it, this does not
+ * change the height of the subtree compared to before the insert.
+ * Returns how many rotations it took.
+ */
+
+static int
+avl_rebalance_grown (avl_tree * tree, avl_node * p, avl_node * c, int side)
+{
+  if (AVL_GET_BALANCE (c) == side) {
+    /* single rotation */
+    if (side == -1) {
+      avl_rotate_right (p);
+    } else {
+      avl_rotate_left (p);
+    }
+    AVL_SET_BALANCE (p, 0);
+    AVL_SET_BALANCE (c, 0);
+    if (tree->aggregates)
+      avl_aggregate_node (tree, p);
+    return 1;
+  } else {
+    /* double rotation */
+    avl_node * g = (side == -1) ? c->right : c->left;
+    int g_balance = AVL_GET_BALANCE (g);
+
+    if (side == -1) {
+      avl_rotate_left (c);
+      avl_rotate_right (p);
+    } else {
+      avl_rotate_right (c);
+      avl_rotate_left (p);
+    }
+    if (g_balance == side) {
+      AVL_SET_BALANCE (p, (- side));
+      AVL_SET_BALANCE (c, 0);
+    } else if (g_balance == (- side)) {
+      AVL_SET_BALANCE (p, 0);
+      AVL_SET_BALANCE (c, side);
+    } else {
+      AVL_SET_BALANCE (p, 0);
+      AVL_SET_BALANCE (c, 0);
+    }
+    AVL_SET_BALANCE (g, 0);
+    if (tree->aggregates) {
+      avl_aggregate_node (tree, c);
+      avl_aggregate_node (tree, p);
+    }
+    return 2;
+  }
+}
+
+void
+avl_link_node_ranked (avl_tree * tree,
+           avl_node * parent,
+           int direction,
+           avl_node * node,
+           void * key)
+{
+  avl_node *c, *p;
+  int rotations = 0;
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  avl_lock_set set;
+
+  set.count = 0;
+  avl_lock_set_grow (&set, tree, parent, direction, node);
+  avl_lock_set_acquire (&set);
+#endif
+
+  avl_node_init (node, key, parent);
+  node->generation = AVL_COW_GENERATION (tree);
+  avl_write_begin (tree);
+  if (direction < 0) {
+    parent->left = node;
+  } else {
+    parent->right = node;
+  }
+  tree->length = tree->length + 1;
+
+  /* climb back up while the subtree below keeps growing */
+  c = node;
+  p = parent;
+  while (p != tree->root) {
+    int side = (c == p->left) ? -1 : +1;
+
+    if (AVL_GET_BALANCE (p) == 0) {
+      AVL_SET_BALANCE (p, side);
+      c = p;
+      p = p->parent;
+    } else if (AVL_GET_BALANCE (p) == (- side)) {
+      AVL_SET_BALANCE (p, 0);
+      break;
+    } else {
+      rotations = avl_rebalance_grown (tree, p, c, side);
+      break;
+    }
+  }
+  if (p == tree->root)
+    tree->height = tree->height + 1;
+  avl_aggregate_path (tree, node);
+  avl_write_end (tree);
+  if (tree->stats)
+    avl_stats_change (tree, AVL_STAT_INSERTS, avl_node_depth (tree, node), rotations);
+
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  avl_lock_set_release (&set);
+#endif
+}
+
+void
+avl_link_node (avl_tree * tree,
+           avl_node * parent,
+           int direction,
+           avl_node * node,
+           void * key)
+{
+  avl_node * c;
+
+  /* every node that gets <node> in its left subtree grows */
+  if (direction < 0 && parent != tree->root) {
+    AVL_SET_RANK (parent, (AVL_GET_RANK (parent) + 1));
+  }
+  for (c = parent; c->parent && c->parent != tree->root; c = c->parent) {
+    if (c->parent->left == c) {
+      AVL_SET_RANK (c->parent, (AVL_GET_RANK (c->parent) + 1));
+    }
+  }
+
+  avl_link_node_ranked (tree, parent, direction, node, key);
+}
+
+int
+avl_get_by_index (avl_tree * tree,
+           unsigned long index,
+           void ** value_address)
+{
+  avl_node * p;
+  unsigned long m = index + 1;
+
+  if (tree->flags & AVL_TREE_ENGINE)
+    return AVL_ENGINE (tree)->get_by_index (tree, index, value_address);
+
+  p = tree->root->right;
+
+  while (1) {
+    if (!p) {
+      return -1;
+    }
+    if (m < AVL_GET_RANK(p)) {
+      p = p->left;
+    } else if (m > AVL_GET_RANK(p)) {
+      m = m - AVL_GET_RANK(p);
+      p = p->right;
+    } else {
+      *value_address = p->key;
+      return 0;
+    }
+  }
+}
+           
+avl_node *
+avl_get_node_by_key (avl_tree * tree,
+         void * key)
+{
+  avl_node * x;
+  unsigned long depth = 0;
+
+  if (AVL_PROMOTE_FAILED (tree))
+    return NULL;
+#ifndef NO_THREAD
+  if (tree->lockless)
+    return avl_lockless_seek (tree, key, AVL_SEEK_EXACT, NULL, NULL);
+#endif
+
+  x = tree->root->right;
+  while (x) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+    depth++;
+    if (compare_result < 0) {
+      x = x->left;
+    } else if (compare_result > 0) {
+      x = x->right;
+    } else {
+      break;
+    }
+  }
+  if (tree->stats)
+    avl_stats_lookup (tree, depth, depth);
+  return x;
+}
+
+int
+avl_get_by_key (avl_tree * tree,
+         void * key,
+         void **value_address)
+{
+  avl_node * x;
+  void * x_key;
+
+  if (tree->flags & AVL_TREE_ENGINE) {
+    AVL_ENGINE (tree)->bound (tree, key, 0, &x_key, NULL);
+    if (!x_key || tree->compare_fun (tree->compare_arg, key, x_key) != 0)
+      return -1;
+    *value_address = x_key;
+    return 0;
+  }
+
+#ifndef NO_THREAD
+  if (tree->lockless) {
+    if (!avl_lockless_seek (tree, key, AVL_SEEK_EXACT, &x_key, NULL))
+      return -1;
+    *value_address = x_key;
+    return 0;
+  }
+#endif
+  if (tree->hash) {
+    x_key = avl_hash_find (tree, key);
+    if (!x_key)
+      return -1;
+    *value_address = x_key;
+    return 0;
+  }
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  x_key = avl_coupled_seek (tree, key, AVL_SEEK_EXACT);
+  if (!x_key)
+    return -1;
+  *value_address = x_key;
+  return 0;
+#endif
+
+  x = avl_get_node_by_key (tree, key);
+  if (!x) {
+    return -1;
+  }
+  x_key = x->key;
+  *value_address = x_key;
+  return 0;
+}
+
+/*
+ * Take <x> out of the tree and rebalance.  <x> itself is neither freed
+ * nor touched afterwards by the rebalancing, nodes keep their keys.
+ */
+
+static void
+avl_unlink_node (avl_tree * tree, avl_node * x)
+{
+  avl_node *y, *p, *q, *r, *top, *x_child, *bottom;
+  int shortened_side, shorter;
+  int rotations = 0;
+
+  /* every node that has <x> in its left subtree loses one from its rank */
+  for (y = x; y->parent != tree->root; y = y->parent) {
+    if (y->parent->left == y) {
+      AVL_SET_RANK (y->parent, (AVL_GET_RANK (y->parent) - 1));
+    }
+  }
+
+  if (x->left && x->right) {
+    /* The complicated case.
+     * Move the immediate predecessor <y> (which has no right child)
+     * into the place of <x>.
+     */
+    y = x->left;
+    while (y->right) {
+      y = y->right;
+    }
+    if (y == x->left) {
+      /* <y> keeps its left subtree, which is one shorter than
+       * the left subtree of <x> was
+       */
+      p = y;
+      shortened_side = -1;
+    } else {
+      p = y->parent;
+      p->right = y->left;
+      if (y->left) {
+        y->left->parent = p;
+      }
+      shortened_side = +1;
+      y->left = x->left;
+      x->left->parent = y;
+    }
+    y->right = x->right;
+    x->right->parent = y;
+    y->parent = x->parent;
+    if (x == x->parent->left) {
+      x->parent->left = y;
+    } else {
+      x->parent->right = y;
+    }
+    /* <y> takes over the balance of <x>, and its left subtree
+     * lost a node because that's where we took it from
+     */
+    y->rank_and_balance = x->rank_and_balance;
+    AVL_SET_RANK (y, (AVL_GET_RANK (y) - 1));
+  } else {
+    /* now <x> has at most one child
+     * scoot this child into the place of <x>
+     */
+    if (x->left) {
+      x_child = x->left;
+      x_child->parent = x->parent;
+    } else if (x->right) {
+      x_child = x->right;
+      x_child->parent = x->parent;
+    } else {
+      x_child = NULL;
+    }
+
+    /* now tell <x>'s parent that a grandchild became a child */
+    p = x->parent;
+    if (x == p->left) {
+      p->left = x_child;
+      shortened_side = -1;
+    } else {
+      p->right = x_child;
+      shortened_side = +1;
+    }
+  }
+
+  /*
+   * the height of the subtree <x>
+   * has now been shortened.  climb back up
+   * the tree, rotating when necessary to adjust
+   * for the change.
+   */
+  shorter = 1;
+  bottom = p;
+
+  while (shorter && p->parent) {
+    
+    /* case 1: height unchanged */
+    if (AVL_GET_BALANCE(p) == 0) {
+      if (shortened_side == -1) {
+    /* we removed a left child, the tree is now heavier
+     * on the right
+     */
     AVL_SET_BALANCE (p, +1);
       } else {
     /* we removed a right child, the tree is now heavier
@@ -491,6 +2990,8 @@ int avl_delete(avl_tree *tree, void *key, avl_free_key_fun_type free_key_fun)
       } else {
     q = p->right;
       }
+      q = avl_cow_touch (tree, q);
+      rotations++;
       if (AVL_GET_BALANCE (q) == 0) {
     /* case 3a: height unchanged */
     if (shortened_side == -1) {
@@ -510,118 +3011,914 @@ int avl_delete(avl_tree *tree, void *key, avl_free_key_fun_type free_key_fun)
       if (q->right) {
         q->right->parent = p;
       }
-      q->right = p;
-      p->parent = q;
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (q)));
+      q->right = p;
+      p->parent = q;
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (q)));
+    }
+    shorter = 0;
+    AVL_SET_BALANCE (q, shortened_side);
+    AVL_SET_BALANCE (p, (- shortened_side));
+    if (tree->aggregates)
+      avl_aggregate_node (tree, p);
+      } else if (AVL_GET_BALANCE (q) == AVL_GET_BALANCE (p)) {
+    /* case 3b: height reduced */
+    if (shortened_side == -1) {
+      /* single rotate left */
+      q->parent = p->parent;
+      p->right = q->left;
+      if (q->left) {
+        q->left->parent = p;
+      }
+      q->left = p;
+      p->parent = q;
+      AVL_SET_RANK (q, (AVL_GET_RANK (q) + AVL_GET_RANK (p)));
+    } else {
+      /* single rotate right */
+      q->parent = p->parent;
+      p->left = q->right;
+      if (q->right) {
+        q->right->parent = p;
+      }
+      q->right = p;
+      p->parent = q;
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (q)));
+    }
+    shorter = 1;
+    AVL_SET_BALANCE (q, 0);
+    AVL_SET_BALANCE (p, 0);
+    if (tree->aggregates)
+      avl_aggregate_node (tree, p);
+      } else {
+    /* case 3c: height reduced, balance factors opposite */
+    rotations++;
+    if (shortened_side == 1) {
+      /* double rotate right */
+      /* first, a left rotation around q */
+      r = avl_cow_touch (tree, q->right);
+      r->parent = p->parent;
+      q->right = r->left;
+      if (r->left) {
+        r->left->parent = q;
+      }
+      r->left = q;
+      q->parent = r;
+      /* now, a right rotation around p */
+      p->left = r->right;
+      if (r->right) {
+        r->right->parent = p;
+      }
+      r->right = p;
+      p->parent = r;
+      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (q)));
+      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (r)));
+    } else {
+      /* double rotate left */
+      /* first, a right rotation around q */
+      r = avl_cow_touch (tree, q->left);
+      r->parent = p->parent;
+      q->left = r->right;
+      if (r->right) {
+        r->right->parent = q;
+      }
+      r->right = q;
+      q->parent = r;
+      /* now a left rotation around p */
+      p->right = r->left;
+      if (r->left) {
+        r->left->parent = p;
+      }
+      r->left = p;
+      p->parent = r;
+      AVL_SET_RANK (q, (AVL_GET_RANK (q) - AVL_GET_RANK (r)));
+      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (p)));        
+    }
+    if (AVL_GET_BALANCE (r) == shortened_side) {
+      AVL_SET_BALANCE (q, (- shortened_side));
+      AVL_SET_BALANCE (p, 0);
+    } else if (AVL_GET_BALANCE (r) == (- shortened_side)) {
+      AVL_SET_BALANCE (q, 0);
+      AVL_SET_BALANCE (p, shortened_side);
+    } else {
+      AVL_SET_BALANCE (q, 0);
+      AVL_SET_BALANCE (p, 0);
+    }
+    AVL_SET_BALANCE (r, 0);
+    if (tree->aggregates) {
+      avl_aggregate_node (tree, q);
+      avl_aggregate_node (tree, p);
+    }
+    q = r;
+      }
+      /* a rotation has caused <q> (or <r> in case 3c) to become
+       * the root.  let <p>'s former parent know this.
+       */
+      if (top->left == p) {
+    top->left = q;
+      } else {
+    top->right = q;
+      }
+      /* end case 3 */
+      p = q;
+    }
+    x = p;
+    p = x->parent;
+    /* shortened_side tells us which side we came up from */
+    if (x == p->left) {
+      shortened_side = -1;
+    } else {
+      shortened_side = +1;
+    }
+  } /* end while(shorter) */
+  /* when we're all done, we're one shorter */
+  tree->length = tree->length - 1;
+  avl_aggregate_path (tree, bottom);
+  if (tree->stats)
+    avl_stats_change (tree, AVL_STAT_DELETES, 0, rotations);
+}
+
+/* release the unlinked <x> and its <key> */
+
+static void
+avl_dispose_node (avl_tree * tree, avl_node * x, void * key, avl_free_key_fun_type free_key_fun)
+{
+  avl_hash_remove (tree, key);
+#ifndef NO_THREAD
+  if (tree->lockless) {
+    avl_retire (tree, x, key, free_key_fun);
+    return;
+  }
+  if (tree->reclaim) {
+    /* readers hold on to keys, not nodes */
+    avl_tree_node_free (tree, x);
+    if (free_key_fun)
+      avl_retire (tree, NULL, key, free_key_fun);
+    return;
+  }
+#endif
+
+  /* return the key and node to storage. For intrusive trees the node
+   * is part of the key, so we must not touch it once the key is gone.
+   */
+  avl_tree_node_free (tree, x);
+  if (free_key_fun)
+      free_key_fun (key);
+}
+
+static int
+avl_delete_helper (avl_tree * tree, avl_node * x, avl_free_key_fun_type free_key_fun)
+{
+  void * key = x->key;
+  avl_cow_key * deferred = NULL;
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  avl_lock_set set;
+
+  set.count = 0;
+  avl_lock_set_unlink (&set, x);
+  avl_lock_set_acquire (&set);
+#endif
+
+  if (AVL_COW_ACTIVE (tree)) {
+    /* the key goes once the snapshots are done with it */
+    if (free_key_fun) {
+      deferred = (avl_cow_key *) malloc (sizeof (avl_cow_key));
+      if (!deferred)
+        return -1;
+    }
+    x = avl_cow_touch_unlink (tree, x);
+    if (!x) {
+      free (deferred);
+      return -1;
+    }
+  }
+
+  avl_write_begin (tree);
+  avl_unlink_node (tree, x);
+  avl_write_end (tree);
+
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  avl_lock_set_release (&set);
+#endif
+
+  if (AVL_COW_ACTIVE (tree)) {
+    avl_cow_unreserve (tree);
+    if (deferred) {
+      deferred->next = NULL;
+      deferred->key = key;
+      deferred->free_key_fun = free_key_fun;
+      deferred->generation = tree->cow->generation;
+      *tree->cow->keys_tail = deferred;
+      tree->cow->keys_tail = &deferred->next;
+      free_key_fun = NULL;
+    }
+  }
+  avl_dispose_node (tree, x, key, free_key_fun);
+  return 0;
+}
+
+int avl_delete(avl_tree *tree, void *key, avl_free_key_fun_type free_key_fun)
+{
+  avl_node * x;
+
+  if (tree->flags & AVL_TREE_ENGINE)
+    return AVL_ENGINE (tree)->remove (tree, key, free_key_fun);
+  if (tree->flags & AVL_TREE_SNAPSHOT)
+    return -1;
+
+  x = avl_get_node_by_key (tree, key);
+  if (!x) {
+    return -1;        /* key not in tree */
+  }
+
+  return avl_delete_helper (tree, x, free_key_fun);
+}
+
+int avl_delete_node(avl_tree *tree, avl_node *node, avl_free_key_fun_type free_key_fun)
+{
+  if (tree->flags & AVL_TREE_SNAPSHOT)
+    return -1;
+
+  return avl_delete_helper (tree, node, free_key_fun);
+}
+
+/*
+ * Batch updates.
+ *
+ * The keys are sorted first.  A batch that is big compared to the tree
+ * is merged with the nodes of the tree and the result is relinked into
+ * a perfectly balanced tree in one go.  Smaller batches are applied key
+ * by key, but every search starts from where the previous key ended up
+ * instead of from the top.
+ */
+
+/* stable merge sort of <keys>, qsort() has no room for the compare_arg */
+
+static int
+avl_sort_keys (avl_tree * tree, void ** keys, unsigned long n)
+{
+  void ** tmp, ** from, ** to;
+  unsigned long width, i;
+
+  for (i = 1; i < n; i++) {
+    if (tree->compare_fun (tree->compare_arg, keys[i - 1], keys[i]) > 0)
+      break;
+  }
+  if (i >= n)
+    return 0;
+
+  tmp = (void **) malloc (sizeof (void *) * n);
+  if (!tmp)
+    return -1;
+
+  from = keys;
+  to = tmp;
+  for (width = 1; width < n; width *= 2) {
+    for (i = 0; i < n; i += 2 * width) {
+      unsigned long a = i, a_end = (i + width < n) ? i + width : n;
+      unsigned long b = a_end, b_end = (i + 2 * width < n) ? i + 2 * width : n;
+      unsigned long k = i;
+
+      while (a < a_end && b < b_end) {
+        if (tree->compare_fun (tree->compare_arg, from[b], from[a]) < 0)
+          to[k++] = from[b++];
+        else
+          to[k++] = from[a++];
+      }
+      while (a < a_end)
+        to[k++] = from[a++];
+      while (b < b_end)
+        to[k++] = from[b++];
+    }
+    from = (from == keys) ? tmp : keys;
+    to = (to == keys) ? tmp : keys;
+  }
+  if (from != keys)
+    memcpy (keys, from, sizeof (void *) * n);
+  free (tmp);
+  return 0;
+}
+
+/* all nodes of <tree> in order, NULL if there is no memory for that */
+
+static avl_node **
+avl_collect_nodes (avl_tree * tree, unsigned long extra)
+{
+  avl_node ** nodes = (avl_node **) malloc (sizeof (avl_node *) * (tree->length + extra + 1));
+  avl_node * x;
+  unsigned long i = 0;
+
+  if (!nodes)
+    return NULL;
+  for (x = avl_get_first (tree); x; x = avl_get_next (x)) {
+    nodes[i++] = x;
+  }
+  return nodes;
+}
+
+/* like avl_build_sorted_helper(), but for nodes we already have */
+
+static avl_node *
+avl_relink_sorted (avl_node ** nodes, unsigned long n, avl_node * parent)
+{
+  unsigned long num_left = (n - 1) / 2;
+  unsigned long num_right = n - 1 - num_left;
+  avl_node * node = nodes[num_left];
+
+  node->parent = parent;
+  node->rank_and_balance = 0;
+  AVL_SET_RANK (node, (num_left + 1));
+  AVL_SET_BALANCE (node, (int) (avl_sorted_height (num_right) - avl_sorted_height (num_left)));
+  node->left = num_left ? avl_relink_sorted (nodes, num_left, node) : NULL;
+  node->right = num_right ? avl_relink_sorted (nodes + num_left + 1, num_right, node) : NULL;
+  return node;
+}
+
+static void
+avl_relink_tree (avl_tree * tree, avl_node ** nodes, unsigned long n)
+{
+  avl_write_begin (tree);
+  tree->root->right = n ? avl_relink_sorted (nodes, n, tree->root) : NULL;
+  tree->length = n;
+  tree->height = avl_sorted_height (n);
+  if (tree->aggregates)
+    avl_aggregate_subtree (tree, tree->root->right);
+  avl_write_end (tree);
+}
+
+/*
+ * Relinking costs about a fifth of an insert per node, as it does not
+ * compare or rotate.  So it pays off once the batch is a quarter of the
+ * tree.
+ */
+
+static int
+avl_batch_rebuilds (avl_tree * tree, unsigned long n)
+{
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  /* a rebuild touches every node, we'd have to lock them all */
+  (void) tree;
+  (void) n;
+  return 0;
+#else
+  /* or copy them all for the snapshots */
+  return n * 4 >= tree->length && !AVL_COW_ACTIVE (tree);
+#endif
+}
+
+/*
+ * Climb up from <finger> to the smallest subtree that can hold <key>.
+ * <side> says on which side of <finger> the key is, +1 if it is not less
+ * than the key of <finger>, -1 if it is not greater.  Going up stops at
+ * the first ancestor that bounds us on that side and is beyond the key:
+ * side * compare(key, ancestor) < <limit>.  <limit> is 1 when looking
+ * for an insert slot to the right (equal keys go to the left) and 0 when
+ * looking for <key> itself.  This costs O(log d) comparisons for a key d
+ * positions away.
+ */
+
+static avl_node *
+avl_finger_climb (avl_tree * tree, avl_node * finger, void * key, int side, int limit)
+{
+  avl_node * x = finger;
+
+  while (x->parent != tree->root) {
+    avl_node * p = x->parent;
+    avl_node * inner = (side > 0) ? p->left : p->right;
+
+    if (inner == x && side * tree->compare_fun (tree->compare_arg, key, p->key) < limit)
+      break;
+    x = p;
+  }
+  return x;
+}
+
+int
+avl_insert_batch (avl_tree * tree, void ** keys, unsigned long n)
+{
+  avl_node ** nodes, ** merged, * finger = NULL;
+  unsigned long i, a, b, k;
+
+  if (tree->flags & (AVL_TREE_INTRUSIVE | AVL_TREE_SNAPSHOT))
+    return -1;
+  if (!n)
+    return 0;
+  if (avl_sort_keys (tree, keys, n) != 0)
+    return -1;
+
+  if ((tree->flags & AVL_TREE_SMALL) && tree->length + n > AVL_SMALL_MAX_KEYS && avl_promote (tree) != 0)
+    return -1;
+  if (tree->flags & AVL_TREE_ENGINE) {
+    /* sorted keys end up next to each other, e.g. in the same few leaves */
+    for (i = 0; i < n; i++) {
+      if (AVL_ENGINE (tree)->insert (tree, keys[i]) != 0) {
+        /* equal keys go in front, so this takes out the ones we added */
+        while (i--)
+          AVL_ENGINE (tree)->remove (tree, keys[i], NULL);
+        return -1;
+      }
     }
-    shorter = 0;
-    AVL_SET_BALANCE (q, shortened_side);
-    AVL_SET_BALANCE (p, (- shortened_side));
-      } else if (AVL_GET_BALANCE (q) == AVL_GET_BALANCE (p)) {
-    /* case 3b: height reduced */
-    if (shortened_side == -1) {
-      /* single rotate left */
-      q->parent = p->parent;
-      p->right = q->left;
-      if (q->left) {
-        q->left->parent = p;
-      }
-      q->left = p;
-      p->parent = q;
-      AVL_SET_RANK (q, (AVL_GET_RANK (q) + AVL_GET_RANK (p)));
+    return 0;
+  }
+
+  /* get all the nodes first so a failure leaves the tree alone */
+  if (avl_hash_reserve (tree, n) != 0)
+    return -1;
+  nodes = (avl_node **) malloc (sizeof (avl_node *) * n);
+  if (!nodes)
+    return -1;
+  for (i = 0; i < n; i++) {
+    nodes[i] = avl_tree_node_new (tree, keys[i], NULL);
+    if (!nodes[i]) {
+      while (i--)
+        avl_tree_node_free (tree, nodes[i]);
+      free (nodes);
+      return -1;
+    }
+  }
+
+  /* each key copies at most its path, and no node is copied twice */
+  if (AVL_COW_ACTIVE (tree)) {
+    unsigned long copies = n * avl_max_height (tree->length + n);
+
+    if (avl_cow_reserve (tree, copies < tree->length ? copies : tree->length) != 0) {
+      for (i = 0; i < n; i++)
+        avl_tree_node_free (tree, nodes[i]);
+      free (nodes);
+      return -1;
+    }
+  }
+
+  /* nothing can go wrong from here on */
+  for (i = 0; i < n; i++)
+    avl_hash_add (tree, keys[i]);
+
+  merged = avl_batch_rebuilds (tree, n) ? avl_collect_nodes (tree, n) : NULL;
+  if (merged) {
+    /* move the tree's nodes up and merge the new ones in from the front,
+     * new keys go in front of equal ones like avl_insert() does
+     */
+    memmove (merged + n, merged, sizeof (avl_node *) * tree->length);
+    a = 0;
+    b = n;
+    k = 0;
+    while (a < n) {
+      if (b < n + tree->length
+          && tree->compare_fun (tree->compare_arg, merged[b]->key, nodes[a]->key) < 0)
+        merged[k++] = merged[b++];
+      else
+        merged[k++] = nodes[a++];
+    }
+    avl_relink_tree (tree, merged, n + tree->length);
+    free (merged);
+    free (nodes);
+    return 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    avl_node * parent;
+    int direction;
+
+    if (finger) {
+      parent = avl_insert_slot (tree, avl_finger_climb (tree, finger, keys[i], +1, 1), keys[i], &direction);
     } else {
-      /* single rotate right */
-      q->parent = p->parent;
-      p->left = q->right;
-      if (q->right) {
-        q->right->parent = p;
-      }
-      q->right = p;
-      p->parent = q;
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (q)));
+      parent = avl_insert_slot (tree, NULL, keys[i], &direction);
     }
-    shorter = 1;
-    AVL_SET_BALANCE (q, 0);
-    AVL_SET_BALANCE (p, 0);
+    avl_link_node (tree, avl_cow_touch (tree, parent), direction, nodes[i], keys[i]);
+    finger = nodes[i];
+  }
+  if (tree->cow)
+    avl_cow_unreserve (tree);
+  free (nodes);
+  return 0;
+}
+
+long
+avl_delete_batch (avl_tree * tree, void ** keys, unsigned long n, avl_free_key_fun_type free_key_fun)
+{
+  avl_node ** nodes, * finger = NULL;
+  unsigned long i, j, kept;
+  long deleted = 0;
+
+  if (tree->flags & AVL_TREE_SNAPSHOT)
+    return -1;
+  if (!n || !tree->length)
+    return 0;
+  if (avl_sort_keys (tree, keys, n) != 0)
+    return -1;
+
+  if (tree->flags & AVL_TREE_ENGINE) {
+    for (i = 0; i < n; i++) {
+      if (AVL_ENGINE (tree)->remove (tree, keys[i], free_key_fun) == 0)
+        deleted++;
+    }
+    return deleted;
+  }
+
+  nodes = avl_batch_rebuilds (tree, n) ? avl_collect_nodes (tree, 0) : NULL;
+  if (nodes) {
+    unsigned long length = tree->length;
+    avl_node * removed = NULL;
+
+    /* removed nodes are chained through ->parent until the relink is done */
+    for (i = 0, j = 0, kept = 0; i < length; i++) {
+      int c = -1;
+
+      while (j < n && (c = tree->compare_fun (tree->compare_arg, keys[j], nodes[i]->key)) < 0)
+        j++;
+      if (j < n && c == 0) {
+        nodes[i]->parent = removed;
+        removed = nodes[i];
+        j++;
+        deleted++;
       } else {
-    /* case 3c: height reduced, balance factors opposite */
-    if (shortened_side == 1) {
-      /* double rotate right */
-      /* first, a left rotation around q */
-      r = q->right;
-      r->parent = p->parent;
-      q->right = r->left;
-      if (r->left) {
-        r->left->parent = q;
-      }
-      r->left = q;
-      q->parent = r;
-      /* now, a right rotation around p */
-      p->left = r->right;
-      if (r->right) {
-        r->right->parent = p;
-      }
-      r->right = p;
-      p->parent = r;
-      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (q)));
-      AVL_SET_RANK (p, (AVL_GET_RANK (p) - AVL_GET_RANK (r)));
-    } else {
-      /* double rotate left */
-      /* first, a right rotation around q */
-      r = q->left;
-      r->parent = p->parent;
-      q->left = r->right;
-      if (r->right) {
-        r->right->parent = q;
-      }
-      r->right = q;
-      q->parent = r;
-      /* now a left rotation around p */
-      p->right = r->left;
-      if (r->left) {
-        r->left->parent = p;
+        nodes[kept++] = nodes[i];
       }
-      r->left = p;
-      p->parent = r;
-      AVL_SET_RANK (q, (AVL_GET_RANK (q) - AVL_GET_RANK (r)));
-      AVL_SET_RANK (r, (AVL_GET_RANK (r) + AVL_GET_RANK (p)));        
     }
-    if (AVL_GET_BALANCE (r) == shortened_side) {
-      AVL_SET_BALANCE (q, (- shortened_side));
-      AVL_SET_BALANCE (p, 0);
-    } else if (AVL_GET_BALANCE (r) == (- shortened_side)) {
-      AVL_SET_BALANCE (q, 0);
-      AVL_SET_BALANCE (p, shortened_side);
-    } else {
-      AVL_SET_BALANCE (q, 0);
-      AVL_SET_BALANCE (p, 0);
+    if (deleted)
+      avl_relink_tree (tree, nodes, kept);
+    free (nodes);
+
+    while (removed) {
+      avl_node * next = removed->parent;
+      avl_dispose_node (tree, removed, removed->key, free_key_fun);
+      removed = next;
     }
-    AVL_SET_BALANCE (r, 0);
-    q = r;
-      }
-      /* a rotation has caused <q> (or <r> in case 3c) to become
-       * the root.  let <p>'s former parent know this.
-       */
-      if (top->left == p) {
-    top->left = q;
-      } else {
-    top->right = q;
+    return deleted;
+  }
+
+  for (i = 0; i < n; i++) {
+    avl_node * x, * from = finger ? avl_finger_climb (tree, finger, keys[i], +1, 0) : tree->root->right;
+
+    /* plain descent from <from> */
+    x = from;
+    while (x) {
+      int c = tree->compare_fun (tree->compare_arg, keys[i], x->key);
+      if (c == 0)
+        break;
+      x = (c < 0) ? x->left : x->right;
+    }
+    if (!x) {
+      if (from)
+        finger = from;
+      continue;
+    }
+
+    /* nodes keep their keys when unlinking, so the predecessor stays
+     * a good place to continue from
+     */
+    finger = avl_get_prev (x);
+    if (avl_delete_helper (tree, x, free_key_fun) != 0)
+      return -1;
+    /* the predecessor may have been replaced by a copy */
+    if (AVL_COW_ACTIVE (tree))
+      finger = NULL;
+    deleted++;
+    if (!tree->length)
+      break;
+  }
+  return deleted;
+}
+
+/*
+ * Split and join.
+ *
+ * These take subtrees apart and put them back together without looking
+ * at keys.  Heights and sizes are worked out from the balance factors and
+ * ranks on the way down, so joining two subtrees with a node in between
+ * costs O(1) per level of height difference and all the joins of a split
+ * add up to O(log n).
+ */
+
+typedef struct {
+  avl_node *            node;
+  unsigned int          height;
+  unsigned long         size;
+} avl_subtree;
+
+static avl_subtree
+avl_subtree_left (avl_subtree t)
+{
+  avl_subtree l;
+
+  l.node = t.node->left;
+  l.height = t.height - (AVL_GET_BALANCE (t.node) > 0 ? 2 : 1);
+  l.size = AVL_GET_RANK (t.node) - 1;
+  return l;
+}
+
+static avl_subtree
+avl_subtree_right (avl_subtree t)
+{
+  avl_subtree r;
+
+  r.node = t.node->right;
+  r.height = t.height - (AVL_GET_BALANCE (t.node) < 0 ? 2 : 1);
+  r.size = t.size - AVL_GET_RANK (t.node);
+  return r;
+}
+
+/* put <k> on top of <l> and <r>, which differ in height by one at most */
+
+static avl_subtree
+avl_subtree_make (avl_node * k, avl_subtree l, avl_subtree r)
+{
+  avl_subtree t;
+
+  k->left = l.node;
+  k->right = r.node;
+  if (l.node)
+    l.node->parent = k;
+  if (r.node)
+    r.node->parent = k;
+  k->rank_and_balance = 0;
+  AVL_SET_RANK (k, (l.size + 1));
+  AVL_SET_BALANCE (k, ((int) r.height - (int) l.height));
+
+  t.node = k;
+  t.height = (l.height > r.height ? l.height : r.height) + 1;
+  t.size = l.size + r.size + 1;
+  return t;
+}
+
+/* <l> is more than one level taller, go down its right spine */
+
+static avl_subtree
+avl_subtree_join_right (avl_subtree l, avl_node * k, avl_subtree r)
+{
+  avl_subtree a = avl_subtree_left (l), c = avl_subtree_right (l), t;
+
+  if (c.height <= r.height + 1) {
+    t = avl_subtree_make (k, c, r);
+    if (t.height <= a.height + 1)
+      return avl_subtree_make (l.node, a, t);
+    /* <c> is one taller than <r>, double rotation with <c> on top */
+    a = avl_subtree_make (l.node, a, avl_subtree_left (c));
+    t = avl_subtree_make (k, avl_subtree_right (c), r);
+    return avl_subtree_make (c.node, a, t);
+  }
+
+  t = avl_subtree_join_right (c, k, r);
+  if (t.height <= a.height + 1)
+    return avl_subtree_make (l.node, a, t);
+  /* single rotation with <t> on top */
+  c = avl_subtree_right (t);
+  a = avl_subtree_make (l.node, a, avl_subtree_left (t));
+  return avl_subtree_make (t.node, a, c);
+}
+
+/* <r> is more than one level taller, go down its left spine */
+
+static avl_subtree
+avl_subtree_join_left (avl_subtree l, avl_node * k, avl_subtree r)
+{
+  avl_subtree a = avl_subtree_right (r), c = avl_subtree_left (r), t;
+
+  if (c.height <= l.height + 1) {
+    t = avl_subtree_make (k, l, c);
+    if (t.height <= a.height + 1)
+      return avl_subtree_make (r.node, t, a);
+    a = avl_subtree_make (r.node, avl_subtree_right (c), a);
+    t = avl_subtree_make (k, l, avl_subtree_left (c));
+    return avl_subtree_make (c.node, t, a);
+  }
+
+  t = avl_subtree_join_left (l, k, c);
+  if (t.height <= a.height + 1)
+    return avl_subtree_make (r.node, t, a);
+  c = avl_subtree_left (t);
+  a = avl_subtree_make (r.node, avl_subtree_right (t), a);
+  return avl_subtree_make (t.node, c, a);
+}
+
+/* everything in <l>, then <k>, then everything in <r> */
+
+static avl_subtree
+avl_subtree_join (avl_subtree l, avl_node * k, avl_subtree r)
+{
+  if (l.height > r.height + 1)
+    return avl_subtree_join_right (l, k, r);
+  if (r.height > l.height + 1)
+    return avl_subtree_join_left (l, k, r);
+  return avl_subtree_make (k, l, r);
+}
+
+/* the first <index> nodes of <t> go to <*l>, the others to <*r> */
+
+static void
+avl_subtree_split (avl_subtree t, unsigned long index, avl_subtree * l, avl_subtree * r)
+{
+  avl_subtree left, right;
+
+  if (!t.node) {
+    *l = *r = t;
+    return;
+  }
+
+  left = avl_subtree_left (t);
+  right = avl_subtree_right (t);
+  if (index <= left.size) {
+    avl_subtree_split (left, index, l, r);
+    *r = avl_subtree_join (*r, t.node, right);
+  } else {
+    avl_subtree_split (right, index - left.size - 1, l, r);
+    *l = avl_subtree_join (left, t.node, *l);
+  }
+}
+
+/* tree->height is not kept up to date by deletes, so count */
+
+static avl_subtree
+avl_tree_subtree (avl_tree * tree)
+{
+  avl_subtree t;
+  avl_node * x;
+
+  t.node = tree->root->right;
+  t.size = tree->length;
+  t.height = 0;
+  for (x = t.node; x; x = (AVL_GET_BALANCE (x) < 0) ? x->left : x->right)
+    t.height++;
+  return t;
+}
+
+static void
+avl_tree_set_subtree (avl_tree * tree, avl_subtree t)
+{
+  tree->root->right = t.node;
+  if (t.node)
+    t.node->parent = tree->root;
+  tree->length = t.size;
+  tree->height = t.height;
+}
+
+/*
+ * Can we move the nodes of <tree> around as we like?  Lock coupled
+ * readers and snapshots need to know about every node that changes.
+ */
+
+static int
+avl_tree_splittable (avl_tree * tree)
+{
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  return 0;
+#endif
+  /* the subtree joins would have to redo the aggregates */
+  return !(tree->flags & (AVL_TREE_ENGINE | AVL_TREE_SNAPSHOT)) && !AVL_COW_ACTIVE (tree)
+    && !tree->aggregates;
+}
+
+static void
+avl_dispose_subtree (avl_tree * tree, avl_node * node, avl_free_key_fun_type free_key_fun)
+{
+  while (node) {
+    avl_node * right = node->right;
+
+    avl_dispose_subtree (tree, node->left, free_key_fun);
+    avl_dispose_node (tree, node, node->key, free_key_fun);
+    node = right;
+  }
+}
+
+int
+avl_delete_index_range (avl_tree * tree,
+            unsigned long low,
+            unsigned long high,
+            avl_free_key_fun_type free_key_fun)
+{
+  avl_subtree a, m, c, last;
+
+  if (AVL_PROMOTE_FAILED (tree))
+    return -1;
+  if (tree->flags & (AVL_TREE_ENGINE | AVL_TREE_SNAPSHOT))
+    return -1;
+  if (low > high || high > tree->length)
+    return -1;
+  if (low == high)
+    return 0;
+
+  if (!avl_tree_splittable (tree)) {
+    /* the slow way, one delete at a time */
+    while (high-- > low) {
+      avl_node * x = tree->root->right;
+      unsigned long m = low + 1;
+
+      while (m != AVL_GET_RANK (x)) {
+        if (m < AVL_GET_RANK (x)) {
+          x = x->left;
+        } else {
+          m = m - AVL_GET_RANK (x);
+          x = x->right;
+        }
       }
-      /* end case 3 */
-      p = q;
+      if (avl_delete_helper (tree, x, free_key_fun) != 0)
+        return -1;
     }
-    x = p;
-    p = x->parent;
-    /* shortened_side tells us which side we came up from */
-    if (x == p->left) {
-      shortened_side = -1;
-    } else {
-      shortened_side = +1;
+    return 0;
+  }
+
+  avl_write_begin (tree);
+  avl_subtree_split (avl_tree_subtree (tree), low, &a, &m);
+  avl_subtree_split (m, high - low, &m, &c);
+  if (a.node) {
+    /* the last node before the range holds the rest together */
+    avl_subtree_split (a, a.size - 1, &a, &last);
+    c = avl_subtree_join (a, last.node, c);
+  }
+  avl_tree_set_subtree (tree, c);
+  avl_write_end (tree);
+
+  avl_dispose_subtree (tree, m.node, free_key_fun);
+  return 0;
+}
+
+avl_tree *
+avl_split (avl_tree * tree, void * key)
+{
+  avl_tree * upper;
+  avl_subtree l, r;
+  avl_node * x;
+  unsigned long index = 0;
+
+  if (AVL_PROMOTE_FAILED (tree))
+    return NULL;
+  /* the moved keys would have to be hashed again one by one */
+  if (!avl_tree_splittable (tree) || tree->hash)
+    return NULL;
+
+  if (tree->pool)
+    upper = avl_tree_new_with_pool (tree->compare_fun, tree->compare_arg, tree->pool);
+  else
+    upper = avl_tree_new (tree->compare_fun, tree->compare_arg);
+  if (!upper)
+    return NULL;
+  upper->flags = tree->flags & AVL_TREE_INTRUSIVE;
+#ifndef NO_THREAD
+  /* readers of <tree> may still be on the moved nodes */
+  if (tree->reclaim) {
+    if ((tree->lockless && avl_tree_set_lockless (upper, tree->reclaim->epoch) != 0)
+        || avl_tree_set_deferred_free (upper, tree->reclaim->epoch) != 0) {
+      avl_tree_free (upper, NULL);
+      return NULL;
     }
-  } /* end while(shorter) */
-  /* when we're all done, we're one shorter */
-  tree->length = tree->length - 1;
-  return (0);
+  }
+#endif
+
+  /* count the keys less than <key> */
+  for (x = tree->root->right; x; ) {
+    if (tree->compare_fun (tree->compare_arg, key, x->key) <= 0) {
+      x = x->left;
+    } else {
+      index = index + AVL_GET_RANK (x);
+      x = x->right;
+    }
+  }
+
+  avl_write_begin (tree);
+  avl_subtree_split (avl_tree_subtree (tree), index, &l, &r);
+  avl_tree_set_subtree (tree, l);
+  avl_write_end (tree);
+  avl_tree_set_subtree (upper, r);
+  return upper;
+}
+
+int
+avl_join (avl_tree * a, avl_tree * b)
+{
+  avl_subtree first, rest;
+  avl_node * last;
+
+  if (AVL_PROMOTE_FAILED (a) || AVL_PROMOTE_FAILED (b))
+    return -1;
+  if (!avl_tree_splittable (a) || !avl_tree_splittable (b) || a->hash || b->hash)
+    return -1;
+  /* the nodes have to go back where they came from */
+  if (a->pool != b->pool || (a->flags & AVL_TREE_INTRUSIVE) != (b->flags & AVL_TREE_INTRUSIVE))
+    return -1;
+#ifndef NO_THREAD
+  /* and be released only once the readers of <b> are gone */
+  if (!a->lockless != !b->lockless || !a->reclaim != !b->reclaim
+      || (a->reclaim && a->reclaim->epoch != b->reclaim->epoch))
+    return -1;
+#endif
+  if (!b->length)
+    return 0;
+
+  if (a->length) {
+    for (last = a->root->right; last->right; last = last->right)
+      ;
+    if (a->compare_fun (a->compare_arg, last->key, avl_get_first (b)->key) > 0)
+      return -1;
+  }
+
+  avl_write_begin (a);
+  avl_write_begin (b);
+  avl_subtree_split (avl_tree_subtree (b), 1, &first, &rest);
+  avl_tree_set_subtree (a, avl_subtree_join (avl_tree_subtree (a), first.node, rest));
+  b->root->right = NULL;
+  b->length = 0;
+  b->height = 0;
+  avl_write_end (b);
+  avl_write_end (a);
+  return 0;
 }
 
 static int
@@ -656,6 +3953,14 @@ avl_iterate_inorder (avl_tree * tree,
 {
   int result;
 
+  if (tree->flags & AVL_TREE_ENGINE)
+    return AVL_ENGINE (tree)->iterate_inorder (tree, iter_fun, iter_arg);
+
+#ifndef NO_THREAD
+  if (tree->lockless)
+    return avl_lockless_iterate (tree, iter_fun, iter_arg);
+#endif
+
   if (tree->length) {
     result = avl_iterate_inorder_helper (tree->root->right, iter_fun, iter_arg);
     return (result);
@@ -668,6 +3973,8 @@ avl_node *avl_get_first(avl_tree *tree)
 {
     avl_node *node;
     
+    if (AVL_PROMOTE_FAILED (tree))
+        return NULL;
     node = tree->root->right;
     if (node == NULL || node->key == NULL) return NULL;
 
@@ -736,6 +4043,9 @@ avl_iterate_index_range (avl_tree * tree,
   unsigned long num_left;
   avl_node * node;
 
+  if (tree->flags & AVL_TREE_ENGINE)
+    return AVL_ENGINE (tree)->iterate_index_range (tree, iter_fun, low, high, iter_arg);
+
   if (high > tree->length) {
     return -1;
   }
@@ -764,6 +4074,143 @@ avl_iterate_index_range (avl_tree * tree,
   return 0;
 }
 
+/*
+ * Like avl_iterate_index_range() but front to back, with the real index.
+ * Recursing like avl_iterate_inorder_helper() only touches each node once,
+ * climbing back up with avl_get_next() would load every parent again.
+ */
+
+static int
+avl_iterate_index_helper (avl_node * node,
+              unsigned long base,
+              avl_iter_index_fun_type iter_fun,
+              unsigned long low,
+              unsigned long high,
+              void * iter_arg)
+{
+  while (node) {
+    unsigned long index = base + AVL_GET_RANK (node) - 1;
+
+    if (low < index && avl_iterate_index_helper (node->left, base, iter_fun, low, high, iter_arg) != 0)
+      return -1;
+    if (index >= high)
+      return 0;
+    if (index >= low && iter_fun (index, node->key, iter_arg) != 0)
+      return -1;
+    base = index + 1;
+    node = node->right;
+  }
+  return 0;
+}
+
+static int
+avl_iterate_index_inorder (avl_tree * tree,
+               avl_iter_index_fun_type iter_fun,
+               unsigned long low,
+               unsigned long high,
+               void * iter_arg)
+{
+  if (tree->flags & AVL_TREE_ENGINE)
+    return AVL_ENGINE (tree)->iterate_index_inorder (tree, iter_fun, low, high, iter_arg);
+
+  if (high > tree->length)
+    return -1;
+  if (high <= low)
+    return 0;
+  return avl_iterate_index_helper (tree->root->right, 0, iter_fun, low, high, iter_arg);
+}
+
+typedef struct {
+  avl_tree *            tree;
+  avl_iter_index_fun_type iter_fun;
+  unsigned long         low;
+  unsigned long         high;
+  void *                iter_arg;
+  int                   result;
+} avl_partition;
+
+static void *
+avl_partition_run (void * arg)
+{
+  avl_partition * part = arg;
+
+  part->result = avl_iterate_index_inorder (part->tree, part->iter_fun,
+                        part->low, part->high, part->iter_arg);
+  return NULL;
+}
+
+int
+avl_iterate_inorder_parallel (avl_tree * tree,
+                  avl_iter_index_fun_type iter_fun,
+                  void ** part_args,
+                  unsigned int parts)
+{
+  avl_partition * part;
+  unsigned long length = tree->length;
+  unsigned int i;
+  int result = 0;
+#ifndef NO_THREAD
+  pthread_t * workers;
+  char * started = NULL;
+#endif
+
+  if (!parts)
+    return -1;
+
+  part = calloc (parts, sizeof (avl_partition));
+  if (!part)
+    return -1;
+
+  /* the first <length % parts> partitions get one key more */
+  for (i = 0; i < parts; i++) {
+    part[i].tree = tree;
+    part[i].iter_fun = iter_fun;
+    part[i].low = (length / parts) * i + (i < length % parts ? i : length % parts);
+    part[i].high = part[i].low + length / parts + (i < length % parts ? 1 : 0);
+    part[i].iter_arg = part_args[i];
+  }
+
+#ifndef NO_THREAD
+  /* plain pthreads, the thread module may not be initialized */
+  workers = calloc (parts, sizeof (pthread_t));
+  if (workers)
+    started = calloc (parts, 1);
+  if (started) {
+    /* the caller does the first partition itself */
+    for (i = 1; i < parts; i++) {
+      if (part[i].low < part[i].high)
+        started[i] = pthread_create (&workers[i], NULL, avl_partition_run, &part[i]) == 0;
+    }
+  }
+#endif
+
+  for (i = 0; i < parts; i++) {
+#ifndef NO_THREAD
+    if (started && started[i])
+      continue;
+#endif
+    avl_partition_run (&part[i]);
+  }
+
+#ifndef NO_THREAD
+  if (started) {
+    for (i = 1; i < parts; i++) {
+      if (started[i])
+        pthread_join (workers[i], NULL);
+    }
+  }
+  free (started);
+  free (workers);
+#endif
+
+  for (i = 0; i < parts; i++) {
+    if (part[i].result != 0)
+      result = -1;
+  }
+  free (part);
+  return result;
+}
+
 /* If <key> is present in the tree, return that key's node, and set <*index>
  * appropriately.  If not, return NULL, and set <*index> to the position
  * representing the closest preceding value.
@@ -819,6 +4266,19 @@ avl_get_span_by_key (avl_tree * tree,
   unsigned long m, i, j;
   avl_node * node;
 
+  if (tree->flags & AVL_TREE_ENGINE) {
+    i = AVL_ENGINE (tree)->bound (tree, key, 0, NULL, NULL);
+    j = AVL_ENGINE (tree)->bound (tree, key, 1, NULL, NULL);
+    /* like below, a missing key gives the index of the one before */
+    if (i == j)
+      *low = *high = i - 1;
+    else {
+      *low = i;
+      *high = j;
+    }
+    return 0;
+  }
+
   node = avl_get_index_by_key (tree, key, &m);
 
   /* did we find an exact match?
@@ -872,6 +4332,15 @@ avl_get_span_by_two_keys (avl_tree * tree,
     high_key = temp;
   }
 
+  if (tree->flags & AVL_TREE_ENGINE) {
+    /* same quirk as below, a present <high_key> excludes its last copy */
+    *low = AVL_ENGINE (tree)->bound (tree, low_key, 0, NULL, NULL);
+    j = AVL_ENGINE (tree)->bound (tree, high_key, 1, NULL, NULL);
+    i = AVL_ENGINE (tree)->bound (tree, high_key, 0, NULL, NULL);
+    *high = (i < j) ? j - 1 : i;
+    return 0;
+  }
+
   low_node = avl_get_index_by_key (tree, low_key, &i);
   high_node = avl_get_index_by_key (tree, high_key, &j);
 
@@ -909,43 +4378,49 @@ avl_get_item_by_key_most (avl_tree * tree,
               void * key,
               void **value_address)
 {
-  avl_node * x = tree->root->right;
+  avl_node * x;
+  unsigned long depth = 0;
   *value_address = NULL;
 
-  if (!x) {
-    return -1;
+  if (tree->flags & AVL_TREE_ENGINE) {
+    AVL_ENGINE (tree)->bound (tree, key, 1, NULL, value_address);
+    return *value_address ? 0 : -1;
   }
-  while (1) {
+
+#ifndef NO_THREAD
+  if (tree->lockless) {
+    if (!avl_lockless_seek (tree, key, AVL_SEEK_MOST, value_address, NULL))
+      return -1;
+    return 0;
+  }
+#endif
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  *value_address = avl_coupled_seek (tree, key, AVL_SEEK_MOST);
+  return *value_address ? 0 : -1;
+#endif
+
+  x = tree->root->right;
+  while (x) {
     int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
 
+    depth++;
     if (compare_result == 0) {
       *value_address = x->key;
-      return 0;
+      break;
     } else if (compare_result < 0) {
       /* the given key is less than the current key */
-      if (x->left) {
-    x = x->left;
-      } else {
-    if (*value_address) 
-      return 0;
-    else
-      return -1;
-      }
+      x = x->left;
     } else {
       /* the given key is more than the current key */
       /* save this value, it might end up being the right one! */
       *value_address = x->key;
-      if (x->right) {
-    /* there is a bigger entry */
-    x = x->right;
-      } else {
-    if (*value_address) 
-      return 0;
-    else
-      return -1;
-      }
+      x = x->right;
     }
   }
+  if (tree->stats)
+    avl_stats_lookup (tree, depth, depth);
+  /* <x> is left on an exact match */
+  return (x || *value_address) ? 0 : -1;
 }
 
 int
@@ -953,45 +4428,284 @@ avl_get_item_by_key_least (avl_tree * tree,
                void * key,
                void **value_address)
 {
-  avl_node * x = tree->root->right;
+  avl_node * x;
+  unsigned long depth = 0;
   *value_address = NULL;
 
-  if (!x) {
-    return -1;
+  if (tree->flags & AVL_TREE_ENGINE) {
+    AVL_ENGINE (tree)->bound (tree, key, 0, value_address, NULL);
+    return *value_address ? 0 : -1;
   }
-  while (1) {
+
+#ifndef NO_THREAD
+  if (tree->lockless) {
+    if (!avl_lockless_seek (tree, key, AVL_SEEK_LEAST, value_address, NULL))
+      return -1;
+    return 0;
+  }
+#endif
+#if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
+  *value_address = avl_coupled_seek (tree, key, AVL_SEEK_LEAST);
+  return *value_address ? 0 : -1;
+#endif
+
+  x = tree->root->right;
+  while (x) {
     int compare_result = tree->compare_fun (tree->compare_arg, key, x->key);
+
+    depth++;
     if (compare_result == 0) {
       *value_address = x->key;
-      return 0;  /* exact match */
+      break;  /* exact match */
     } else if (compare_result < 0) {
       /* the given key is less than the current key */
       /* save this value, it might end up being the right one! */
       *value_address = x->key;
-      if (x->left) {
-    x = x->left;
-      } else {
-    if (*value_address)  /* we have found a valid entry */
-      return 0; 
-    else
-      return -1;
-      }
+      x = x->left;
     } else {
-      if (x->right) {
-    /* there is a bigger entry */
-    x = x->right;
-      } else {
-    if (*value_address)  /* we have found a valid entry */
-      return 0; 
-    else
+      x = x->right;
+    }
+  }
+  if (tree->stats)
+    avl_stats_lookup (tree, depth, depth);
+  /* <x> is left on an exact match */
+  return (x || *value_address) ? 0 : -1;
+}
+
+/*
+ * Range aggregates.  A node inside the range whose subtree is not cut by
+ * a bound contributes its aggregate as a whole, so only the nodes on the
+ * paths to the two bounds are looked at one by one.
+ */
+
+typedef struct {
+  avl_tree *            tree;
+  void *                low_key;
+  void *                high_key;
+  void *                value;
+  void *                scratch;
+  int                   have;
+} avl_aggregate_query;
+
+static void
+avl_aggregate_append (avl_aggregate_query * q, const void * next)
+{
+  const avl_augment * ops = &q->tree->aggregates->ops;
+
+  if (q->have) {
+    ops->combine (ops->arg, q->value, next);
+  } else {
+    memcpy (q->value, next, ops->size);
+    q->have = 1;
+  }
+}
+
+/* adds up the keys of <x> that are in range, <low> and <high> say which bounds can cut it */
+
+static void
+avl_aggregate_helper (avl_aggregate_query * q, avl_node * x, int low, int high)
+{
+  avl_tree * tree = q->tree;
+
+  while (x) {
+    if (low && tree->compare_fun (tree->compare_arg, x->key, q->low_key) < 0) {
+      x = x->right;
+    } else if (high && tree->compare_fun (tree->compare_arg, x->key, q->high_key) > 0) {
+      x = x->left;
+    } else if (!low && !high) {
+      avl_aggregate_append (q, AVL_AGGREGATE (x));
+      return;
+    } else {
+      /* only <low> can cut the left subtree, only <high> the right one */
+      avl_aggregate_helper (q, x->left, low, 0);
+      tree->aggregates->ops.lift (tree->aggregates->ops.arg, q->scratch, x->key);
+      avl_aggregate_append (q, q->scratch);
+      low = 0;
+      x = x->right;
+    }
+  }
+}
+
+int
+avl_aggregate_range (avl_tree * tree,
+             void * low_key,
+             void * high_key,
+             void * value)
+{
+  avl_aggregate_query q;
+  /* most aggregates are a few numbers */
+  union {
+    long double         align;
+    void *              pointer;
+    char                bytes[64];
+  } scratch;
+
+  if (!tree->aggregates)
+    return -1;
+
+  q.tree = tree;
+  q.low_key = low_key;
+  q.high_key = high_key;
+  q.value = value;
+  q.have = 0;
+  if (tree->aggregates->ops.size <= sizeof (scratch)) {
+    q.scratch = &scratch;
+  } else {
+    q.scratch = malloc (tree->aggregates->ops.size);
+    if (!q.scratch)
       return -1;
-      }
+  }
+
+  avl_aggregate_helper (&q, tree->root->right, low_key != NULL, high_key != NULL);
+
+  if (q.scratch != &scratch)
+    free (q.scratch);
+  return q.have ? 0 : -1;
+}
+
+int
+avl_aggregate_update (avl_tree * tree,
+             void * key)
+{
+  avl_node * x;
+
+  if (!tree->aggregates)
+    return -1;
+
+  /* <key> itself may be any of the keys that compare equal to it */
+  x = avl_get_node_by_key (tree, key);
+  if (!x)
+    return -1;
+  while (x->key != key) {
+    avl_node * prev = avl_get_prev (x);
+    if (!prev || tree->compare_fun (tree->compare_arg, key, prev->key) != 0)
+      break;
+    x = prev;
+  }
+  while (x && x->key != key) {
+    x = avl_get_next (x);
+    if (x && tree->compare_fun (tree->compare_arg, key, x->key) != 0)
+      x = NULL;
+  }
+  if (!x)
+    return -1;
+
+  avl_aggregate_path (tree, x);
+  return 0;
+}
+
+void
+avl_cursor_init (avl_cursor * cursor, avl_tree * tree)
+{
+  cursor->tree = tree;
+  cursor->node = NULL;
+}
+
+/*
+ * Go from the cursor towards <key> and leave the cursor on the node we
+ * ended on.  Returns that node and its comparison with <key>, or NULL
+ * for an empty tree.
+ */
+
+static avl_node *
+avl_cursor_descend (avl_cursor * cursor, void * key, int * compare_result)
+{
+  avl_tree * tree = cursor->tree;
+  avl_node * x = cursor->node;
+  int c;
+
+  if (x) {
+    c = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (c == 0) {
+      *compare_result = 0;
+      return x;
     }
+    x = avl_finger_climb (tree, x, key, (c < 0) ? -1 : +1, 0);
+  } else {
+    if (AVL_PROMOTE_FAILED (tree))
+      return NULL;
+    x = tree->root->right;
+    if (!x)
+      return NULL;
+  }
+
+  while (1) {
+    avl_node * next;
+
+    c = tree->compare_fun (tree->compare_arg, key, x->key);
+    if (c == 0)
+      break;
+    next = (c < 0) ? x->left : x->right;
+    if (!next)
+      break;
+    x = next;
   }
+  cursor->node = x;
+  *compare_result = c;
+  return x;
+}
+
+int
+avl_cursor_seek (avl_cursor * cursor, void * key, void ** value_address)
+{
+  int c;
+  avl_node * x = avl_cursor_descend (cursor, key, &c);
+
+  if (!x || c != 0)
+    return -1;
+  *value_address = x->key;
+  return 0;
+}
+
+int
+avl_cursor_seek_least (avl_cursor * cursor, void * key, void ** value_address)
+{
+  int c;
+  avl_node * x = avl_cursor_descend (cursor, key, &c);
+
+  /* we stopped right of <key>, or left of it with the successor being
+   * the one we want
+   */
+  if (x && c > 0)
+    x = avl_get_next (x);
+  if (!x)
+    return -1;
+  cursor->node = x;
+  *value_address = x->key;
+  return 0;
+}
+
+int
+avl_cursor_next (avl_cursor * cursor, void ** value_address)
+{
+  avl_node * x = cursor->node ? avl_get_next (cursor->node) : avl_get_first (cursor->tree);
+
+  if (!x)
+    return -1;
+  cursor->node = x;
+  *value_address = x->key;
+  return 0;
+}
+
+int
+avl_cursor_prev (avl_cursor * cursor, void ** value_address)
+{
+  avl_node * x;
+
+  if (!cursor->node)
+    return -1;
+  x = avl_get_prev (cursor->node);
+  if (!x)
+    return -1;
+  cursor->node = x;
+  *value_address = x->key;
+  return 0;
 }
 
 #define AVL_MAX(X, Y)  ((X) > (Y) ? (X) : (Y))
 
+/* returns the height of <node>, or -1 if the subtree is out of balance */
+
 static long
 avl_verify_balance (avl_node * node)
 {
@@ -1000,28 +4714,34 @@ avl_verify_balance (avl_node * node)
   } else {
     long lh = avl_verify_balance (node->left);
     long rh = avl_verify_balance (node->right);
+    if (lh < 0 || rh < 0) {
+      return -1;
+    }
     if ((rh - lh) != AVL_GET_BALANCE(node)) {
-      return 0;
+      return -1;
     }
     if (((lh - rh) > 1) || ((lh - rh) < -1)) {
-      return 0;
+      return -1;
     }
     return (1 + AVL_MAX (lh, rh));
   }
 }
     
-static void
+static int
 avl_verify_parent (avl_node * node, avl_node * parent)
 {
   if (node->parent != parent) {
-    return;
+    return -1;
   }
   if (node->left) {
-    avl_verify_parent (node->left, node);
+    if (avl_verify_parent (node->left, node) != 0)
+      return -1;
   }
   if (node->right) {
-    avl_verify_parent (node->right, node);
+    if (avl_verify_parent (node->right, node) != 0)
+      return -1;
   }
+  return 0;
 }
 
 static long
@@ -1045,15 +4765,25 @@ avl_verify_rank (avl_node * node)
   }
 }
 
-/* sanity-check the tree */
+/* sanity-check the tree, returns -1 if the balance, parent
+ * links or length are wrong.
+ */
 
 int
 avl_verify (avl_tree * tree)
 {
+  if (tree->flags & AVL_TREE_ENGINE)
+    return AVL_ENGINE (tree)->verify (tree);
+
   if (tree->length) {
-    avl_verify_balance (tree->root->right);
-    avl_verify_parent  (tree->root->right, tree->root);
-    avl_verify_rank    (tree->root->right);
+    if (avl_verify_balance (tree->root->right) < 0)
+      return -1;
+    /* the parent links of a snapshot belong to the tree */
+    if (!(tree->flags & AVL_TREE_SNAPSHOT)
+        && avl_verify_parent  (tree->root->right, tree->root) != 0)
+      return -1;
+    if ((unsigned long) avl_verify_rank (tree->root->right) != tree->length)
+      return -1;
   }
   return (0);
 }
@@ -1154,7 +4884,9 @@ avl_print_tree (avl_tree * tree, avl_key_printer_fun_type key_printer)
   if (!key_printer) {
     key_printer = default_key_printer;
   }
-  if (tree->length) {
+  if (tree->flags & AVL_TREE_ENGINE) {
+    AVL_ENGINE (tree)->print (tree, key_printer);
+  } else if (tree->length) {
     print_node (key_printer, tree->root->right, &top);
   } else {
     fprintf (stdout, "<empty tree>\n");
@@ -1164,11 +4896,23 @@ avl_print_tree (avl_tree * tree, avl_key_printer_fun_type key_printer)
 
 void avl_tree_rlock(avl_tree *tree)
 {
+#ifndef NO_THREAD
+    if (tree->stats) {
+        avl_stats_lock(tree, 0);
+        return;
+    }
+#endif
     thread_rwlock_rlock(&tree->rwlock);
 }
 
 void avl_tree_wlock(avl_tree *tree)
 {
+#ifndef NO_THREAD
+    if (tree->stats) {
+        avl_stats_lock(tree, 1);
+        return;
+    }
+#endif
     thread_rwlock_wlock(&tree->rwlock);
 }
 
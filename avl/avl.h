@@ -12,6 +12,8 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #define AVL_KEY_PRINTER_BUFLEN (256)
 
 #ifndef NO_THREAD
@@ -22,6 +24,10 @@ extern "C" {
 #define thread_rwlock_rlock(x) do{}while(0)
 #define thread_rwlock_wlock(x) do{}while(0)
 #define thread_rwlock_unlock(x) do{}while(0)
+#define thread_spin_create(x) do{}while(0)
+#define thread_spin_destroy(x) do{}while(0)
+#define thread_spin_lock(x) do{}while(0)
+#define thread_spin_unlock(x) do{}while(0)
 #endif
 
 typedef struct avl_node_tag {
@@ -35,11 +41,20 @@ typedef struct avl_node_tag {
    * The rest of the bits are used for <rank>
    */
   unsigned int        rank_and_balance;
+  /* the tree generation the node was made in, see avl_snapshot() */
+  unsigned int        generation;
 #if !defined(NO_THREAD) && defined(HAVE_AVL_NODE_LOCK)
   rwlock_t rwlock;
 #endif
 } avl_node;
 
+/*
+ * Get the structure that embeds <node> as its <member>, for trees
+ * created with avl_tree_new_intrusive().
+ */
+#define AVL_CONTAINER_OF(node, type, member) \
+  ((type *)((char *)(node) - offsetof(type, member)))
+
 #define AVL_GET_BALANCE(n)    ((int)(((n)->rank_and_balance & 3) - 1))
 
 #define AVL_GET_RANK(n)    (((n)->rank_and_balance >> 2))
@@ -54,11 +69,52 @@ typedef struct avl_node_tag {
 
 struct _avl_tree;
 
+/*
+ * Slab allocator for avl_node.  A pool hands out nodes from big slabs and
+ * keeps freed nodes on a free list, so inserting and deleting does not go
+ * through malloc() for every node.  A pool can be private to a single tree
+ * (it is then released in bulk by avl_tree_free()) or shared between trees.
+ */
+typedef struct _avl_node_pool avl_node_pool;
+
+/* state of a tree in lockless read mode, see avl_tree_set_lockless() */
+struct _avl_lockless;
+/* removed nodes and keys waiting for readers, see avl_tree_set_deferred_free() */
+struct _avl_reclaim;
+struct thread_epoch_tag;
+/* snapshot bookkeeping, see avl_snapshot() */
+struct _avl_cow;
+/* exact match index, see avl_tree_set_hash() */
+struct _avl_hash;
+/* what a tree without avl_node calls into, see avl_tree_new_btree() */
+struct _avl_engine;
+/* per thread counters, see avl_tree_set_stats() */
+struct _avl_stats;
+/* see avl_tree_new_augmented() */
+struct _avl_aggregates;
+
 typedef int (*avl_key_compare_fun_type)    (void * compare_arg, void * a, void * b);
+typedef unsigned long (*avl_key_hash_fun_type)    (void * compare_arg, void * key);
 typedef int (*avl_iter_fun_type)    (void * key, void * iter_arg);
 typedef int (*avl_iter_index_fun_type)    (unsigned long index, void * key, void * iter_arg);
 typedef int (*avl_free_key_fun_type)    (void * key);
 typedef int (*avl_key_printer_fun_type)    (char *, void *);
+/* see avl_serialize() */
+typedef size_t (*avl_key_writer_fun_type)    (void * key, char * buffer, size_t size);
+
+/*
+ * What avl_tree_new_augmented() keeps for every subtree.  A value is
+ * <size> bytes.  <lift> sets <value> to what <key> alone adds up to,
+ * <combine> turns <value> into what <value> followed by <next> adds up
+ * to.  <combine> must be associative but need not be commutative, so
+ * e.g. "first key in order" works as well as a sum.  Both get <arg>.
+ */
+typedef struct {
+  size_t                size;
+  void                  (*lift) (void * arg, void * value, void * key);
+  void                  (*combine) (void * arg, void * value, const void * next);
+  void *                arg;
+} avl_augment;
 
 /*
  * <compare_fun> and <compare_arg> let us associate a particular compare
@@ -68,13 +124,45 @@ typedef int (*avl_key_printer_fun_type)    (char *, void *);
 #ifdef _mangle
 # define avl_tree_new _mangle(avl_tree_new)
 # define avl_node_new _mangle(avl_node_new)
+# define avl_node_pool_new _mangle(avl_node_pool_new)
+# define avl_node_pool_free _mangle(avl_node_pool_free)
+# define avl_tree_new_with_pool _mangle(avl_tree_new_with_pool)
+# define avl_tree_new_from_sorted _mangle(avl_tree_new_from_sorted)
+# define avl_tree_new_intrusive _mangle(avl_tree_new_intrusive)
+# define avl_tree_new_augmented _mangle(avl_tree_new_augmented)
+# define avl_tree_new_btree _mangle(avl_tree_new_btree)
+# define avl_tree_new_compact _mangle(avl_tree_new_compact)
+# define avl_tree_new_small _mangle(avl_tree_new_small)
+# define avl_tree_new_mapped _mangle(avl_tree_new_mapped)
+# define avl_serialize _mangle(avl_serialize)
+# define avl_freeze _mangle(avl_freeze)
 # define avl_tree_free _mangle(avl_tree_free)
+# define avl_tree_set_lockless _mangle(avl_tree_set_lockless)
+# define avl_tree_set_deferred_free _mangle(avl_tree_set_deferred_free)
+# define avl_tree_set_hash _mangle(avl_tree_set_hash)
+# define avl_tree_set_stats _mangle(avl_tree_set_stats)
+# define avl_tree_get_stats _mangle(avl_tree_get_stats)
+# define avl_tree_read_enter _mangle(avl_tree_read_enter)
+# define avl_tree_read_leave _mangle(avl_tree_read_leave)
+# define avl_snapshot _mangle(avl_snapshot)
+# define avl_snapshot_free _mangle(avl_snapshot_free)
 # define avl_insert _mangle(avl_insert)
+# define avl_insert_node _mangle(avl_insert_node)
+# define avl_link_node _mangle(avl_link_node)
+# define avl_link_node_ranked _mangle(avl_link_node_ranked)
 # define avl_delete _mangle(avl_delete)
+# define avl_delete_node _mangle(avl_delete_node)
+# define avl_insert_batch _mangle(avl_insert_batch)
+# define avl_delete_batch _mangle(avl_delete_batch)
+# define avl_delete_index_range _mangle(avl_delete_index_range)
+# define avl_split _mangle(avl_split)
+# define avl_join _mangle(avl_join)
+# define avl_get_node_by_key _mangle(avl_get_node_by_key)
 # define avl_get_by_index _mangle(avl_get_by_index)
 # define avl_get_by_key _mangle(avl_get_by_key)
 # define avl_iterate_inorder _mangle(avl_iterate_inorder)
 # define avl_iterate_index_range _mangle(avl_iterate_index_range)
+# define avl_iterate_inorder_parallel _mangle(avl_iterate_inorder_parallel)
 # define avl_tree_rlock _mangle(avl_tree_rlock)
 # define avl_tree_wlock _mangle(avl_tree_wlock)
 # define avl_tree_wlock _mangle(avl_tree_wlock)
@@ -89,8 +177,17 @@ typedef int (*avl_key_printer_fun_type)    (char *, void *);
 # define avl_get_first _mangle(avl_get_first)
 # define avl_get_prev _mangle(avl_get_prev)
 # define avl_get_next _mangle(avl_get_next)
+# define avl_get_first_locked _mangle(avl_get_first_locked)
+# define avl_get_next_locked _mangle(avl_get_next_locked)
 # define avl_get_item_by_key_most _mangle(avl_get_item_by_key_most)
 # define avl_get_item_by_key_least _mangle(avl_get_item_by_key_least)
+# define avl_aggregate_range _mangle(avl_aggregate_range)
+# define avl_aggregate_update _mangle(avl_aggregate_update)
+# define avl_cursor_init _mangle(avl_cursor_init)
+# define avl_cursor_seek _mangle(avl_cursor_seek)
+# define avl_cursor_seek_least _mangle(avl_cursor_seek_least)
+# define avl_cursor_next _mangle(avl_cursor_next)
+# define avl_cursor_prev _mangle(avl_cursor_prev)
 #endif
 
 typedef struct _avl_tree {
@@ -99,6 +196,17 @@ typedef struct _avl_tree {
   unsigned int          length;
   avl_key_compare_fun_type    compare_fun;
   void *             compare_arg;
+  avl_node_pool *       pool;
+  unsigned int          flags;
+  struct _avl_lockless *    lockless;
+  struct _avl_reclaim *     reclaim;
+  /* keys live in an engine for avl_tree_new_btree(), _compact() and _small() */
+  const struct _avl_engine *    engine_ops;
+  void *                engine;
+  struct _avl_cow *     cow;
+  struct _avl_hash *    hash;
+  struct _avl_stats *   stats;
+  struct _avl_aggregates *  aggregates;
 #ifndef NO_THREAD
   rwlock_t rwlock;
 #endif
@@ -107,6 +215,135 @@ typedef struct _avl_tree {
 avl_tree * avl_tree_new (avl_key_compare_fun_type compare_fun, void * compare_arg);
 avl_node * avl_node_new (void * key, avl_node * parent);
 
+/* <nodes_per_slab> of 0 selects a sensible default. */
+avl_node_pool * avl_node_pool_new (unsigned int nodes_per_slab);
+
+/* Drops the caller's reference. The pool goes away once no tree uses it. */
+void avl_node_pool_free (avl_node_pool * pool);
+
+/*
+ * Like avl_tree_new() but takes nodes from <pool>.  If <pool> is NULL a
+ * private pool is created for the tree.  The tree holds its own reference
+ * to the pool, so a shared pool can be released by the caller right away.
+ */
+avl_tree * avl_tree_new_with_pool (
+  avl_key_compare_fun_type compare_fun,
+  void *        compare_arg,
+  avl_node_pool *    pool
+  );
+
+/*
+ * Build a tree out of <n> <keys> that are already in ascending order
+ * in O(n).  The result is perfectly balanced.  Returns NULL if the keys
+ * are not sorted according to <compare_fun> or memory runs out.
+ */
+avl_tree * avl_tree_new_from_sorted (
+  avl_key_compare_fun_type compare_fun,
+  void *        compare_arg,
+  void **        keys,
+  unsigned long        n
+  );
+
+/*
+ * Create a tree whose nodes are embedded in the keys themselves, so
+ * inserting and deleting never allocates.  Use avl_insert_node() and
+ * avl_delete_node() with such a tree, avl_insert() is refused.  Since
+ * a node is part of its key, free_key_fun may free the whole structure.
+ */
+avl_tree * avl_tree_new_intrusive (avl_key_compare_fun_type compare_fun, void * compare_arg);
+
+/*
+ * Create a tree that keeps the aggregate <augment> describes for every
+ * subtree up to date, so avl_aggregate_range() takes O(log n).  Inserts
+ * and deletes call <augment>'s functions O(log n) times.  Nodes come
+ * with room for the aggregate, so avl_insert_node() and avl_link_node()
+ * must not be used.  avl_snapshot(), avl_split() and avl_join() refuse
+ * such a tree.  Returns NULL if memory runs out and when built with
+ * HAVE_AVL_NODE_LOCK.
+ */
+avl_tree * avl_tree_new_augmented (
+  avl_key_compare_fun_type compare_fun,
+  void *        compare_arg,
+  const avl_augment *   augment
+  );
+
+/*
+ * Create a tree that keeps its keys in a B+tree with wide nodes instead
+ * of one node per key.  Lookups touch far fewer cache lines and a key
+ * costs about a pointer of memory.  The key based functions, the index
+ * functions, batches, iteration, avl_verify() and avl_print_tree() work
+ * as for any other tree.  There are no avl_node for such a tree, so
+ * avl_get_first() and avl_get_node_by_key() return NULL, avl_insert_node()
+ * fails and neither cursors, avl_get_next() nor the lockless read mode
+ * can be used.
+ */
+avl_tree * avl_tree_new_btree (avl_key_compare_fun_type compare_fun, void * compare_arg);
+
+/*
+ * Create a tree whose nodes sit in one array and link each other by
+ * 32 bit index, 24 bytes a key on 64 bit systems instead of a malloc()ed
+ * avl_node of 40.  Everything said about avl_tree_new_btree() applies.
+ */
+avl_tree * avl_tree_new_compact (avl_key_compare_fun_type compare_fun, void * compare_arg);
+
+/*
+ * Create a tree for a handful of keys.  Up to 32 keys sit in one sorted
+ * array and there is no sentinel root either, so a tree of a dozen keys
+ * costs two allocations instead of fourteen.  It turns into an ordinary
+ * tree for good once it grows past that, or as soon as anything that
+ * works on avl_node is called: avl_get_first(), avl_get_node_by_key(),
+ * cursors, avl_insert_node(), avl_split(), avl_join(), avl_snapshot(),
+ * avl_delete_index_range() or enabling the lockless read mode, deferred
+ * frees or the counters.  That is a write, so take the write lock around
+ * those calls if the tree is shared.  avl_tree_set_hash() is remembered
+ * and only builds its index then.  avl_link_node() needs a tree that has
+ * been turned already.  Returns NULL if memory runs out.
+ */
+avl_tree * avl_tree_new_small (avl_key_compare_fun_type compare_fun, void * compare_arg);
+
+/*
+ * Write the keys of <tree> to <fd> in a form avl_tree_new_mapped() can
+ * use as is.  <key_writer> puts the bytes of <key> into <buffer> if there
+ * are no more than <size> and returns how many there are, like
+ * snprintf().  <fd> should be positioned at the start of an empty file.
+ * Returns -1 if writing fails or memory runs out.
+ */
+int avl_serialize (avl_tree * tree, int fd, avl_key_writer_fun_type key_writer);
+
+/*
+ * Map a file written by avl_serialize() and serve lookups from it.  The
+ * keys passed to <compare_fun> and handed out are pointers to the bytes
+ * <key_writer> wrote, aligned to 8 bytes, and stay valid until
+ * avl_tree_free(), which ignores its free_key_fun.  The tree is read
+ * only, inserts and deletes fail.  Otherwise what is said about
+ * avl_tree_new_btree() applies.  Returns NULL if <fd> does not hold such
+ * a file.
+ *
+ * Opening reads the 24 bytes per key that locate the keys and checks
+ * them against the size of the file, the keys themselves are only read
+ * as searches touch them.  A key may end anywhere before the next one
+ * starts, <compare_fun> has to tell from its bytes where that is.  The
+ * file must not change while it is mapped, truncating it makes lookups
+ * crash.
+ */
+avl_tree * avl_tree_new_mapped (
+  int            fd,
+  avl_key_compare_fun_type compare_fun,
+  void *        compare_arg
+  );
+
+/*
+ * Make a read only copy of <tree> that is laid out for lookups: the
+ * keys in one array in breadth first order, searched without branching
+ * on the comparisons and with the next levels prefetched.  With 1M keys
+ * avl_get_by_key() takes about a third of the time it does on the tree.
+ * The copy shares the keys with <tree>, so only one of the two may be
+ * freed with a free_key_fun.  Take <tree>'s read lock around the call.
+ * Otherwise what is said about avl_tree_new_mapped() applies.  Returns
+ * NULL if memory runs out.
+ */
+avl_tree * avl_freeze (avl_tree * tree);
+
 void avl_tree_free (
   avl_tree *        tree,
   avl_free_key_fun_type    free_key_fun
@@ -117,24 +354,139 @@ int avl_insert (
   void *        key
   );
 
+/* link the caller provided <node> with <key> into the tree */
+int avl_insert_node (
+  avl_tree *        tree,
+  avl_node *        node,
+  void *        key
+  );
+
+/*
+ * Link <node> with <key> in as the <direction> (<0 left, >0 right) child
+ * of <parent>, which must be a free slot that keeps the tree in order,
+ * and rebalance.  This is for callers that do their own descent, e.g.
+ * with an inlined comparison.  For an empty tree <parent> is tree->root
+ * and <direction> is right.
+ */
+void avl_link_node (
+  avl_tree *        tree,
+  avl_node *        parent,
+  int            direction,
+  avl_node *        node,
+  void *        key
+  );
+
+/*
+ * Same as avl_link_node(), for callers that already incremented the rank
+ * of every node they went left at during their descent.
+ */
+void avl_link_node_ranked (
+  avl_tree *        tree,
+  avl_node *        parent,
+  int            direction,
+  avl_node *        node,
+  void *        key
+  );
+
 int avl_delete (
   avl_tree *        tree,
   void *        key,
   avl_free_key_fun_type    free_key_fun
   );
 
+/* remove <node> from the tree without searching for it */
+int avl_delete_node (
+  avl_tree *        tree,
+  avl_node *        node,
+  avl_free_key_fun_type    free_key_fun
+  );
+
+/*
+ * Insert or delete a whole set of <n> <keys> under one write lock.  The
+ * <keys> array is sorted in place.  Big batches are merged with the tree
+ * and rebuilt in O(n + length), small ones are done key by key, each
+ * search starting from the previous key.  avl_insert_batch() returns -1
+ * and leaves the tree alone if memory runs out or the tree is intrusive,
+ * avl_delete_batch() returns the number of keys it deleted, or -1.
+ */
+int avl_insert_batch (
+  avl_tree *        tree,
+  void **        keys,
+  unsigned long        n
+  );
+
+long avl_delete_batch (
+  avl_tree *        tree,
+  void **        keys,
+  unsigned long        n,
+  avl_free_key_fun_type    free_key_fun
+  );
+
+/*
+ * Delete the keys with index <low> up to, not including, <high> in
+ * O(log n) plus what freeing them costs.  Built with HAVE_AVL_NODE_LOCK
+ * or while the tree has snapshots, the keys are deleted one by one.
+ * Returns -1 for a bad range and for B+tree and compact trees.
+ */
+int avl_delete_index_range (
+  avl_tree *        tree,
+  unsigned long        low,
+  unsigned long        high,
+  avl_free_key_fun_type    free_key_fun
+  );
+
+/*
+ * Move all keys not less than <key> out of <tree> into a new tree, which
+ * is returned, in O(log n).  The new tree uses the same pool, and the
+ * same lockless read mode and deferred frees with the same epoch.
+ */
+avl_tree * avl_split (
+  avl_tree *        tree,
+  void *        key
+  );
+
+/*
+ * Move all keys of <b> to the end of <a> in O(log n), <b> is left empty.
+ * None of them may be less than the last key of <a>, and both trees have
+ * to use the same pool, both be intrusive or not and both be in lockless
+ * read mode or use deferred frees with the same epoch or not.  Returns -1
+ * if not.
+ *
+ * avl_split() and avl_join() are not available for B+tree and compact
+ * trees, trees with snapshots or a hash index, or when built with
+ * HAVE_AVL_NODE_LOCK.
+ */
+int avl_join (
+  avl_tree *        a,
+  avl_tree *        b
+  );
+
 int avl_get_by_index (
   avl_tree *        tree,
   unsigned long        index,
   void **        value_address
   );
 
+/*
+ * Built with HAVE_AVL_NODE_LOCK, avl_get_by_key(), avl_get_item_by_key_most()
+ * and avl_get_item_by_key_least() need no tree lock, but every node lock
+ * is dropped again before they return.  The key they hand out is then
+ * only good until the next avl_delete() that frees it.  To keep using it,
+ * set up the tree with avl_tree_set_deferred_free() and do the lookup and
+ * everything with the key between thread_epoch_enter() and
+ * thread_epoch_leave(), or take the tree read lock around both.
+ */
 int avl_get_by_key (
   avl_tree *        tree,
   void *        key,
   void **        value_address
   );
 
+avl_node * avl_get_node_by_key (
+  avl_tree *        tree,
+  void *        key
+  );
+
 int avl_iterate_inorder (
   avl_tree *        tree,
   avl_iter_fun_type    iter_fun,
@@ -149,6 +501,24 @@ int avl_iterate_index_range (
   void *        iter_arg
   );
 
+/*
+ * Cut the index space into <parts> runs of the same length, give or take
+ * one, and walk them at the same time, each from its own thread.  Run i
+ * calls <iter_fun> in order for its keys, with their index and
+ * <part_args>[i], so merging the per run results in run order gives the
+ * same answer every time.  The tree must not change meanwhile, take the
+ * read lock.  The threads are plain pthreads, thread_initialize() is not
+ * needed.  Runs whose thread cannot be started, and all of them without
+ * thread support, are done by the caller one after another.  Returns -1
+ * if <iter_fun> stopped any of the runs.
+ */
+int avl_iterate_inorder_parallel (
+  avl_tree *        tree,
+  avl_iter_index_fun_type iter_fun,
+  void **        part_args,
+  unsigned int        parts
+  );
+
 int avl_get_span_by_key (
   avl_tree *        tree,
   void *        key,
@@ -177,6 +547,17 @@ avl_node *avl_get_prev(avl_node * node);
 
 avl_node *avl_get_next(avl_node * node);
 
+/*
+ * Hand over hand walk that does not need the tree lock if built with
+ * HAVE_AVL_NODE_LOCK.  The node returned is read locked, the next call
+ * unlocks it again.  Stopping early, release it with avl_node_unlock().
+ * This is no snapshot, keys inserted or deleted meanwhile may or may not
+ * show up.  Without node locks these are avl_get_first() and
+ * avl_get_next().
+ */
+avl_node *avl_get_first_locked(avl_tree *tree);
+avl_node *avl_get_next_locked(avl_node * node);
+
 /* These two are from David Ascher <david_ascher@brown.edu> */
 
 int avl_get_item_by_key_most (
@@ -191,6 +572,47 @@ int avl_get_item_by_key_least (
   void **        value_address
   );
 
+/*
+ * Add up the keys from <low_key> to <high_key>, both included, in order
+ * into the <size> bytes at <value>, see avl_tree_new_augmented().  NULL
+ * leaves that end open.  Take the read lock as for a lookup.  Returns -1
+ * if no key is in the range or the tree keeps no aggregates.
+ */
+int avl_aggregate_range (
+  avl_tree *        tree,
+  void *        low_key,
+  void *        high_key,
+  void *        value
+  );
+
+/*
+ * Call this with the write lock held after changing what <key> adds up
+ * to in place.  <key> must be in the tree.  Returns -1 if it is not.
+ */
+int avl_aggregate_update (avl_tree * tree, void * key);
+
+/*
+ * A cursor remembers the node of the last lookup, the next seek starts
+ * from there and only goes up as far as needed.  Keys d positions away
+ * cost O(log d) instead of O(log n), which pays for sorted or otherwise
+ * local access.  Take the tree lock as for the other lookups.  Deleting
+ * the node the cursor is on leaves it dangling, avl_cursor_init() it
+ * again then.  The seeks return 0 and set *value_address if they found
+ * a key, but leave the cursor close to <key> in any case.
+ */
+typedef struct _avl_cursor {
+  avl_tree *            tree;
+  avl_node *            node;
+} avl_cursor;
+
+void avl_cursor_init (avl_cursor * cursor, avl_tree * tree);
+int avl_cursor_seek (avl_cursor * cursor, void * key, void ** value_address);
+/* the smallest key that is not less than <key> */
+int avl_cursor_seek_least (avl_cursor * cursor, void * key, void ** value_address);
+/* step to the next or previous key, next on a fresh cursor is the first one */
+int avl_cursor_next (avl_cursor * cursor, void ** value_address);
+int avl_cursor_prev (avl_cursor * cursor, void ** value_address);
+
 /* optional locking stuff */
 void avl_tree_rlock(avl_tree *tree);
 void avl_tree_wlock(avl_tree *tree);
@@ -199,6 +621,99 @@ void avl_node_rlock(avl_node *node);
 void avl_node_wlock(avl_node *node);
 void avl_node_unlock(avl_node *node);
 
+/*
+ * Lockless read mode.  Once enabled, avl_get_by_key(), avl_get_node_by_key(),
+ * avl_get_item_by_key_most(), avl_get_item_by_key_least() and
+ * avl_iterate_inorder() do not need the tree lock anymore but must be
+ * called between avl_tree_read_enter() and avl_tree_read_leave().  Writers
+ * keep taking avl_tree_wlock().  Deleted nodes and keys are only released
+ * after all readers that could have seen them left, using <epoch> (NULL
+ * for the process wide one).  Other lookups, e.g. by index, and nodes
+ * returned to the reader still need the lock.  Must be called before the
+ * tree is shared.  Returns -1 without thread support.
+ */
+int avl_tree_set_lockless(avl_tree *tree, struct thread_epoch_tag *epoch);
+
+/*
+ * Hand the keys that deletes remove to free_key_fun only once every
+ * thread that was inside thread_epoch_enter() of <epoch> (NULL for the
+ * process wide one) at the time has left.  A reader that looks a key up
+ * between thread_epoch_enter() and thread_epoch_leave() can then drop
+ * the tree lock right away and keep using the key until it leaves the
+ * epoch.  Nodes are still released at once, so this is not the lockless
+ * read mode.  That mode defers keys like this already.  Must be called
+ * before the tree is shared.  Returns -1 for trees with an engine, for
+ * an epoch other than the one of the lockless read mode, if memory runs
+ * out and without thread support.
+ */
+int avl_tree_set_deferred_free(avl_tree *tree, struct thread_epoch_tag *epoch);
+
+/* takes the read lock if the tree is not in lockless read mode */
+void avl_tree_read_enter(avl_tree *tree);
+void avl_tree_read_leave(avl_tree *tree);
+
+/*
+ * Keep a hash index of the keys next to the tree, so avl_get_by_key()
+ * finds a key in O(1) instead of O(log n).  Everything else still uses
+ * the tree.  <hash_fun> gets the tree's compare_arg and must give keys
+ * that compare equal the same hash.  Inserts may now fail if the index
+ * cannot grow.  It pays off from about eight string keys on, with 1000
+ * keys a lookup takes a third of the time.  NULL drops the index.
+ * Returns -1 if memory runs out, for intrusive, B+tree, compact and
+ * lockless trees, and when built with HAVE_AVL_NODE_LOCK.
+ */
+int avl_tree_set_hash(avl_tree *tree, avl_key_hash_fun_type hash_fun);
+
+/* see avl_tree_get_stats(), all but height and max_depth wrap around */
+typedef struct {
+  unsigned long         lookups;        /* searches by key */
+  unsigned long         compares;       /* compare_fun calls they made */
+  unsigned long         inserts;
+  unsigned long         deletes;
+  unsigned long         rotations;      /* a double rotation counts two */
+  unsigned long         max_depth;      /* deepest node a lookup or insert reached */
+  unsigned int          height;         /* tree->height right now */
+  unsigned long         lock_waits;     /* avl_tree_rlock() and _wlock() that blocked */
+  unsigned long         lock_wait_ns;   /* time they spent blocked */
+} avl_tree_stats;
+
+/*
+ * Count what the tree does, or stop counting for a false <enable>.
+ * Enabling again starts from zero.  Threads count into one of 16
+ * records of the tree, so a lookup costs a thread specific lookup and a
+ * few atomic adds more, and a lock is only clocked when it is taken
+ * already.  Any number of trees may count, they take about 1 KB each.
+ * Lookups through avl_tree_set_hash()'s index are not counted.  Must not
+ * be called while other threads use the tree.  Returns -1 for trees
+ * without avl_node, see avl_tree_new_btree(), and if memory runs out,
+ * which includes turning a small tree into an ordinary one.
+ */
+int avl_tree_set_stats(avl_tree *tree, int enable);
+
+/* Returns -1 if the tree is not counting.  May run next to any user. */
+int avl_tree_get_stats(avl_tree *tree, avl_tree_stats *stats);
+
+/*
+ * Take a read only snapshot of <tree> in O(1).  The snapshot shares all
+ * nodes with the tree, a writer copies a node and the path above it
+ * before changing it, so the snapshot keeps showing the tree as it was.
+ * avl_iterate_inorder(), avl_get_by_key(), avl_get_by_index(),
+ * avl_get_item_by_key_most() and avl_get_item_by_key_least() work on a
+ * snapshot without any lock, while the tree is changed; nothing that
+ * follows parent links does.  Deleted keys are only freed once every
+ * snapshot that may still see them was released.
+ *
+ * Taking and releasing a snapshot needs the write lock of the tree.
+ * While snapshots exist, writes may replace nodes, so node pointers and
+ * cursors do not stay valid across writes, avl_delete() may fail if
+ * memory runs out and avl_link_node() must not be used.  Release all
+ * snapshots before the tree.  Returns NULL for intrusive, B+tree,
+ * compact and lockless trees and when built with HAVE_AVL_NODE_LOCK.
+ */
+avl_tree * avl_snapshot (avl_tree * tree);
+/* avl_tree_free() on a snapshot does the same */
+void avl_snapshot_free (avl_tree * snapshot);
+
 #ifdef __cplusplus
 }
 #endif
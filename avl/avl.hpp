@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Typed C++ front end for the avl tree.
+ *
+ * icecast::avl_tree<T, Compare> stores its values in nodes that embed the
+ * avl_node, so there is one allocation per value.  Searches are done here
+ * with <Compare> inlined, linking, unlinking and rebalancing is left to
+ * avl.c so ranks and balance factors are maintained by the same code as
+ * for C trees.  c_tree() gives access to the underlying tree for the rank
+ * based and debugging functions of the C API.
+ */
+
+#ifndef __AVL_HPP
+#define __AVL_HPP
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <utility>
+
+#include "avl.h"
+
+namespace icecast {
+
+template <typename T, typename Compare = std::less<T> >
+class avl_tree {
+  public:
+    class iterator;
+
+  private:
+    struct node : public ::avl_node {
+        template <typename... Args>
+        explicit node(Args&&... args) : value(std::forward<Args>(args)...) {}
+        T value;
+    };
+
+    ::avl_tree *tree_;
+    Compare compare_;
+
+    static node *to_node(::avl_node *n) { return static_cast<node *>(n); }
+
+    /* for functions of the C API that compare by themselves */
+    static int compare_fun(void *compare_arg, void *a, void *b)
+    {
+        const Compare &compare = *static_cast<Compare *>(compare_arg);
+        const T &va = static_cast<node *>(a)->value;
+        const T &vb = static_cast<node *>(b)->value;
+
+        if (compare(va, vb))
+            return -1;
+        if (compare(vb, va))
+            return 1;
+        return 0;
+    }
+
+    static ::avl_node *last_node(::avl_tree *t)
+    {
+        ::avl_node *x = t->root->right;
+
+        while (x && x->right)
+            x = x->right;
+        return x;
+    }
+
+    static int free_fun(void *key)
+    {
+        delete static_cast<node *>(key);
+        return 1;
+    }
+
+    ::avl_node *find_node(const T &key) const
+    {
+        ::avl_node *x = tree_->root->right;
+
+        while (x) {
+            const T &v = to_node(x)->value;
+            if (compare_(key, v)) {
+                x = x->left;
+            } else if (compare_(v, key)) {
+                x = x->right;
+            } else {
+                return x;
+            }
+        }
+        return NULL;
+    }
+
+    T *link(node *n)
+    {
+        ::avl_node *parent = tree_->root;
+        ::avl_node *x = parent->right;
+        int direction = 1;
+
+        /* equal keys go to the left, like avl_insert() does. Ranks are
+         * counted up on the way down, linking cannot fail.
+         */
+        while (x) {
+            parent = x;
+            if (!compare_(to_node(x)->value, n->value)) {
+                AVL_SET_RANK(x, (AVL_GET_RANK(x) + 1));
+                direction = -1;
+                x = x->left;
+            } else {
+                direction = 1;
+                x = x->right;
+            }
+        }
+        avl_link_node_ranked(tree_, parent, direction, n, n);
+        return &n->value;
+    }
+
+  public:
+    class iterator {
+      public:
+        iterator() : tree_(NULL), node_(NULL) {}
+        T &operator*() const { return to_node(node_)->value; }
+        T *operator->() const { return &to_node(node_)->value; }
+        iterator &operator++() { node_ = avl_get_next(node_); return *this; }
+        /* --end() is the last value */
+        iterator &operator--() { node_ = node_ ? avl_get_prev(node_) : last_node(tree_); return *this; }
+        bool operator==(const iterator &other) const { return node_ == other.node_; }
+        bool operator!=(const iterator &other) const { return node_ != other.node_; }
+
+      private:
+        friend class avl_tree;
+        iterator(::avl_tree *t, ::avl_node *n) : tree_(t), node_(n) {}
+        ::avl_tree *tree_;
+        ::avl_node *node_;
+    };
+
+    explicit avl_tree(const Compare &compare = Compare())
+        : tree_(NULL), compare_(compare)
+    {
+        tree_ = avl_tree_new_intrusive(compare_fun, &compare_);
+        if (!tree_)
+            throw std::bad_alloc();
+    }
+
+    ~avl_tree()
+    {
+        if (tree_)
+            avl_tree_free(tree_, free_fun);
+    }
+
+    avl_tree(const avl_tree &) = delete;
+    avl_tree &operator=(const avl_tree &) = delete;
+
+    std::size_t size() const { return tree_->length; }
+    bool empty() const { return tree_->length == 0; }
+
+    /* Duplicates are allowed, the new value ends up in front of equal ones. */
+    T *insert(const T &value) { return link(new node(value)); }
+    T *insert(T &&value) { return link(new node(std::move(value))); }
+
+    template <typename... Args>
+    T *emplace(Args&&... args) { return link(new node(std::forward<Args>(args)...)); }
+
+    T *find(const T &key)
+    {
+        ::avl_node *x = find_node(key);
+        return x ? &to_node(x)->value : NULL;
+    }
+
+    const T *find(const T &key) const
+    {
+        ::avl_node *x = find_node(key);
+        return x ? &to_node(x)->value : NULL;
+    }
+
+    /* removes one value equal to <key>, returns false if there was none */
+    bool erase(const T &key)
+    {
+        ::avl_node *x = find_node(key);
+
+        if (!x)
+            return false;
+        avl_delete_node(tree_, x, free_fun);
+        return true;
+    }
+
+    void erase(iterator it) { avl_delete_node(tree_, it.node_, free_fun); }
+
+    /* the <index>th value in order, using the ranks */
+    T *at_index(unsigned long index) const
+    {
+        void *key;
+
+        if (avl_get_by_index(tree_, index, &key) != 0)
+            return NULL;
+        return &static_cast<node *>(key)->value;
+    }
+
+    iterator begin() const { return iterator(tree_, avl_get_first(tree_)); }
+    iterator end() const { return iterator(tree_, NULL); }
+
+    ::avl_tree *c_tree() const { return tree_; }
+};
+
+}
+
+#endif /* __AVL_HPP */
@@ -0,0 +1,734 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * B+tree engine for the avl tree API.
+ *
+ * Keys live in wide leaves, 32 to a node, which are linked both ways for
+ * in order walks.  Inner nodes hold a separator for every child but the
+ * first, which is the first key below that child.  So separators are
+ * always keys still in the tree, we never compare with a freed one.
+ * Inner nodes also count the keys below each child, which gives us the
+ * ranks for the index based functions.  Nodes other than the root never
+ * drop below half full.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avl_btree.h"
+
+#define AVL_BTREE_ORDER (32)
+#define AVL_BTREE_MIN (AVL_BTREE_ORDER / 2)
+
+typedef struct avl_bnode_tag {
+  unsigned int          leaf;
+  /* keys in a leaf, children in an inner node */
+  unsigned int          n;
+  /* in inner nodes keys[i] is the separator before child[i], keys[0] is unused */
+  void *                keys[AVL_BTREE_ORDER];
+} avl_bnode;
+
+typedef struct avl_bleaf_tag {
+  avl_bnode             head;
+  struct avl_bleaf_tag *    prev;
+  struct avl_bleaf_tag *    next;
+} avl_bleaf;
+
+typedef struct {
+  avl_bnode             head;
+  avl_bnode *           child[AVL_BTREE_ORDER];
+  unsigned long         count[AVL_BTREE_ORDER];
+} avl_binner;
+
+typedef struct {
+  avl_bnode *           root;
+  avl_bleaf *           first;
+  avl_bleaf *           last;
+} avl_btree;
+
+#define AVL_BTREE(tree) ((avl_btree *) (tree)->engine)
+#define AVL_BLEAF(node) ((avl_bleaf *) (node))
+#define AVL_BINNER(node) ((avl_binner *) (node))
+
+static avl_bnode *
+avl_bleaf_new (void)
+{
+  avl_bleaf * leaf = (avl_bleaf *) calloc (1, sizeof (avl_bleaf));
+
+  if (!leaf)
+    return NULL;
+  leaf->head.leaf = 1;
+  return &leaf->head;
+}
+
+static avl_bnode *
+avl_binner_new (void)
+{
+  avl_binner * inner = (avl_binner *) calloc (1, sizeof (avl_binner));
+
+  if (!inner)
+    return NULL;
+  return &inner->head;
+}
+
+void *
+avl_btree_new (void)
+{
+  avl_btree * bt = (avl_btree *) malloc (sizeof (avl_btree));
+
+  if (!bt)
+    return NULL;
+  bt->root = avl_bleaf_new ();
+  if (!bt->root) {
+    free (bt);
+    return NULL;
+  }
+  bt->first = bt->last = AVL_BLEAF (bt->root);
+  return bt;
+}
+
+static void
+avl_btree_free_helper (avl_bnode * node, avl_free_key_fun_type free_key_fun)
+{
+  unsigned int i;
+
+  if (node->leaf) {
+    if (free_key_fun) {
+      for (i = 0; i < node->n; i++)
+        free_key_fun (node->keys[i]);
+    }
+  } else {
+    for (i = 0; i < node->n; i++)
+      avl_btree_free_helper (AVL_BINNER (node)->child[i], free_key_fun);
+  }
+  free (node);
+}
+
+void
+avl_btree_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+{
+  avl_btree * bt = AVL_BTREE (tree);
+
+  avl_btree_free_helper (bt->root, free_key_fun);
+  free (bt);
+  tree->engine = NULL;
+}
+
+/*
+ * First position in <keys>[<from>..<n>-1] with compare(key, keys[pos]) < <limit>,
+ * <n> if there is none.  <limit> 1 gives the first key not less than <key>,
+ * 0 the first one greater.
+ */
+
+static unsigned int
+avl_btree_search (avl_tree * tree, void ** keys, unsigned int from, unsigned int n, void * key, int limit)
+{
+  unsigned int lo = from, hi = n;
+
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+    if (tree->compare_fun (tree->compare_arg, key, keys[mid]) < limit)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+/* the child of <node> to follow, see avl_btree_search() for <limit> */
+
+static unsigned int
+avl_btree_route (avl_tree * tree, avl_bnode * node, void * key, int limit)
+{
+  return avl_btree_search (tree, node->keys, 1, node->n, key, limit) - 1;
+}
+
+/* the smallest key below <node> */
+
+static void *
+avl_btree_leftmost (avl_bnode * node)
+{
+  while (!node->leaf)
+    node = AVL_BINNER (node)->child[0];
+  return node->keys[0];
+}
+
+static unsigned long
+avl_btree_size (avl_bnode * node)
+{
+  unsigned long size = 0;
+  unsigned int i;
+
+  if (node->leaf)
+    return node->n;
+  for (i = 0; i < node->n; i++)
+    size += AVL_BINNER (node)->count[i];
+  return size;
+}
+
+/* make room in <node> and put <child> with separator <sep> at <pos> */
+
+static void
+avl_binner_put (avl_bnode * node, unsigned int pos, void * sep, avl_bnode * child, unsigned long count)
+{
+  avl_binner * inner = AVL_BINNER (node);
+  unsigned int move = node->n - pos;
+
+  memmove (&node->keys[pos + 1], &node->keys[pos], sizeof (void *) * move);
+  memmove (&inner->child[pos + 1], &inner->child[pos], sizeof (avl_bnode *) * move);
+  memmove (&inner->count[pos + 1], &inner->count[pos], sizeof (unsigned long) * move);
+  node->keys[pos] = sep;
+  inner->child[pos] = child;
+  inner->count[pos] = count;
+  node->n++;
+}
+
+/*
+ * Insert <key> below <node>.  If <node> had to be split the new right
+ * half is returned and <*sep> set to its separator.  <spare> holds a
+ * fresh node for every level that is full, starting with this one.
+ */
+
+static avl_bnode *
+avl_btree_insert_helper (avl_tree * tree, avl_bnode * node, void * key, void ** sep, avl_bnode ** spare)
+{
+  avl_bnode * right;
+  unsigned int pos, half = AVL_BTREE_ORDER / 2;
+
+  if (node->leaf) {
+    pos = avl_btree_search (tree, node->keys, 0, node->n, key, 1);
+    if (node->n < AVL_BTREE_ORDER) {
+      memmove (&node->keys[pos + 1], &node->keys[pos], sizeof (void *) * (node->n - pos));
+      node->keys[pos] = key;
+      node->n++;
+      return NULL;
+    }
+
+    right = *spare;
+    *spare = NULL;
+    memcpy (right->keys, &node->keys[half], sizeof (void *) * (AVL_BTREE_ORDER - half));
+    right->n = AVL_BTREE_ORDER - half;
+    node->n = half;
+
+    AVL_BLEAF (right)->prev = AVL_BLEAF (node);
+    AVL_BLEAF (right)->next = AVL_BLEAF (node)->next;
+    if (AVL_BLEAF (node)->next)
+      AVL_BLEAF (node)->next->prev = AVL_BLEAF (right);
+    else
+      AVL_BTREE (tree)->last = AVL_BLEAF (right);
+    AVL_BLEAF (node)->next = AVL_BLEAF (right);
+
+    /* equal keys stay left of the split */
+    if (pos <= half) {
+      memmove (&node->keys[pos + 1], &node->keys[pos], sizeof (void *) * (node->n - pos));
+      node->keys[pos] = key;
+      node->n++;
+    } else {
+      pos -= half;
+      memmove (&right->keys[pos + 1], &right->keys[pos], sizeof (void *) * (right->n - pos));
+      right->keys[pos] = key;
+      right->n++;
+    }
+    *sep = right->keys[0];
+    return right;
+  } else {
+    avl_binner * inner = AVL_BINNER (node);
+    avl_bnode * split;
+    void * child_sep;
+
+    pos = avl_btree_route (tree, node, key, 1);
+    split = avl_btree_insert_helper (tree, inner->child[pos], key, &child_sep, spare + 1);
+    if (!split) {
+      inner->count[pos]++;
+      return NULL;
+    }
+
+    inner->count[pos] = avl_btree_size (inner->child[pos]);
+    if (node->n < AVL_BTREE_ORDER) {
+      avl_binner_put (node, pos + 1, child_sep, split, avl_btree_size (split));
+      return NULL;
+    }
+
+    right = *spare;
+    *spare = NULL;
+    memcpy (&right->keys[1], &node->keys[half + 1], sizeof (void *) * (AVL_BTREE_ORDER - half - 1));
+    memcpy (AVL_BINNER (right)->child, &inner->child[half], sizeof (avl_bnode *) * (AVL_BTREE_ORDER - half));
+    memcpy (AVL_BINNER (right)->count, &inner->count[half], sizeof (unsigned long) * (AVL_BTREE_ORDER - half));
+    right->n = AVL_BTREE_ORDER - half;
+    node->n = half;
+    *sep = node->keys[half];
+
+    pos++;
+    if (pos <= half) {
+      avl_binner_put (node, pos, child_sep, split, avl_btree_size (split));
+    } else {
+      avl_binner_put (right, pos - half, child_sep, split, avl_btree_size (split));
+    }
+    return right;
+  }
+}
+
+/* more levels than 32^40 keys need */
+#define AVL_BTREE_MAX_HEIGHT (40)
+
+int
+avl_btree_insert (avl_tree * tree, void * key)
+{
+  avl_btree * bt = AVL_BTREE (tree);
+  avl_bnode * spare[AVL_BTREE_MAX_HEIGHT + 1];
+  avl_bnode * node, * split, * root = NULL;
+  unsigned int depth = 0, i;
+  int failed = 0;
+  void * sep;
+
+  /* Splits can go all the way up.  Get the memory for them first, so
+   * running out of it leaves the tree as it was.
+   */
+  for (node = bt->root; ; depth++) {
+    spare[depth] = NULL;
+    if (node->n == AVL_BTREE_ORDER) {
+      spare[depth] = node->leaf ? avl_bleaf_new () : avl_binner_new ();
+      failed |= !spare[depth];
+    }
+    if (node->leaf)
+      break;
+    node = AVL_BINNER (node)->child[avl_btree_route (tree, node, key, 1)];
+  }
+  if (bt->root->n == AVL_BTREE_ORDER) {
+    root = avl_binner_new ();
+    failed |= !root;
+  }
+  if (failed) {
+    for (i = 0; i <= depth; i++)
+      free (spare[i]);
+    free (root);
+    return -1;
+  }
+
+  split = avl_btree_insert_helper (tree, bt->root, key, &sep, spare);
+  if (split) {
+    AVL_BINNER (root)->child[0] = bt->root;
+    AVL_BINNER (root)->count[0] = avl_btree_size (bt->root);
+    AVL_BINNER (root)->child[1] = split;
+    AVL_BINNER (root)->count[1] = avl_btree_size (split);
+    root->keys[1] = sep;
+    root->n = 2;
+    bt->root = root;
+    tree->height = tree->height + 1;
+  } else {
+    free (root);
+  }
+  /* full nodes below one that had room did not need theirs */
+  for (i = 0; i <= depth; i++)
+    free (spare[i]);
+
+  tree->length = tree->length + 1;
+  return 0;
+}
+
+/*
+ * Child <i> of <node> dropped below half full.  Take a key or child from
+ * a sibling that has one to spare, or merge with a sibling otherwise.
+ */
+
+static void
+avl_btree_fix (avl_tree * tree, avl_bnode * node, unsigned int i)
+{
+  avl_binner * inner = AVL_BINNER (node);
+  avl_bnode * child = inner->child[i];
+  avl_bnode * left = i > 0 ? inner->child[i - 1] : NULL;
+  avl_bnode * right = i + 1 < node->n ? inner->child[i + 1] : NULL;
+  unsigned int j;
+
+  if (left && left->n > AVL_BTREE_MIN) {
+    /* move the last entry of <left> to the front of <child> */
+    if (child->leaf) {
+      memmove (&child->keys[1], &child->keys[0], sizeof (void *) * child->n);
+      child->keys[0] = left->keys[left->n - 1];
+      node->keys[i] = child->keys[0];
+      inner->count[i - 1]--;
+      inner->count[i]++;
+    } else {
+      avl_binner * c = AVL_BINNER (child);
+      avl_binner * l = AVL_BINNER (left);
+      unsigned long moved = l->count[left->n - 1];
+
+      memmove (&child->keys[1], &child->keys[0], sizeof (void *) * child->n);
+      memmove (&c->child[1], &c->child[0], sizeof (avl_bnode *) * child->n);
+      memmove (&c->count[1], &c->count[0], sizeof (unsigned long) * child->n);
+      c->child[0] = l->child[left->n - 1];
+      c->count[0] = moved;
+      child->keys[1] = node->keys[i];
+      node->keys[i] = left->keys[left->n - 1];
+      inner->count[i - 1] -= moved;
+      inner->count[i] += moved;
+    }
+    left->n--;
+    child->n++;
+    return;
+  }
+
+  if (right && right->n > AVL_BTREE_MIN) {
+    /* move the first entry of <right> to the end of <child> */
+    if (child->leaf) {
+      child->keys[child->n] = right->keys[0];
+      memmove (&right->keys[0], &right->keys[1], sizeof (void *) * (right->n - 1));
+      node->keys[i + 1] = right->keys[0];
+      inner->count[i]++;
+      inner->count[i + 1]--;
+    } else {
+      avl_binner * c = AVL_BINNER (child);
+      avl_binner * r = AVL_BINNER (right);
+      unsigned long moved = r->count[0];
+
+      child->keys[child->n] = node->keys[i + 1];
+      c->child[child->n] = r->child[0];
+      c->count[child->n] = moved;
+      node->keys[i + 1] = right->keys[1];
+      memmove (&right->keys[1], &right->keys[2], sizeof (void *) * (right->n - 2));
+      memmove (&r->child[0], &r->child[1], sizeof (avl_bnode *) * (right->n - 1));
+      memmove (&r->count[0], &r->count[1], sizeof (unsigned long) * (right->n - 1));
+      inner->count[i] += moved;
+      inner->count[i + 1] -= moved;
+    }
+    right->n--;
+    child->n++;
+    return;
+  }
+
+  /* nobody has anything to spare, merge child <i> into its left
+   * sibling, or the right sibling into child <i>
+   */
+  if (!left) {
+    left = child;
+    child = right;
+    i = i + 1;
+  }
+  if (child->leaf) {
+    memcpy (&left->keys[left->n], child->keys, sizeof (void *) * child->n);
+    AVL_BLEAF (left)->next = AVL_BLEAF (child)->next;
+    if (AVL_BLEAF (child)->next)
+      AVL_BLEAF (child)->next->prev = AVL_BLEAF (left);
+    else
+      AVL_BTREE (tree)->last = AVL_BLEAF (left);
+  } else {
+    left->keys[left->n] = node->keys[i];
+    memcpy (&left->keys[left->n + 1], &child->keys[1], sizeof (void *) * (child->n - 1));
+    memcpy (&AVL_BINNER (left)->child[left->n], AVL_BINNER (child)->child, sizeof (avl_bnode *) * child->n);
+    memcpy (&AVL_BINNER (left)->count[left->n], AVL_BINNER (child)->count, sizeof (unsigned long) * child->n);
+  }
+  left->n += child->n;
+  inner->count[i - 1] += inner->count[i];
+  free (child);
+
+  for (j = i; j + 1 < node->n; j++) {
+    node->keys[j] = node->keys[j + 1];
+    inner->child[j] = inner->child[j + 1];
+    inner->count[j] = inner->count[j + 1];
+  }
+  node->n--;
+}
+
+/* remove and return the key at <index> below <node> */
+
+static void *
+avl_btree_delete_helper (avl_tree * tree, avl_bnode * node, unsigned long index)
+{
+  unsigned int i;
+  void * key;
+
+  if (node->leaf) {
+    key = node->keys[index];
+    memmove (&node->keys[index], &node->keys[index + 1], sizeof (void *) * (node->n - index - 1));
+    node->n--;
+    return key;
+  }
+
+  for (i = 0; index >= AVL_BINNER (node)->count[i]; i++)
+    index -= AVL_BINNER (node)->count[i];
+
+  key = avl_btree_delete_helper (tree, AVL_BINNER (node)->child[i], index);
+  AVL_BINNER (node)->count[i]--;
+  /* the separator is the first key of the child, which may be gone */
+  if (i > 0 && index == 0)
+    node->keys[i] = avl_btree_leftmost (AVL_BINNER (node)->child[i]);
+  if (AVL_BINNER (node)->child[i]->n < AVL_BTREE_MIN)
+    avl_btree_fix (tree, node, i);
+  return key;
+}
+
+int
+avl_btree_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun)
+{
+  avl_btree * bt = AVL_BTREE (tree);
+  void * at;
+  unsigned long index = avl_btree_bound (tree, key, 0, &at, NULL);
+
+  if (!at || tree->compare_fun (tree->compare_arg, key, at) != 0)
+    return -1;
+
+  at = avl_btree_delete_helper (tree, bt->root, index);
+  if (!bt->root->leaf && bt->root->n == 1) {
+    avl_bnode * old = bt->root;
+    bt->root = AVL_BINNER (old)->child[0];
+    free (old);
+    tree->height = tree->height - 1;
+  }
+  tree->length = tree->length - 1;
+
+  if (free_key_fun)
+    free_key_fun (at);
+  return 0;
+}
+
+/* leaf and position of the key at <index>, which must exist */
+
+static avl_bnode *
+avl_btree_find_index (avl_tree * tree, unsigned long index, unsigned int * pos)
+{
+  avl_bnode * node = AVL_BTREE (tree)->root;
+
+  while (!node->leaf) {
+    unsigned int i;
+    for (i = 0; index >= AVL_BINNER (node)->count[i]; i++)
+      index -= AVL_BINNER (node)->count[i];
+    node = AVL_BINNER (node)->child[i];
+  }
+  *pos = (unsigned int) index;
+  return node;
+}
+
+unsigned long
+avl_btree_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before)
+{
+  avl_bnode * node = AVL_BTREE (tree)->root;
+  int limit = upper ? 0 : 1;
+  unsigned long index = 0;
+  unsigned int pos;
+
+  while (!node->leaf) {
+    unsigned int i, child = avl_btree_route (tree, node, key, limit);
+    for (i = 0; i < child; i++)
+      index += AVL_BINNER (node)->count[i];
+    node = AVL_BINNER (node)->child[child];
+  }
+  pos = avl_btree_search (tree, node->keys, 0, node->n, key, limit);
+  index += pos;
+
+  if (at) {
+    if (pos < node->n)
+      *at = node->keys[pos];
+    else
+      *at = AVL_BLEAF (node)->next ? AVL_BLEAF (node)->next->head.keys[0] : NULL;
+  }
+  if (before) {
+    if (pos > 0)
+      *before = node->keys[pos - 1];
+    else if (AVL_BLEAF (node)->prev)
+      *before = AVL_BLEAF (node)->prev->head.keys[AVL_BLEAF (node)->prev->head.n - 1];
+    else
+      *before = NULL;
+  }
+  return index;
+}
+
+int
+avl_btree_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  avl_bnode * leaf;
+  unsigned int pos;
+
+  if (index >= tree->length)
+    return -1;
+  leaf = avl_btree_find_index (tree, index, &pos);
+  *value_address = leaf->keys[pos];
+  return 0;
+}
+
+int
+avl_btree_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  avl_bleaf * leaf;
+  unsigned int i;
+  int result;
+
+  for (leaf = AVL_BTREE (tree)->first; leaf; leaf = leaf->next) {
+    for (i = 0; i < leaf->head.n; i++) {
+      result = iter_fun (leaf->head.keys[i], iter_arg);
+      if (result != 0)
+        return result;
+    }
+  }
+  return 0;
+}
+
+/* same order and indices as avl_iterate_index_range(): from <high>-1 down */
+
+int
+avl_btree_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                   unsigned long low, unsigned long high, void * iter_arg)
+{
+  unsigned long num_left;
+  avl_bnode * node;
+  unsigned int pos;
+
+  if (high > tree->length)
+    return -1;
+  if (high <= low)
+    return 0;
+
+  num_left = high - low;
+  node = avl_btree_find_index (tree, high - 1, &pos);
+  while (num_left) {
+    num_left = num_left - 1;
+    if (iter_fun (num_left, node->keys[pos], iter_arg) != 0)
+      return -1;
+    if (pos == 0) {
+      if (!AVL_BLEAF (node)->prev)
+        break;
+      node = &AVL_BLEAF (node)->prev->head;
+      pos = node->n;
+    }
+    pos--;
+  }
+  return 0;
+}
+
+/* from <low> up to <high>-1, with the real index of every key */
+
+int
+avl_btree_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                 unsigned long low, unsigned long high, void * iter_arg)
+{
+  avl_bnode * node;
+  unsigned int pos;
+
+  if (high > tree->length)
+    return -1;
+  if (high <= low)
+    return 0;
+
+  node = avl_btree_find_index (tree, low, &pos);
+  for (; low < high; low++) {
+    if (iter_fun (low, node->keys[pos], iter_arg) != 0)
+      return -1;
+    if (++pos == node->n) {
+      if (!AVL_BLEAF (node)->next)
+        break;
+      node = &AVL_BLEAF (node)->next->head;
+      pos = 0;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Returns the number of keys below <node>, or -1 if something is broken.
+ * All keys must be within <low> and <high>, NULL for no bound.
+ */
+
+static long
+avl_btree_verify_helper (avl_tree * tree, avl_bnode * node, unsigned int depth,
+             void * low, void * high, avl_bleaf ** next_leaf)
+{
+  unsigned int i;
+  long size = 0;
+
+  if (node != AVL_BTREE (tree)->root && node->n < AVL_BTREE_MIN)
+    return -1;
+  if (node->n > AVL_BTREE_ORDER)
+    return -1;
+
+  if (node->leaf) {
+    if (depth != 1 || AVL_BLEAF (node) != *next_leaf)
+      return -1;
+    for (i = 0; i < node->n; i++) {
+      void * key = node->keys[i];
+      if (low && tree->compare_fun (tree->compare_arg, low, key) > 0)
+        return -1;
+      if (high && tree->compare_fun (tree->compare_arg, key, high) > 0)
+        return -1;
+      low = key;
+    }
+    *next_leaf = AVL_BLEAF (node)->next;
+    if (*next_leaf && (*next_leaf)->prev != AVL_BLEAF (node))
+      return -1;
+    return node->n;
+  }
+
+  if (node->n < 2 || depth < 2)
+    return -1;
+  for (i = 0; i < node->n; i++) {
+    void * child_low = i > 0 ? node->keys[i] : low;
+    void * child_high = i + 1 < node->n ? node->keys[i + 1] : high;
+    long child_size;
+
+    if (i > 0 && node->keys[i] != avl_btree_leftmost (AVL_BINNER (node)->child[i]))
+      return -1;
+    child_size = avl_btree_verify_helper (tree, AVL_BINNER (node)->child[i], depth - 1,
+                           child_low, child_high, next_leaf);
+
+    if (child_size < 0 || (unsigned long) child_size != AVL_BINNER (node)->count[i])
+      return -1;
+    size += child_size;
+  }
+  return size;
+}
+
+int
+avl_btree_verify (avl_tree * tree)
+{
+  avl_btree * bt = AVL_BTREE (tree);
+  avl_bleaf * next_leaf = bt->first;
+  long size;
+
+  if (bt->first->prev)
+    return -1;
+  size = avl_btree_verify_helper (tree, bt->root, tree->height, NULL, NULL, &next_leaf);
+  if (size < 0 || (unsigned long) size != tree->length || next_leaf)
+    return -1;
+  return 0;
+}
+
+static void
+avl_btree_print_helper (avl_bnode * node, avl_key_printer_fun_type key_printer, unsigned int depth)
+{
+  char buffer[AVL_KEY_PRINTER_BUFLEN];
+  unsigned int i;
+
+  if (node->leaf) {
+    fprintf (stdout, "%*s[", depth * 2, "");
+    for (i = 0; i < node->n; i++) {
+      key_printer (buffer, node->keys[i]);
+      fprintf (stdout, i ? " %s" : "%s", buffer);
+    }
+    fprintf (stdout, "]\n");
+    return;
+  }
+
+  for (i = 0; i < node->n; i++) {
+    if (i > 0) {
+      key_printer (buffer, node->keys[i]);
+      fprintf (stdout, "%*s%s (%lu)\n", depth * 2, "", buffer, AVL_BINNER (node)->count[i]);
+    }
+    avl_btree_print_helper (AVL_BINNER (node)->child[i], key_printer, depth + 1);
+  }
+}
+
+void
+avl_btree_print (avl_tree * tree, avl_key_printer_fun_type key_printer)
+{
+  if (tree->length) {
+    avl_btree_print_helper (AVL_BTREE (tree)->root, key_printer, 0);
+  } else {
+    fprintf (stdout, "<empty tree>\n");
+  }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * B+tree engine behind avl_tree_new_btree().  This is private to the
+ * avl library, avl.c calls into it for trees with the B+tree flag set.
+ * All functions take the avl_tree for its compare function, length and
+ * the engine state.
+ */
+
+#ifndef __AVL_BTREE_H
+#define __AVL_BTREE_H
+
+#include "avl.h"
+
+#ifdef _mangle
+# define avl_btree_new _mangle(avl_btree_new)
+# define avl_btree_free _mangle(avl_btree_free)
+# define avl_btree_insert _mangle(avl_btree_insert)
+# define avl_btree_delete _mangle(avl_btree_delete)
+# define avl_btree_bound _mangle(avl_btree_bound)
+# define avl_btree_get_by_index _mangle(avl_btree_get_by_index)
+# define avl_btree_iterate_inorder _mangle(avl_btree_iterate_inorder)
+# define avl_btree_iterate_index_range _mangle(avl_btree_iterate_index_range)
+# define avl_btree_iterate_index_inorder _mangle(avl_btree_iterate_index_inorder)
+# define avl_btree_verify _mangle(avl_btree_verify)
+# define avl_btree_print _mangle(avl_btree_print)
+#endif
+
+/* returns NULL if memory runs out */
+void * avl_btree_new (void);
+void avl_btree_free (avl_tree * tree, avl_free_key_fun_type free_key_fun);
+
+/* equal keys go in front of the ones already there, like avl_insert() */
+int avl_btree_insert (avl_tree * tree, void * key);
+int avl_btree_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun);
+
+/*
+ * Index of the first key that is not less than <key>, or with <upper>
+ * set of the first one that is greater.  <*at> and <*before> are set to
+ * the keys at that index and the one before, NULL if there is none.
+ */
+unsigned long avl_btree_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before);
+
+int avl_btree_get_by_index (avl_tree * tree, unsigned long index, void ** value_address);
+int avl_btree_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg);
+int avl_btree_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                   unsigned long low, unsigned long high, void * iter_arg);
+int avl_btree_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                 unsigned long low, unsigned long high, void * iter_arg);
+int avl_btree_verify (avl_tree * tree);
+void avl_btree_print (avl_tree * tree, avl_key_printer_fun_type key_printer);
+
+#endif /* __AVL_BTREE_H */
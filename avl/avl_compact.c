@@ -0,0 +1,572 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Compact engine for the avl tree API.
+ *
+ * The same AVL tree with ranks as avl.c, but the nodes live in a single
+ * array and refer to each other by 32 bit index, with 0 for none.  A
+ * node is the key pointer, three indices and the usual rank_and_balance,
+ * so the AVL_*_RANK and AVL_*_BALANCE macros work on it.  Deleted nodes
+ * go on a free list threaded through <left>.  Nobody outside sees the
+ * nodes, so a node with two children can simply take over the key of
+ * its predecessor when it is deleted.
+ *
+ * Balance factors of +-2 cannot be stored in two bits, the retracing
+ * code passes them to avl_compact_rebalance() instead.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "avl_compact.h"
+
+#define AVL_COMPACT_FIRST_SIZE (16)
+/* what fits into the rank bits */
+#define AVL_COMPACT_MAX_KEYS (0x3fffffffUL)
+
+typedef struct {
+  void *                key;
+  uint32_t              left;
+  uint32_t              right;
+  uint32_t              parent;
+  unsigned int          rank_and_balance;
+} avl_cnode;
+
+typedef struct {
+  /* nodes[0] is not used, so index 0 can mean none */
+  avl_cnode *           nodes;
+  uint32_t              size;
+  uint32_t              capacity;
+  uint32_t              root;
+  uint32_t              free_list;
+} avl_compact;
+
+#define AVL_COMPACT(tree) ((avl_compact *) (tree)->engine)
+
+void *
+avl_compact_new (void)
+{
+  avl_compact * c = (avl_compact *) malloc (sizeof (avl_compact));
+
+  if (!c)
+    return NULL;
+  c->nodes = (avl_cnode *) malloc (sizeof (avl_cnode) * AVL_COMPACT_FIRST_SIZE);
+  if (!c->nodes) {
+    free (c);
+    return NULL;
+  }
+  c->size = 1;
+  c->capacity = AVL_COMPACT_FIRST_SIZE;
+  c->root = 0;
+  c->free_list = 0;
+  return c;
+}
+
+static void
+avl_compact_free_helper (avl_cnode * nodes, uint32_t x, avl_free_key_fun_type free_key_fun)
+{
+  while (x) {
+    avl_compact_free_helper (nodes, nodes[x].left, free_key_fun);
+    free_key_fun (nodes[x].key);
+    x = nodes[x].right;
+  }
+}
+
+void
+avl_compact_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+{
+  avl_compact * c = AVL_COMPACT (tree);
+
+  if (free_key_fun)
+    avl_compact_free_helper (c->nodes, c->root, free_key_fun);
+  free (c->nodes);
+  free (c);
+  tree->engine = NULL;
+}
+
+/* returns 0 if memory runs out, <nodes> may have moved */
+
+static uint32_t
+avl_compact_alloc (avl_compact * c)
+{
+  uint32_t x = c->free_list;
+
+  if (x) {
+    c->free_list = c->nodes[x].left;
+    return x;
+  }
+  if (c->size == c->capacity) {
+    avl_cnode * nodes = (avl_cnode *) realloc (c->nodes, sizeof (avl_cnode) * 2 * (size_t) c->capacity);
+    if (!nodes)
+      return 0;
+    c->nodes = nodes;
+    c->capacity = c->capacity * 2;
+  }
+  return c->size++;
+}
+
+/*
+ * Rotations.  They fix up the links and ranks, balance factors are left
+ * to the caller.
+ */
+
+static void
+avl_compact_replace_child (avl_compact * c, uint32_t parent, uint32_t old_child, uint32_t new_child)
+{
+  avl_cnode * nodes = c->nodes;
+
+  nodes[new_child].parent = parent;
+  if (!parent)
+    c->root = new_child;
+  else if (nodes[parent].left == old_child)
+    nodes[parent].left = new_child;
+  else
+    nodes[parent].right = new_child;
+}
+
+static void
+avl_compact_rotate_left (avl_compact * c, uint32_t x)
+{
+  avl_cnode * nodes = c->nodes;
+  uint32_t y = nodes[x].right;
+
+  nodes[x].right = nodes[y].left;
+  if (nodes[y].left)
+    nodes[nodes[y].left].parent = x;
+  avl_compact_replace_child (c, nodes[x].parent, x, y);
+  nodes[y].left = x;
+  nodes[x].parent = y;
+  AVL_SET_RANK (&nodes[y], (AVL_GET_RANK (&nodes[y]) + AVL_GET_RANK (&nodes[x])));
+}
+
+static void
+avl_compact_rotate_right (avl_compact * c, uint32_t x)
+{
+  avl_cnode * nodes = c->nodes;
+  uint32_t y = nodes[x].left;
+
+  nodes[x].left = nodes[y].right;
+  if (nodes[y].right)
+    nodes[nodes[y].right].parent = x;
+  avl_compact_replace_child (c, nodes[x].parent, x, y);
+  nodes[y].right = x;
+  nodes[x].parent = y;
+  AVL_SET_RANK (&nodes[x], (AVL_GET_RANK (&nodes[x]) - AVL_GET_RANK (&nodes[y])));
+}
+
+/* <x> is out of balance by <balance>, +-2.  Returns the new top. */
+
+static uint32_t
+avl_compact_rebalance (avl_compact * c, uint32_t x, int balance)
+{
+  avl_cnode * nodes = c->nodes;
+  int side = balance > 0 ? +1 : -1;
+  uint32_t y = side > 0 ? nodes[x].right : nodes[x].left;
+  uint32_t z;
+  int b = AVL_GET_BALANCE (&nodes[y]);
+
+  if (b != -side) {
+    /* single rotation, <b> is only 0 after a delete */
+    if (side > 0)
+      avl_compact_rotate_left (c, x);
+    else
+      avl_compact_rotate_right (c, x);
+    AVL_SET_BALANCE (&nodes[x], (b ? 0 : side));
+    AVL_SET_BALANCE (&nodes[y], (b ? 0 : -side));
+    return y;
+  }
+
+  /* double rotation with the inner grandchild <z> on top */
+  z = side > 0 ? nodes[y].left : nodes[y].right;
+  b = AVL_GET_BALANCE (&nodes[z]);
+  if (side > 0) {
+    avl_compact_rotate_right (c, y);
+    avl_compact_rotate_left (c, x);
+  } else {
+    avl_compact_rotate_left (c, y);
+    avl_compact_rotate_right (c, x);
+  }
+  AVL_SET_BALANCE (&nodes[x], (b == side ? -side : 0));
+  AVL_SET_BALANCE (&nodes[y], (b == -side ? side : 0));
+  AVL_SET_BALANCE (&nodes[z], 0);
+  return z;
+}
+
+int
+avl_compact_insert (avl_tree * tree, void * key)
+{
+  avl_compact * c = AVL_COMPACT (tree);
+  avl_cnode * nodes;
+  uint32_t x, p, q;
+  int side = +1;
+
+  if (tree->length >= AVL_COMPACT_MAX_KEYS)
+    return -1;
+  x = avl_compact_alloc (c);
+  if (!x)
+    return -1;
+  nodes = c->nodes;
+
+  /* every node we go left at gets one more in its left subtree */
+  p = 0;
+  q = c->root;
+  while (q) {
+    p = q;
+    if (tree->compare_fun (tree->compare_arg, key, nodes[p].key) < 1) {
+      AVL_SET_RANK (&nodes[p], (AVL_GET_RANK (&nodes[p]) + 1));
+      side = -1;
+      q = nodes[p].left;
+    } else {
+      side = +1;
+      q = nodes[p].right;
+    }
+  }
+
+  nodes[x].key = key;
+  nodes[x].left = 0;
+  nodes[x].right = 0;
+  nodes[x].parent = p;
+  nodes[x].rank_and_balance = 0;
+  AVL_SET_RANK (&nodes[x], 1);
+  AVL_SET_BALANCE (&nodes[x], 0);
+  if (!p)
+    c->root = x;
+  else if (side < 0)
+    nodes[p].left = x;
+  else
+    nodes[p].right = x;
+  tree->length = tree->length + 1;
+
+  /* climb back up while the subtree below keeps growing */
+  while (p) {
+    int b = AVL_GET_BALANCE (&nodes[p]) + (nodes[p].left == x ? -1 : +1);
+
+    if (b == 0) {
+      AVL_SET_BALANCE (&nodes[p], 0);
+      return 0;
+    }
+    if (b == 2 || b == -2) {
+      avl_compact_rebalance (c, p, b);
+      return 0;
+    }
+    AVL_SET_BALANCE (&nodes[p], b);
+    x = p;
+    p = nodes[p].parent;
+  }
+  tree->height = tree->height + 1;
+  return 0;
+}
+
+int
+avl_compact_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun)
+{
+  avl_compact * c = AVL_COMPACT (tree);
+  avl_cnode * nodes = c->nodes;
+  uint32_t x = 0, y, q, p, child;
+  void * found;
+  int side;
+
+  /* the first equal key, so avl_insert_batch() can undo its inserts */
+  for (q = c->root; q; ) {
+    int compare_result = tree->compare_fun (tree->compare_arg, key, nodes[q].key);
+    if (compare_result <= 0) {
+      if (compare_result == 0)
+        x = q;
+      q = nodes[q].left;
+    } else {
+      q = nodes[q].right;
+    }
+  }
+  if (!x)
+    return -1;
+  found = nodes[x].key;
+
+  /* <y> is the node that goes, with one child at most */
+  y = x;
+  if (nodes[x].left && nodes[x].right) {
+    for (y = nodes[x].left; nodes[y].right; y = nodes[y].right)
+      ;
+    nodes[x].key = nodes[y].key;
+  }
+
+  for (q = y, p = nodes[y].parent; p; q = p, p = nodes[p].parent) {
+    if (nodes[p].left == q)
+      AVL_SET_RANK (&nodes[p], (AVL_GET_RANK (&nodes[p]) - 1));
+  }
+
+  child = nodes[y].left ? nodes[y].left : nodes[y].right;
+  p = nodes[y].parent;
+  side = (p && nodes[p].left == y) ? -1 : +1;
+  if (!p)
+    c->root = child;
+  else if (side < 0)
+    nodes[p].left = child;
+  else
+    nodes[p].right = child;
+  if (child)
+    nodes[child].parent = p;
+  nodes[y].key = NULL;
+  nodes[y].left = c->free_list;
+  c->free_list = y;
+  tree->length = tree->length - 1;
+
+  /* climb back up while the subtree below keeps shrinking */
+  while (p) {
+    int b = AVL_GET_BALANCE (&nodes[p]) - side;
+
+    if (b == 1 || b == -1) {
+      AVL_SET_BALANCE (&nodes[p], b);
+      break;
+    }
+    if (b == 0) {
+      AVL_SET_BALANCE (&nodes[p], 0);
+    } else {
+      p = avl_compact_rebalance (c, p, b);
+      if (AVL_GET_BALANCE (&nodes[p]) != 0)
+        break;
+    }
+    q = p;
+    p = nodes[q].parent;
+    if (p)
+      side = (nodes[p].left == q) ? -1 : +1;
+  }
+  if (!p)
+    tree->height = tree->height - 1;
+
+  if (free_key_fun)
+    free_key_fun (found);
+  return 0;
+}
+
+unsigned long
+avl_compact_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before)
+{
+  avl_compact * c = AVL_COMPACT (tree);
+  avl_cnode * nodes = c->nodes;
+  int limit = upper ? 0 : 1;
+  unsigned long index = 0;
+  uint32_t x = c->root, at_node = 0, before_node = 0;
+
+  while (x) {
+    if (tree->compare_fun (tree->compare_arg, key, nodes[x].key) < limit) {
+      at_node = x;
+      x = nodes[x].left;
+    } else {
+      before_node = x;
+      index = index + AVL_GET_RANK (&nodes[x]);
+      x = nodes[x].right;
+    }
+  }
+  if (at)
+    *at = at_node ? nodes[at_node].key : NULL;
+  if (before)
+    *before = before_node ? nodes[before_node].key : NULL;
+  return index;
+}
+
+/* the node at <index>, which must exist */
+
+static uint32_t
+avl_compact_find_index (avl_compact * c, unsigned long index)
+{
+  avl_cnode * nodes = c->nodes;
+  unsigned long m = index + 1;
+  uint32_t x = c->root;
+
+  while (m != AVL_GET_RANK (&nodes[x])) {
+    if (m < AVL_GET_RANK (&nodes[x])) {
+      x = nodes[x].left;
+    } else {
+      m = m - AVL_GET_RANK (&nodes[x]);
+      x = nodes[x].right;
+    }
+  }
+  return x;
+}
+
+int
+avl_compact_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  avl_compact * c = AVL_COMPACT (tree);
+
+  if (index >= tree->length)
+    return -1;
+  *value_address = c->nodes[avl_compact_find_index (c, index)].key;
+  return 0;
+}
+
+static int
+avl_compact_iterate_helper (avl_cnode * nodes, uint32_t x, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  int result;
+
+  while (x) {
+    result = avl_compact_iterate_helper (nodes, nodes[x].left, iter_fun, iter_arg);
+    if (result != 0)
+      return result;
+    result = iter_fun (nodes[x].key, iter_arg);
+    if (result != 0)
+      return result;
+    x = nodes[x].right;
+  }
+  return 0;
+}
+
+int
+avl_compact_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  avl_compact * c = AVL_COMPACT (tree);
+
+  return avl_compact_iterate_helper (c->nodes, c->root, iter_fun, iter_arg);
+}
+
+/* same order and indices as avl_iterate_index_range(): from <high>-1 down */
+
+int
+avl_compact_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                 unsigned long low, unsigned long high, void * iter_arg)
+{
+  avl_compact * c = AVL_COMPACT (tree);
+  avl_cnode * nodes = c->nodes;
+  unsigned long num_left;
+  uint32_t x;
+
+  if (high > tree->length)
+    return -1;
+  if (high <= low)
+    return 0;
+
+  num_left = high - low;
+  x = avl_compact_find_index (c, high - 1);
+  while (num_left) {
+    num_left = num_left - 1;
+    if (iter_fun (num_left, nodes[x].key, iter_arg) != 0)
+      return -1;
+    /* step to the predecessor */
+    if (nodes[x].left) {
+      for (x = nodes[x].left; nodes[x].right; x = nodes[x].right)
+        ;
+    } else {
+      while (nodes[x].parent && nodes[nodes[x].parent].left == x)
+        x = nodes[x].parent;
+      x = nodes[x].parent;
+    }
+  }
+  return 0;
+}
+
+static int
+avl_compact_index_helper (avl_cnode * nodes, uint32_t x, unsigned long base,
+              avl_iter_index_fun_type iter_fun,
+              unsigned long low, unsigned long high, void * iter_arg)
+{
+  while (x) {
+    unsigned long index = base + AVL_GET_RANK (&nodes[x]) - 1;
+
+    if (low < index && avl_compact_index_helper (nodes, nodes[x].left, base, iter_fun, low, high, iter_arg) != 0)
+      return -1;
+    if (index >= high)
+      return 0;
+    if (index >= low && iter_fun (index, nodes[x].key, iter_arg) != 0)
+      return -1;
+    base = index + 1;
+    x = nodes[x].right;
+  }
+  return 0;
+}
+
+/* from <low> up to <high>-1, with the real index of every key */
+
+int
+avl_compact_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                   unsigned long low, unsigned long high, void * iter_arg)
+{
+  avl_compact * c = AVL_COMPACT (tree);
+
+  if (high > tree->length)
+    return -1;
+  if (high <= low)
+    return 0;
+  return avl_compact_index_helper (c->nodes, c->root, 0, iter_fun, low, high, iter_arg);
+}
+
+/*
+ * Returns the height of <x>, or -1 if something is broken.  <*size> is
+ * set to the number of nodes, <*last> to the last key seen in order.
+ */
+
+static long
+avl_compact_verify_helper (avl_tree * tree, uint32_t x, uint32_t parent,
+               unsigned long * size, void ** last)
+{
+  avl_cnode * nodes = AVL_COMPACT (tree)->nodes;
+  unsigned long left_size, right_size;
+  long left_height, right_height;
+
+  if (!x) {
+    *size = 0;
+    return 0;
+  }
+  if (nodes[x].parent != parent)
+    return -1;
+
+  left_height = avl_compact_verify_helper (tree, nodes[x].left, x, &left_size, last);
+  if (left_height < 0)
+    return -1;
+  if (*last && tree->compare_fun (tree->compare_arg, *last, nodes[x].key) > 0)
+    return -1;
+  *last = nodes[x].key;
+  right_height = avl_compact_verify_helper (tree, nodes[x].right, x, &right_size, last);
+  if (right_height < 0)
+    return -1;
+
+  if (AVL_GET_RANK (&nodes[x]) != left_size + 1
+      || AVL_GET_BALANCE (&nodes[x]) != right_height - left_height)
+    return -1;
+  *size = left_size + right_size + 1;
+  return (left_height > right_height ? left_height : right_height) + 1;
+}
+
+int
+avl_compact_verify (avl_tree * tree)
+{
+  unsigned long size;
+  void * last = NULL;
+  long height = avl_compact_verify_helper (tree, AVL_COMPACT (tree)->root, 0, &size, &last);
+
+  if (height < 0 || (unsigned long) height != tree->height || size != tree->length)
+    return -1;
+  return 0;
+}
+
+static void
+avl_compact_print_helper (avl_cnode * nodes, uint32_t x, avl_key_printer_fun_type key_printer, unsigned int depth)
+{
+  char buffer[AVL_KEY_PRINTER_BUFLEN];
+
+  if (!x)
+    return;
+  avl_compact_print_helper (nodes, nodes[x].right, key_printer, depth + 1);
+  key_printer (buffer, nodes[x].key);
+  fprintf (stdout, "%*s%s (%u,%d)\n", depth * 2, "", buffer,
+       AVL_GET_RANK (&nodes[x]), AVL_GET_BALANCE (&nodes[x]));
+  avl_compact_print_helper (nodes, nodes[x].left, key_printer, depth + 1);
+}
+
+void
+avl_compact_print (avl_tree * tree, avl_key_printer_fun_type key_printer)
+{
+  if (tree->length) {
+    avl_compact_print_helper (AVL_COMPACT (tree)->nodes, AVL_COMPACT (tree)->root, key_printer, 0);
+  } else {
+    fprintf (stdout, "<empty tree>\n");
+  }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Compact engine behind avl_tree_new_compact().  This is private to the
+ * avl library, avl.c calls into it for trees that were created with it.
+ * The functions behave like their avl_btree_* counterparts.
+ */
+
+#ifndef __AVL_COMPACT_H
+#define __AVL_COMPACT_H
+
+#include "avl.h"
+
+#ifdef _mangle
+# define avl_compact_new _mangle(avl_compact_new)
+# define avl_compact_free _mangle(avl_compact_free)
+# define avl_compact_insert _mangle(avl_compact_insert)
+# define avl_compact_delete _mangle(avl_compact_delete)
+# define avl_compact_bound _mangle(avl_compact_bound)
+# define avl_compact_get_by_index _mangle(avl_compact_get_by_index)
+# define avl_compact_iterate_inorder _mangle(avl_compact_iterate_inorder)
+# define avl_compact_iterate_index_range _mangle(avl_compact_iterate_index_range)
+# define avl_compact_iterate_index_inorder _mangle(avl_compact_iterate_index_inorder)
+# define avl_compact_verify _mangle(avl_compact_verify)
+# define avl_compact_print _mangle(avl_compact_print)
+#endif
+
+/* returns NULL if memory runs out */
+void * avl_compact_new (void);
+void avl_compact_free (avl_tree * tree, avl_free_key_fun_type free_key_fun);
+
+/* equal keys go in front of the ones already there, like avl_insert() */
+int avl_compact_insert (avl_tree * tree, void * key);
+int avl_compact_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun);
+
+unsigned long avl_compact_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before);
+
+int avl_compact_get_by_index (avl_tree * tree, unsigned long index, void ** value_address);
+int avl_compact_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg);
+int avl_compact_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                   unsigned long low, unsigned long high, void * iter_arg);
+int avl_compact_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                   unsigned long low, unsigned long high, void * iter_arg);
+int avl_compact_verify (avl_tree * tree);
+void avl_compact_print (avl_tree * tree, avl_key_printer_fun_type key_printer);
+
+#endif /* __AVL_COMPACT_H */
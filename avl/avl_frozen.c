@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Frozen trees.
+ *
+ * The keys sit in one array in Eytzinger order like in a mapped file,
+ * but as plain pointers, so a cache line holds eight slots and the top
+ * four levels of every search fit in two lines.  The descent computes
+ * the next slot from the comparison instead of branching on it, and
+ * fetches the line three levels further down and the keys of both
+ * children while the compare function runs.  The keys in order and the
+ * index of each slot are kept apart from the search array, they are
+ * only needed once the search is done.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avl_frozen.h"
+
+#if defined(__GNUC__)
+#define AVL_FROZEN_PREFETCH(p) __builtin_prefetch (p)
+#else
+#define AVL_FROZEN_PREFETCH(p) do{}while(0)
+#endif
+
+typedef struct {
+  /* <length>+1 keys, slot 0 is not used */
+  void **               layout;
+  /* the index of the key in each slot */
+  unsigned int *        index;
+  /* the keys in order */
+  void **               order;
+} avl_frozen;
+
+#define AVL_FROZEN(tree) ((avl_frozen *) (tree)->engine)
+
+/* put the keys in <order> into Eytzinger order, returns the next index */
+
+static unsigned long
+avl_frozen_layout (avl_frozen * f, unsigned long length, unsigned long slot, unsigned long index)
+{
+  if (slot > length)
+    return index;
+  index = avl_frozen_layout (f, length, 2 * slot, index);
+  f->layout[slot] = f->order[index];
+  f->index[slot] = (unsigned int) index;
+  return avl_frozen_layout (f, length, 2 * slot + 1, index + 1);
+}
+
+typedef struct {
+  void **               keys;
+  unsigned long         count;
+} avl_frozen_collect;
+
+static int
+avl_frozen_collect_key (void * key, void * iter_arg)
+{
+  avl_frozen_collect * collect = (avl_frozen_collect *) iter_arg;
+
+  collect->keys[collect->count++] = key;
+  return 0;
+}
+
+static void
+avl_frozen_release (avl_frozen * f)
+{
+  free (f->layout);
+  free (f->index);
+  free (f->order);
+  free (f);
+}
+
+void *
+avl_frozen_new (avl_tree * tree, avl_tree * source)
+{
+  unsigned long n = source->length;
+  avl_frozen_collect collect;
+  avl_frozen * f;
+
+  f = (avl_frozen *) calloc (1, sizeof (avl_frozen));
+  if (!f)
+    return NULL;
+  f->layout = (void **) malloc (sizeof (void *) * (n + 1));
+  f->index = (unsigned int *) malloc (sizeof (unsigned int) * (n + 1));
+  f->order = (void **) malloc (sizeof (void *) * (n + 1));
+  if (!f->layout || !f->index || !f->order) {
+    avl_frozen_release (f);
+    return NULL;
+  }
+
+  collect.keys = f->order;
+  collect.count = 0;
+  if (avl_iterate_inorder (source, avl_frozen_collect_key, &collect) != 0 || collect.count != n) {
+    avl_frozen_release (f);
+    return NULL;
+  }
+  f->layout[0] = NULL;
+  f->index[0] = 0;
+  avl_frozen_layout (f, n, 1, 0);
+
+  tree->length = (unsigned int) n;
+  for (tree->height = 0; n >> tree->height; tree->height++)
+    ;
+  return f;
+}
+
+void
+avl_frozen_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+{
+  avl_frozen * f = AVL_FROZEN (tree);
+  unsigned long i;
+
+  if (free_key_fun) {
+    for (i = 0; i < tree->length; i++)
+      free_key_fun (f->order[i]);
+  }
+  avl_frozen_release (f);
+  tree->engine = NULL;
+}
+
+int
+avl_frozen_insert (avl_tree * tree, void * key)
+{
+  (void) tree;
+  (void) key;
+  return -1;
+}
+
+int
+avl_frozen_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun)
+{
+  (void) tree;
+  (void) key;
+  (void) free_key_fun;
+  return -1;
+}
+
+unsigned long
+avl_frozen_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before)
+{
+  avl_frozen * f = AVL_FROZEN (tree);
+  void ** layout = f->layout;
+  unsigned long n = tree->length, slot = 1, index;
+  int limit = upper ? 0 : 1;
+
+  while (slot <= n) {
+    /* slots 8 * slot up to 8 * slot + 7 share a line, prefetching
+     * beyond the end of the array is harmless.  The keys of both
+     * children are next, whichever way we go.
+     */
+    AVL_FROZEN_PREFETCH (layout + 8 * slot);
+    if (2 * slot < n) {
+      AVL_FROZEN_PREFETCH (layout[2 * slot]);
+      AVL_FROZEN_PREFETCH (layout[2 * slot + 1]);
+    }
+    slot = 2 * slot + (tree->compare_fun (tree->compare_arg, key, layout[slot]) >= limit);
+  }
+  /* undo the right turns since the last left one, that is where we went left */
+#if defined(__GNUC__)
+  slot = slot >> __builtin_ffsl ((long) ~slot);
+#else
+  while (slot & 1)
+    slot = slot >> 1;
+  slot = slot >> 1;
+#endif
+
+  index = slot ? f->index[slot] : n;
+  if (at)
+    *at = slot ? layout[slot] : NULL;
+  if (before)
+    *before = index ? f->order[index - 1] : NULL;
+  return index;
+}
+
+int
+avl_frozen_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  if (index >= tree->length)
+    return -1;
+  *value_address = AVL_FROZEN (tree)->order[index];
+  return 0;
+}
+
+int
+avl_frozen_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  avl_frozen * f = AVL_FROZEN (tree);
+  unsigned long i;
+  int result;
+
+  for (i = 0; i < tree->length; i++) {
+    result = iter_fun (f->order[i], iter_arg);
+    if (result != 0)
+      return result;
+  }
+  return 0;
+}
+
+/* same order and indices as avl_iterate_index_range(): from <high>-1 down */
+
+int
+avl_frozen_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                unsigned long low, unsigned long high, void * iter_arg)
+{
+  avl_frozen * f = AVL_FROZEN (tree);
+  unsigned long num_left;
+
+  if (high > tree->length)
+    return -1;
+  if (high <= low)
+    return 0;
+
+  for (num_left = high - low; num_left; ) {
+    num_left = num_left - 1;
+    if (iter_fun (num_left, f->order[low + num_left], iter_arg) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* from <low> up to <high>-1, with the real index of every key */
+
+int
+avl_frozen_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg)
+{
+  avl_frozen * f = AVL_FROZEN (tree);
+
+  if (high > tree->length)
+    return -1;
+  for (; low < high; low++) {
+    if (iter_fun (low, f->order[low], iter_arg) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+int
+avl_frozen_verify (avl_tree * tree)
+{
+  avl_frozen * f = AVL_FROZEN (tree);
+  unsigned long n = tree->length, i;
+
+  for (i = 1; i < n; i++) {
+    if (tree->compare_fun (tree->compare_arg, f->order[i - 1], f->order[i]) > 0)
+      return -1;
+  }
+  for (i = 1; i <= n; i++) {
+    if (f->index[i] >= n || f->layout[i] != f->order[f->index[i]])
+      return -1;
+    /* in order, the left child comes before and the right one after */
+    if (2 * i <= n && f->index[2 * i] >= f->index[i])
+      return -1;
+    if (2 * i + 1 <= n && f->index[2 * i + 1] <= f->index[i])
+      return -1;
+  }
+  return 0;
+}
+
+void
+avl_frozen_print (avl_tree * tree, avl_key_printer_fun_type key_printer)
+{
+  avl_frozen * f = AVL_FROZEN (tree);
+  char buffer[AVL_KEY_PRINTER_BUFLEN];
+  unsigned long i;
+
+  if (!tree->length) {
+    fprintf (stdout, "<empty tree>\n");
+    return;
+  }
+  for (i = 0; i < tree->length; i++) {
+    key_printer (buffer, f->order[i]);
+    fprintf (stdout, "%lu: %s\n", i, buffer);
+  }
+}
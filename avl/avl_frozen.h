@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Read only engine behind avl_freeze().  This is private to the avl
+ * library.  The functions behave like their avl_btree_* counterparts,
+ * inserts and deletes always fail.
+ */
+
+#ifndef __AVL_FROZEN_H
+#define __AVL_FROZEN_H
+
+#include "avl.h"
+
+#ifdef _mangle
+# define avl_frozen_new _mangle(avl_frozen_new)
+# define avl_frozen_free _mangle(avl_frozen_free)
+# define avl_frozen_insert _mangle(avl_frozen_insert)
+# define avl_frozen_delete _mangle(avl_frozen_delete)
+# define avl_frozen_bound _mangle(avl_frozen_bound)
+# define avl_frozen_get_by_index _mangle(avl_frozen_get_by_index)
+# define avl_frozen_iterate_inorder _mangle(avl_frozen_iterate_inorder)
+# define avl_frozen_iterate_index_range _mangle(avl_frozen_iterate_index_range)
+# define avl_frozen_iterate_index_inorder _mangle(avl_frozen_iterate_index_inorder)
+# define avl_frozen_verify _mangle(avl_frozen_verify)
+# define avl_frozen_print _mangle(avl_frozen_print)
+#endif
+
+/* lays out the keys of <source> for <tree> and sets its length and height, NULL if memory runs out */
+void * avl_frozen_new (avl_tree * tree, avl_tree * source);
+void avl_frozen_free (avl_tree * tree, avl_free_key_fun_type free_key_fun);
+
+int avl_frozen_insert (avl_tree * tree, void * key);
+int avl_frozen_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun);
+
+unsigned long avl_frozen_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before);
+
+int avl_frozen_get_by_index (avl_tree * tree, unsigned long index, void ** value_address);
+int avl_frozen_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg);
+int avl_frozen_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg);
+int avl_frozen_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg);
+int avl_frozen_verify (avl_tree * tree);
+void avl_frozen_print (avl_tree * tree, avl_key_printer_fun_type key_printer);
+
+#endif /* __AVL_FROZEN_H */
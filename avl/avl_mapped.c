@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Serialized trees and the read only engine that maps them.
+ *
+ * A file is a header, the keys in Eytzinger order, the keys in sorted
+ * order and then the key data, everything in native byte order and
+ * referred to by offset from the start of the file.  In Eytzinger order
+ * the children of slot i are 2i and 2i+1, so a search runs through one
+ * array front to back and the top levels of every search share the same
+ * few cache lines.  Each slot also holds the index of its key, the
+ * sorted array serves the index based functions.  Opening a file only
+ * reads those two arrays to check them, the pages with the keys come in
+ * as searches touch them.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "avl_mapped.h"
+
+#define AVL_MAPPED_MAGIC "AVLTREE"
+#define AVL_MAPPED_VERSION (1)
+/* tells us whether the file was written with our byte order */
+#define AVL_MAPPED_BYTE_ORDER (0x01020304U)
+/* key data is aligned so keys can be structures */
+#define AVL_MAPPED_ALIGN(x) (((x) + 7) & ~(uint64_t) 7)
+
+typedef struct {
+  char                  magic[8];
+  uint32_t              version;
+  uint32_t              byte_order;
+  uint64_t              length;
+  uint64_t              height;
+  /* <length>+1 avl_mapped_slot, slot 0 is not used */
+  uint64_t              layout_offset;
+  /* <length> offsets of the keys in order */
+  uint64_t              order_offset;
+  uint64_t              size;
+} avl_mapped_header;
+
+typedef struct {
+  uint64_t              key;
+  uint64_t              index;
+} avl_mapped_slot;
+
+typedef struct {
+  char *                base;
+  size_t                size;
+  const avl_mapped_slot *   layout;
+  const uint64_t *      order;
+} avl_mapped;
+
+#define AVL_MAPPED(tree) ((avl_mapped *) (tree)->engine)
+#define AVL_MAPPED_KEY(m, offset) ((void *) ((m)->base + (offset)))
+
+/* put the keys in <order> into Eytzinger order, returns the next index */
+
+static unsigned long
+avl_mapped_layout (avl_mapped_slot * layout, const uint64_t * order, unsigned long length,
+           unsigned long slot, unsigned long index)
+{
+  if (slot > length)
+    return index;
+  index = avl_mapped_layout (layout, order, length, 2 * slot, index);
+  layout[slot].key = order[index];
+  layout[slot].index = index;
+  return avl_mapped_layout (layout, order, length, 2 * slot + 1, index + 1);
+}
+
+#ifndef _WIN32
+static int
+avl_mapped_write (int fd, const void * buffer, size_t size)
+{
+  const char * p = (const char *) buffer;
+
+  while (size) {
+    ssize_t written = write (fd, p, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += written;
+    size -= (size_t) written;
+  }
+  return 0;
+}
+#endif
+
+typedef struct {
+  void **               keys;
+  unsigned long         count;
+} avl_mapped_collect;
+
+static int
+avl_mapped_collect_key (void * key, void * iter_arg)
+{
+  avl_mapped_collect * collect = (avl_mapped_collect *) iter_arg;
+
+  collect->keys[collect->count++] = key;
+  return 0;
+}
+
+/* call <key_writer> with a buffer big enough for <key>, returns its size */
+
+static int
+avl_mapped_key (avl_key_writer_fun_type key_writer, void * key,
+        char ** buffer, size_t * buffer_size, size_t * size)
+{
+  *size = key_writer (key, *buffer, *buffer_size);
+  if (*size > *buffer_size) {
+    char * bigger = (char *) realloc (*buffer, *size);
+    if (!bigger)
+      return -1;
+    *buffer = bigger;
+    *buffer_size = *size;
+    if (key_writer (key, *buffer, *buffer_size) != *size)
+      return -1;
+  }
+  return 0;
+}
+
+int
+avl_serialize (avl_tree * tree, int fd, avl_key_writer_fun_type key_writer)
+{
+#ifndef _WIN32
+  static const char padding[8] = {0};
+  avl_mapped_header header;
+  avl_mapped_collect collect;
+  avl_mapped_slot * layout = NULL;
+  uint64_t * order = NULL, offset;
+  char * buffer = NULL;
+  size_t buffer_size = 0, size;
+  unsigned long n = tree->length, i;
+  int result = -1;
+
+  collect.keys = (void **) malloc (sizeof (void *) * (n + 1));
+  order = (uint64_t *) malloc (sizeof (uint64_t) * (n + 1));
+  layout = (avl_mapped_slot *) calloc (n + 1, sizeof (avl_mapped_slot));
+  if (!collect.keys || !order || !layout)
+    goto out;
+  collect.count = 0;
+  if (avl_iterate_inorder (tree, avl_mapped_collect_key, &collect) != 0 || collect.count != n)
+    goto out;
+
+  /* first find out where every key goes */
+  offset = AVL_MAPPED_ALIGN (sizeof (header) + sizeof (avl_mapped_slot) * (n + 1) + sizeof (uint64_t) * n);
+  for (i = 0; i < n; i++) {
+    if (avl_mapped_key (key_writer, collect.keys[i], &buffer, &buffer_size, &size) != 0)
+      goto out;
+    order[i] = offset;
+    offset = AVL_MAPPED_ALIGN (offset + size);
+  }
+  avl_mapped_layout (layout, order, n, 1, 0);
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, AVL_MAPPED_MAGIC, sizeof (AVL_MAPPED_MAGIC));
+  header.version = AVL_MAPPED_VERSION;
+  header.byte_order = AVL_MAPPED_BYTE_ORDER;
+  header.length = n;
+  for (header.height = 0; ((uint64_t) 1 << header.height) <= n; header.height++)
+    ;
+  header.layout_offset = sizeof (header);
+  header.order_offset = header.layout_offset + sizeof (avl_mapped_slot) * (n + 1);
+  header.size = offset;
+
+  if (avl_mapped_write (fd, &header, sizeof (header)) != 0
+      || avl_mapped_write (fd, layout, sizeof (avl_mapped_slot) * (n + 1)) != 0
+      || avl_mapped_write (fd, order, sizeof (uint64_t) * n) != 0)
+    goto out;
+  offset = header.order_offset + sizeof (uint64_t) * n;
+  if (avl_mapped_write (fd, padding, AVL_MAPPED_ALIGN (offset) - offset) != 0)
+    goto out;
+
+  /* then write them */
+  for (i = 0; i < n; i++) {
+    if (avl_mapped_key (key_writer, collect.keys[i], &buffer, &buffer_size, &size) != 0
+        || avl_mapped_write (fd, buffer, size) != 0
+        || avl_mapped_write (fd, padding, AVL_MAPPED_ALIGN (size) - size) != 0)
+      goto out;
+  }
+  result = 0;
+
+out:
+  free (buffer);
+  free (layout);
+  free (order);
+  free (collect.keys);
+  return result;
+#else
+  return -1;
+#endif
+}
+
+#ifndef _WIN32
+/*
+ * Is what <header> says about the file at <base> true?  Every offset the
+ * lookups follow is checked against the size, so a truncated or corrupt
+ * file is turned down instead of read beyond its end.  Keys are written
+ * one after another, so their offsets must grow and each key ends where
+ * the next one starts.  This reads the two arrays but none of the keys.
+ */
+
+static int
+avl_mapped_check (const char * base, uint64_t file_size)
+{
+  const avl_mapped_header * header = (const avl_mapped_header *) base;
+  const avl_mapped_slot * layout;
+  const uint64_t * order;
+  uint64_t n = header->length, i, height, data;
+
+  if (memcmp (header->magic, AVL_MAPPED_MAGIC, sizeof (AVL_MAPPED_MAGIC)) != 0
+      || header->version != AVL_MAPPED_VERSION
+      || header->byte_order != AVL_MAPPED_BYTE_ORDER
+      || header->size > file_size
+      || header->length > UINT_MAX
+      || header->layout_offset != sizeof (avl_mapped_header)
+      || header->order_offset != header->layout_offset + sizeof (avl_mapped_slot) * (n + 1))
+    return -1;
+  data = AVL_MAPPED_ALIGN (header->order_offset + sizeof (uint64_t) * n);
+  if (data > header->size)
+    return -1;
+  for (height = 0; ((uint64_t) 1 << height) <= n; height++)
+    ;
+  if (header->height != height)
+    return -1;
+
+  layout = (const avl_mapped_slot *) (base + header->layout_offset);
+  order = (const uint64_t *) (base + header->order_offset);
+  for (i = 0; i < n; i++) {
+    if (order[i] != AVL_MAPPED_ALIGN (order[i]) || order[i] < data || order[i] > header->size)
+      return -1;
+    data = order[i];
+  }
+  for (i = 1; i <= n; i++) {
+    if (layout[i].index >= n || layout[i].key != order[layout[i].index])
+      return -1;
+  }
+  return 0;
+}
+#endif
+
+void *
+avl_mapped_open (avl_tree * tree, int fd)
+{
+#ifndef _WIN32
+  avl_mapped * m;
+  const avl_mapped_header * header;
+  struct stat st;
+  void * base;
+
+  if (fstat (fd, &st) != 0 || (uint64_t) st.st_size < sizeof (avl_mapped_header))
+    return NULL;
+  /* Nothing is ever written through the mapping.  Shared, its pages are
+   * those of the page cache, and every process that maps the file uses
+   * the same ones instead of a copy of its own.
+   */
+  base = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  header = (const avl_mapped_header *) base;
+  if (avl_mapped_check ((const char *) base, (uint64_t) st.st_size) != 0) {
+    munmap (base, (size_t) st.st_size);
+    return NULL;
+  }
+
+  m = (avl_mapped *) malloc (sizeof (avl_mapped));
+  if (!m) {
+    munmap (base, (size_t) st.st_size);
+    return NULL;
+  }
+  m->base = (char *) base;
+  m->size = (size_t) st.st_size;
+  m->layout = (const avl_mapped_slot *) (m->base + header->layout_offset);
+  m->order = (const uint64_t *) (m->base + header->order_offset);
+  tree->length = (unsigned int) header->length;
+  tree->height = (unsigned int) header->height;
+  return m;
+#else
+  return NULL;
+#endif
+}
+
+/* the keys are part of the mapping, there is nothing to free */
+
+void
+avl_mapped_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+{
+  avl_mapped * m = AVL_MAPPED (tree);
+
+  (void) free_key_fun;
+#ifndef _WIN32
+  munmap (m->base, m->size);
+#endif
+  free (m);
+  tree->engine = NULL;
+}
+
+int
+avl_mapped_insert (avl_tree * tree, void * key)
+{
+  (void) tree;
+  (void) key;
+  return -1;
+}
+
+int
+avl_mapped_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun)
+{
+  (void) tree;
+  (void) key;
+  (void) free_key_fun;
+  return -1;
+}
+
+unsigned long
+avl_mapped_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before)
+{
+  avl_mapped * m = AVL_MAPPED (tree);
+  unsigned long n = tree->length, slot = 1, index;
+  int limit = upper ? 0 : 1;
+
+  while (slot <= n) {
+    if (tree->compare_fun (tree->compare_arg, key, AVL_MAPPED_KEY (m, m->layout[slot].key)) < limit)
+      slot = 2 * slot;
+    else
+      slot = 2 * slot + 1;
+  }
+  /* undo the right turns since the last left one, that is where we went left */
+  while (slot & 1)
+    slot = slot >> 1;
+  slot = slot >> 1;
+
+  index = slot ? (unsigned long) m->layout[slot].index : n;
+  if (at)
+    *at = slot ? AVL_MAPPED_KEY (m, m->layout[slot].key) : NULL;
+  if (before)
+    *before = index ? AVL_MAPPED_KEY (m, m->order[index - 1]) : NULL;
+  return index;
+}
+
+int
+avl_mapped_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  avl_mapped * m = AVL_MAPPED (tree);
+
+  if (index >= tree->length)
+    return -1;
+  *value_address = AVL_MAPPED_KEY (m, m->order[index]);
+  return 0;
+}
+
+int
+avl_mapped_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  avl_mapped * m = AVL_MAPPED (tree);
+  unsigned long i;
+  int result;
+
+  for (i = 0; i < tree->length; i++) {
+    result = iter_fun (AVL_MAPPED_KEY (m, m->order[i]), iter_arg);
+    if (result != 0)
+      return result;
+  }
+  return 0;
+}
+
+/* same order and indices as avl_iterate_index_range(): from <high>-1 down */
+
+int
+avl_mapped_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                unsigned long low, unsigned long high, void * iter_arg)
+{
+  avl_mapped * m = AVL_MAPPED (tree);
+  unsigned long num_left;
+
+  if (high > tree->length)
+    return -1;
+  if (high <= low)
+    return 0;
+
+  for (num_left = high - low; num_left; ) {
+    num_left = num_left - 1;
+    if (iter_fun (num_left, AVL_MAPPED_KEY (m, m->order[low + num_left]), iter_arg) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* from <low> up to <high>-1, with the real index of every key */
+
+int
+avl_mapped_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg)
+{
+  avl_mapped * m = AVL_MAPPED (tree);
+
+  if (high > tree->length)
+    return -1;
+  for (; low < high; low++) {
+    if (iter_fun (low, AVL_MAPPED_KEY (m, m->order[low]), iter_arg) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+int
+avl_mapped_verify (avl_tree * tree)
+{
+  avl_mapped * m = AVL_MAPPED (tree);
+  unsigned long n = tree->length, i;
+
+  for (i = 0; i < n; i++) {
+    if (m->order[i] >= m->size)
+      return -1;
+    if (i && tree->compare_fun (tree->compare_arg, AVL_MAPPED_KEY (m, m->order[i - 1]),
+                    AVL_MAPPED_KEY (m, m->order[i])) > 0)
+      return -1;
+  }
+  for (i = 1; i <= n; i++) {
+    if (m->layout[i].index >= n || m->layout[i].key != m->order[m->layout[i].index])
+      return -1;
+    /* in order, the left child comes before and the right one after */
+    if (2 * i <= n && m->layout[2 * i].index >= m->layout[i].index)
+      return -1;
+    if (2 * i + 1 <= n && m->layout[2 * i + 1].index <= m->layout[i].index)
+      return -1;
+  }
+  return 0;
+}
+
+void
+avl_mapped_print (avl_tree * tree, avl_key_printer_fun_type key_printer)
+{
+  avl_mapped * m = AVL_MAPPED (tree);
+  char buffer[AVL_KEY_PRINTER_BUFLEN];
+  unsigned long i;
+
+  if (!tree->length) {
+    fprintf (stdout, "<empty tree>\n");
+    return;
+  }
+  for (i = 0; i < tree->length; i++) {
+    key_printer (buffer, AVL_MAPPED_KEY (m, m->order[i]));
+    fprintf (stdout, "%lu: %s\n", i, buffer);
+  }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Read only engine behind avl_tree_new_mapped(), which serves lookups
+ * straight out of a file written by avl_serialize().  This is private
+ * to the avl library.  The functions behave like their avl_btree_*
+ * counterparts, inserts and deletes always fail.
+ */
+
+#ifndef __AVL_MAPPED_H
+#define __AVL_MAPPED_H
+
+#include "avl.h"
+
+#ifdef _mangle
+# define avl_mapped_open _mangle(avl_mapped_open)
+# define avl_mapped_free _mangle(avl_mapped_free)
+# define avl_mapped_insert _mangle(avl_mapped_insert)
+# define avl_mapped_delete _mangle(avl_mapped_delete)
+# define avl_mapped_bound _mangle(avl_mapped_bound)
+# define avl_mapped_get_by_index _mangle(avl_mapped_get_by_index)
+# define avl_mapped_iterate_inorder _mangle(avl_mapped_iterate_inorder)
+# define avl_mapped_iterate_index_range _mangle(avl_mapped_iterate_index_range)
+# define avl_mapped_iterate_index_inorder _mangle(avl_mapped_iterate_index_inorder)
+# define avl_mapped_verify _mangle(avl_mapped_verify)
+# define avl_mapped_print _mangle(avl_mapped_print)
+#endif
+
+/* maps <fd> and sets the length and height of <tree>, NULL if that fails */
+void * avl_mapped_open (avl_tree * tree, int fd);
+void avl_mapped_free (avl_tree * tree, avl_free_key_fun_type free_key_fun);
+
+int avl_mapped_insert (avl_tree * tree, void * key);
+int avl_mapped_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun);
+
+unsigned long avl_mapped_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before);
+
+int avl_mapped_get_by_index (avl_tree * tree, unsigned long index, void ** value_address);
+int avl_mapped_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg);
+int avl_mapped_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg);
+int avl_mapped_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg);
+int avl_mapped_verify (avl_tree * tree);
+void avl_mapped_print (avl_tree * tree, avl_key_printer_fun_type key_printer);
+
+#endif /* __AVL_MAPPED_H */
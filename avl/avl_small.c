@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Small trees.
+ *
+ * Up to AVL_SMALL_MAX_KEYS keys sit in one sorted array of pointers,
+ * so a tree costs a single allocation besides the avl_tree itself and
+ * a lookup reads a few adjacent cache lines.  The keys are opaque, all
+ * we can do with them is call the compare function, so the search is a
+ * binary one: it makes the fewest calls.  Inserts and deletes move the
+ * keys behind the slot, which is no more than a few hundred bytes.
+ * The array starts with room for four keys and doubles when it is full.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avl_small.h"
+
+#define AVL_SMALL_FIRST_KEYS (4)
+
+void *
+avl_small_new (void)
+{
+  return malloc (sizeof (void *) * AVL_SMALL_FIRST_KEYS);
+}
+
+void
+avl_small_free (avl_tree * tree, avl_free_key_fun_type free_key_fun)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long i;
+
+  if (free_key_fun) {
+    for (i = 0; i < tree->length; i++)
+      free_key_fun (keys[i]);
+  }
+  free (keys);
+  tree->engine = NULL;
+}
+
+/* the first slot whose key is not less than <key>, or greater than it if <upper> */
+
+static unsigned long
+avl_small_slot (avl_tree * tree, void * key, int upper)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long low = 0, high = tree->length;
+  int limit = upper ? 0 : 1;
+
+  while (low < high) {
+    unsigned long middle = (low + high) / 2;
+
+    if (tree->compare_fun (tree->compare_arg, key, keys[middle]) >= limit)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+int
+avl_small_insert (avl_tree * tree, void * key)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long n = tree->length, slot;
+
+  /* full when the length reached a power of two */
+  if (n >= AVL_SMALL_FIRST_KEYS && !(n & (n - 1))) {
+    keys = (void **) realloc (keys, sizeof (void *) * n * 2);
+    if (!keys)
+      return -1;
+    tree->engine = keys;
+  }
+
+  /* equal keys go in front of the ones already there */
+  slot = avl_small_slot (tree, key, 0);
+  memmove (keys + slot + 1, keys + slot, sizeof (void *) * (n - slot));
+  keys[slot] = key;
+  tree->length = n + 1;
+  tree->height = 1;
+  return 0;
+}
+
+int
+avl_small_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long n = tree->length, slot;
+  void * found;
+
+  slot = avl_small_slot (tree, key, 0);
+  if (slot == n || tree->compare_fun (tree->compare_arg, key, keys[slot]) != 0)
+    return -1;
+  found = keys[slot];
+
+  memmove (keys + slot, keys + slot + 1, sizeof (void *) * (n - slot - 1));
+  tree->length = n - 1;
+  if (!tree->length)
+    tree->height = 0;
+  if (free_key_fun)
+    free_key_fun (found);
+  return 0;
+}
+
+unsigned long
+avl_small_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long slot = avl_small_slot (tree, key, upper);
+
+  if (at)
+    *at = slot < tree->length ? keys[slot] : NULL;
+  if (before)
+    *before = slot ? keys[slot - 1] : NULL;
+  return slot;
+}
+
+int
+avl_small_get_by_index (avl_tree * tree, unsigned long index, void ** value_address)
+{
+  if (index >= tree->length)
+    return -1;
+  *value_address = AVL_SMALL_KEYS (tree)[index];
+  return 0;
+}
+
+int
+avl_small_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long i;
+  int result;
+
+  for (i = 0; i < tree->length; i++) {
+    result = iter_fun (keys[i], iter_arg);
+    if (result != 0)
+      return result;
+  }
+  return 0;
+}
+
+/* same order and indices as avl_iterate_index_range(): from <high>-1 down */
+
+int
+avl_small_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                unsigned long low, unsigned long high, void * iter_arg)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long num_left;
+
+  if (high > tree->length)
+    return -1;
+  if (high <= low)
+    return 0;
+
+  for (num_left = high - low; num_left; ) {
+    num_left = num_left - 1;
+    if (iter_fun (num_left, keys[low + num_left], iter_arg) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* from <low> up to <high>-1, with the real index of every key */
+
+int
+avl_small_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+
+  if (high > tree->length)
+    return -1;
+  for (; low < high; low++) {
+    if (iter_fun (low, keys[low], iter_arg) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+int
+avl_small_verify (avl_tree * tree)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  unsigned long i;
+
+  if (tree->length > AVL_SMALL_MAX_KEYS)
+    return -1;
+  for (i = 1; i < tree->length; i++) {
+    if (tree->compare_fun (tree->compare_arg, keys[i - 1], keys[i]) > 0)
+      return -1;
+  }
+  return 0;
+}
+
+void
+avl_small_print (avl_tree * tree, avl_key_printer_fun_type key_printer)
+{
+  void ** keys = AVL_SMALL_KEYS (tree);
+  char buffer[AVL_KEY_PRINTER_BUFLEN];
+  unsigned long i;
+
+  if (!tree->length) {
+    fprintf (stdout, "<empty tree>\n");
+    return;
+  }
+  for (i = 0; i < tree->length; i++) {
+    key_printer (buffer, keys[i]);
+    fprintf (stdout, "%lu: %s\n", i, buffer);
+  }
+}
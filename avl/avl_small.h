@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 1995 by Sam Rushing <rushing@nightmare.com>
+ * Copyright (C) 2013-2019 by Philipp "ph3-der-loewe" Schafft <lion@lion.leolix.org>
+ */
+
+/*
+ * Sorted array a tree made by avl_tree_new_small() keeps its keys in
+ * until it grows past AVL_SMALL_MAX_KEYS.  This is private to the avl
+ * library.  The functions behave like their avl_btree_* counterparts,
+ * avl.c moves the keys into avl_node once the array is full.
+ */
+
+#ifndef __AVL_SMALL_H
+#define __AVL_SMALL_H
+
+#include "avl.h"
+
+/* a few compares more than a tree of that size, but no node to chase */
+#define AVL_SMALL_MAX_KEYS (32)
+
+#ifdef _mangle
+# define avl_small_new _mangle(avl_small_new)
+# define avl_small_free _mangle(avl_small_free)
+# define avl_small_insert _mangle(avl_small_insert)
+# define avl_small_delete _mangle(avl_small_delete)
+# define avl_small_bound _mangle(avl_small_bound)
+# define avl_small_get_by_index _mangle(avl_small_get_by_index)
+# define avl_small_iterate_inorder _mangle(avl_small_iterate_inorder)
+# define avl_small_iterate_index_range _mangle(avl_small_iterate_index_range)
+# define avl_small_iterate_index_inorder _mangle(avl_small_iterate_index_inorder)
+# define avl_small_verify _mangle(avl_small_verify)
+# define avl_small_print _mangle(avl_small_print)
+#endif
+
+/* the engine is the array itself, <length> keys in order */
+#define AVL_SMALL_KEYS(tree) ((void **) (tree)->engine)
+
+void * avl_small_new (void);
+void avl_small_free (avl_tree * tree, avl_free_key_fun_type free_key_fun);
+
+int avl_small_insert (avl_tree * tree, void * key);
+int avl_small_delete (avl_tree * tree, void * key, avl_free_key_fun_type free_key_fun);
+
+unsigned long avl_small_bound (avl_tree * tree, void * key, int upper, void ** at, void ** before);
+
+int avl_small_get_by_index (avl_tree * tree, unsigned long index, void ** value_address);
+int avl_small_iterate_inorder (avl_tree * tree, avl_iter_fun_type iter_fun, void * iter_arg);
+int avl_small_iterate_index_range (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg);
+int avl_small_iterate_index_inorder (avl_tree * tree, avl_iter_index_fun_type iter_fun,
+                  unsigned long low, unsigned long high, void * iter_arg);
+int avl_small_verify (avl_tree * tree);
+void avl_small_print (avl_tree * tree, avl_key_printer_fun_type key_printer);
+
+#endif /* __AVL_SMALL_H */
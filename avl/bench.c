@@ -0,0 +1,386 @@
+/*
+ * Benchmarks for the avl library.  Build with optimizations, e.g.
+ *
+ *   cc -O2 -DHAVE_NANOSLEEP -I.. bench.c avl*.c ../thread/thread.c -lpthread
+ *   ./a.out [name...]
+ *
+ * and without a name all of them run.  Numbers depend on the machine,
+ * compare builds on the same one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <thread/thread.h>
+#include "avl.h"
+
+/* how long the timed benchmarks run each case, in ms */
+#define BENCH_TIME 1000
+
+static int _compare(void *compare_arg, void *a, void *b)
+{
+    long i = (long)a, j = (long)b;
+
+    (void)compare_arg;
+    return i < j ? -1 : i > j;
+}
+
+static int _free(void *key)
+{
+    (void)key;
+    return 1;
+}
+
+/* wall clock in seconds */
+static double bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Node allocation: malloc() against a private pool per tree and one
+ * pool shared by many trees, for a big tree churned once, a small one
+ * churned often and many small short lived trees.
+ */
+
+#define POOL_SMALL_KEYS 15
+#define POOL_SMALL_TREES 200000
+
+static avl_tree *pool_tree_new(int pooled, avl_node_pool *pool)
+{
+    if (pooled)
+        return avl_tree_new_with_pool(_compare, NULL, pool);
+    return avl_tree_new(_compare, NULL);
+}
+
+static void pool_churn(int pooled, long n, int rounds)
+{
+    avl_tree *tree = pool_tree_new(pooled, NULL);
+    double start = bench_now();
+    long i;
+    int r;
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++)
+            avl_insert(tree, (void *)((i * 7919) % n));
+        for (i = 0; i < n; i++)
+            avl_delete(tree, (void *)((i * 7919) % n), _free);
+    }
+    printf("  %-6s churn %7ld keys x%-4d %7.3f s\n", pooled ? "pool" : "malloc",
+            n, rounds, bench_now() - start);
+    avl_tree_free(tree, _free);
+}
+
+static void pool_small(int pooled, avl_node_pool *pool)
+{
+    double start = bench_now();
+    long i;
+    int t;
+
+    for (t = 0; t < POOL_SMALL_TREES; t++) {
+        avl_tree *tree = pool_tree_new(pooled, pool);
+
+        for (i = 0; i < POOL_SMALL_KEYS; i++)
+            avl_insert(tree, (void *)((i * 7) % POOL_SMALL_KEYS));
+        avl_tree_free(tree, _free);
+    }
+    printf("  %-6s %d trees of %d keys %7.3f s\n",
+            pool ? "shared" : pooled ? "pool" : "malloc",
+            POOL_SMALL_TREES, POOL_SMALL_KEYS, bench_now() - start);
+}
+
+static void bench_pool(void)
+{
+    avl_node_pool *pool;
+
+    printf("pool:\n");
+    pool_churn(0, 1000000, 1);
+    pool_churn(1, 1000000, 1);
+    pool_churn(0, 1000, 1000);
+    pool_churn(1, 1000, 1000);
+    pool_small(0, NULL);
+    pool_small(1, NULL);
+    pool = avl_node_pool_new(0);
+    if (!pool)
+        return;
+    pool_small(1, pool);
+    avl_node_pool_free(pool);
+}
+
+/*
+ * Readers looking keys up while one writer inserts and deletes.  With
+ * HAVE_AVL_NODE_LOCK the readers only take node locks, otherwise the
+ * tree lock.
+ */
+
+#define READERS_KEYS 100000
+
+static avl_tree *readers_tree;
+static volatile int readers_done;
+/* what each thread got done, the writer's last */
+static long readers_ops[9];
+
+static void *readers_reader(void *arg)
+{
+    long *result = arg;
+    unsigned int seed = (unsigned int)(result - readers_ops) + 1;
+    long ops = 0;
+
+    while (!readers_done) {
+        void *found;
+        long key = (rand_r(&seed) % READERS_KEYS) * 2 + 1;
+
+#ifndef HAVE_AVL_NODE_LOCK
+        avl_tree_rlock(readers_tree);
+#endif
+        avl_get_by_key(readers_tree, (void *)key, &found);
+#ifndef HAVE_AVL_NODE_LOCK
+        avl_tree_unlock(readers_tree);
+#endif
+        ops++;
+    }
+
+    *result = ops;
+    return NULL;
+}
+
+static void *readers_writer(void *arg)
+{
+    unsigned int seed = 7;
+    long ops = 0;
+
+    (void)arg;
+    while (!readers_done) {
+        long key = (rand_r(&seed) % READERS_KEYS) * 2 + 1;
+
+        avl_tree_wlock(readers_tree);
+        if (rand_r(&seed) & 1)
+            avl_insert(readers_tree, (void *)key);
+        else
+            avl_delete(readers_tree, (void *)key, _free);
+        avl_tree_unlock(readers_tree);
+        ops++;
+    }
+
+    readers_ops[8] = ops;
+    return NULL;
+}
+
+static void bench_readers(void)
+{
+    static const int counts[] = {1, 2, 4, 8};
+    unsigned int c;
+    long i;
+
+#ifdef HAVE_AVL_NODE_LOCK
+    printf("readers: node locks, %d keys\n", READERS_KEYS);
+#else
+    printf("readers: tree lock, %d keys\n", READERS_KEYS);
+#endif
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        thread_type *readers[8], *writer;
+        long lookups = 0;
+        int r;
+
+        readers_tree = avl_tree_new(_compare, NULL);
+        for (i = 0; i < READERS_KEYS; i += 2)
+            avl_insert(readers_tree, (void *)(i * 2 + 1));
+
+        readers_done = 0;
+        for (r = 0; r < counts[c]; r++)
+            readers[r] = thread_create("reader", readers_reader, &readers_ops[r], THREAD_ATTACHED);
+        writer = thread_create("writer", readers_writer, NULL, THREAD_ATTACHED);
+        thread_sleep(BENCH_TIME * 1000);
+        readers_done = 1;
+        for (r = 0; r < counts[c]; r++) {
+            thread_join(readers[r]);
+            lookups += readers_ops[r];
+        }
+        thread_join(writer);
+
+        printf("  %d readers: %8ld lookups/s, %7ld writes/s\n", counts[c],
+                lookups * 1000 / BENCH_TIME, readers_ops[8] * 1000 / BENCH_TIME);
+        avl_tree_free(readers_tree, _free);
+    }
+}
+
+/*
+ * The avl tree against the B-tree engine of avl_tree_new_btree(), from
+ * trees that fit in cache to ones that don't.  Small trees are built
+ * over and over to get a measurable time.  Keys start at 1, the engines
+ * can't find a NULL key.
+ */
+
+static void btree_run(int btree, long n)
+{
+    long reps = 20000000 / n, r, i, hits = 0;
+    double start, insert = 0, lookup = 0;
+
+    if (reps > 1000)
+        reps = 1000;
+    if (reps < 1)
+        reps = 1;
+
+    for (r = 0; r < reps; r++) {
+        avl_tree *tree = btree ? avl_tree_new_btree(_compare, NULL) : avl_tree_new(_compare, NULL);
+
+        if (!tree)
+            return;
+        start = bench_now();
+        for (i = 0; i < n; i++)
+            avl_insert(tree, (void *)((i * 2654435761UL) % n + 1));
+        insert += bench_now() - start;
+        start = bench_now();
+        for (i = 0; i < n; i++) {
+            void *found;
+
+            hits += avl_get_by_key(tree, (void *)((i * 40503UL) % n + 1), &found) == 0;
+        }
+        lookup += bench_now() - start;
+        avl_tree_free(tree, _free);
+    }
+    printf("  %-6s %8ld keys: insert %6.1f ns/key, lookup %6.1f ns/key%s\n",
+            btree ? "btree" : "avl", n, insert * 1e9 / (n * reps),
+            lookup * 1e9 / (n * reps), hits == n * reps ? "" : " (lost keys)");
+}
+
+static void bench_btree(void)
+{
+    static const long sizes[] = {1000, 100000, 10000000};
+    unsigned int s;
+
+    printf("btree:\n");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        btree_run(0, sizes[s]);
+        btree_run(1, sizes[s]);
+    }
+}
+
+/*
+ * Lookups through the tree against lookups through the hash index of
+ * avl_tree_set_hash(), for string and long keys, to see from which size
+ * on the index pays off.
+ */
+
+#define HASH_LOOKUPS 2000000
+
+static int hash_string_compare(void *compare_arg, void *a, void *b)
+{
+    (void)compare_arg;
+    return strcmp(a, b);
+}
+
+static unsigned long hash_string(void *compare_arg, void *key)
+{
+    unsigned long hash = 14695981039346656037UL;
+    const unsigned char *p;
+
+    (void)compare_arg;
+    for (p = key; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static unsigned long hash_long(void *compare_arg, void *key)
+{
+    (void)compare_arg;
+    return (unsigned long)key * 0x9E3779B97F4A7C15UL;
+}
+
+/* ns per lookup, or -1 if the index could not be set up */
+static double hash_run(void **keys, long n, int strings, int hashed)
+{
+    avl_tree *tree = avl_tree_new(strings ? hash_string_compare : _compare, NULL);
+    unsigned long x = 1;
+    double start, ns = -1;
+    long i;
+
+    if (!tree)
+        return -1;
+    for (i = 0; i < n; i++)
+        avl_insert(tree, keys[i]);
+    if (!hashed || avl_tree_set_hash(tree, strings ? hash_string : hash_long) == 0) {
+        start = bench_now();
+        for (i = 0; i < HASH_LOOKUPS; i++) {
+            void *found;
+
+            x = x * 6364136223846793005UL + 1;
+            avl_get_by_key(tree, keys[(x >> 33) % n], &found);
+        }
+        ns = (bench_now() - start) * 1e9 / HASH_LOOKUPS;
+    }
+    avl_tree_free(tree, _free);
+    return ns;
+}
+
+static void bench_hash(void)
+{
+    static const long sizes[] = {4, 8, 16, 32, 64, 128, 1024, 16384, 262144, 1048576};
+    unsigned int s;
+
+    printf("hash: ns per lookup\n");
+    printf("  %8s %10s %10s %10s %10s\n", "keys", "str tree", "str hash", "long tree", "long hash");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        long n = sizes[s], i;
+        void **keys = malloc(sizeof(*keys) * n);
+        char *strings = malloc(24 * n);
+        double ns[4];
+
+        if (!keys || !strings) {
+            free(keys);
+            free(strings);
+            return;
+        }
+        for (i = 0; i < n; i++) {
+            snprintf(strings + i * 24, 24, "x-header-name-%ld", i * 7919 % 1000003);
+            keys[i] = strings + i * 24;
+        }
+        ns[0] = hash_run(keys, n, 1, 0);
+        ns[1] = hash_run(keys, n, 1, 1);
+        for (i = 0; i < n; i++)
+            keys[i] = (void *)(i * 2654435761L + 1);
+        ns[2] = hash_run(keys, n, 0, 0);
+        ns[3] = hash_run(keys, n, 0, 1);
+        printf("  %8ld %10.1f %10.1f %10.1f %10.1f\n", n, ns[0], ns[1], ns[2], ns[3]);
+        free(strings);
+        free(keys);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} benchmarks[] = {
+    {"pool", bench_pool},
+    {"readers", bench_readers},
+    {"btree", bench_btree},
+    {"hash", bench_hash}
+};
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int a;
+
+    thread_initialize();
+    for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (argc > 1) {
+            for (a = 1; a < argc; a++) {
+                if (strcmp(argv[a], benchmarks[i].name) == 0)
+                    break;
+            }
+            if (a == argc)
+                continue;
+        }
+        benchmarks[i].run();
+    }
+    thread_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Benchmark of the C++ front end in avl.hpp against the C API, inserting
+ * and looking up shuffled long keys.  Build with optimizations, e.g.
+ *
+ *   cc -O2 -c -I.. avl*.c ../thread/thread.c
+ *   c++ -O2 -std=c++11 -I.. bench.cpp *.o -lpthread
+ *   ./a.out [keys]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/time.h>
+
+#include "avl.hpp"
+
+static int _compare(void *compare_arg, void *a, void *b)
+{
+    long i = (long)a, j = (long)b;
+
+    (void)compare_arg;
+    return i < j ? -1 : i > j;
+}
+
+/* wall clock in seconds */
+static double bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<long> keys;
+    long n = 1000000, i, found = 0;
+    double start, insert, lookup;
+
+    if (argc == 2)
+        n = atol(argv[1]);
+    if (n <= 0)
+        n = 1000000;
+
+    keys.resize(n);
+    for (i = 0; i < n; i++)
+        keys[i] = (i * 2654435761L) % n + 1;
+
+    {
+        avl_tree *tree = avl_tree_new(_compare, NULL);
+        void *value;
+
+        start = bench_now();
+        for (i = 0; i < n; i++)
+            avl_insert(tree, (void *)keys[i]);
+        insert = bench_now() - start;
+        start = bench_now();
+        for (i = 0; i < n; i++)
+            found += avl_get_by_key(tree, (void *)keys[i], &value) == 0;
+        lookup = bench_now() - start;
+        printf("C API:    insert %6.1f ns/key, lookup %6.1f ns/key\n",
+                insert * 1e9 / n, lookup * 1e9 / n);
+        avl_tree_free(tree, NULL);
+    }
+
+    {
+        icecast::avl_tree<long> tree;
+
+        start = bench_now();
+        for (i = 0; i < n; i++)
+            tree.insert(keys[i]);
+        insert = bench_now() - start;
+        start = bench_now();
+        for (i = 0; i < n; i++)
+            found += tree.find(keys[i]) != NULL;
+        lookup = bench_now() - start;
+        printf("template: insert %6.1f ns/key, lookup %6.1f ns/key\n",
+                insert * 1e9 / n, lookup * 1e9 / n);
+    }
+
+    if (found != 2 * n) {
+        printf("lost keys\n");
+        return 1;
+    }
+    return 0;
+}
@@ -1,4 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "avl.h"
 
 #ifdef _WIN32
@@ -8,12 +13,29 @@
 int _compare(void *compare_arg, void *a, void *b);
 int _free(void *key);
 int _printer(char *buff, void *key);
+unsigned long _hash(void *compare_arg, void *key);
+int _count(unsigned long index, void *key, void *iter_arg);
+int _long_compare(void *compare_arg, void *a, void *b);
+size_t _long_writer(void *key, char *buffer, size_t size);
+void _lift(void *arg, void *value, void *key);
+void _combine(void *arg, void *value, const void *next);
+int _expected(int *counts, int range, long *expected);
+int _next(void *key, void *iter_arg);
+int _check(avl_tree *tree, long *expected, int n);
+int _mutate(avl_tree *tree, int ops);
+int _free_count(void *key);
+
+/* what _free_count() freed */
+static int freed;
+/* what _lift() adds up for a key */
+static long weights[52];
 
 int main(int argc, char **argv)
 {
     int i, max_nodes;
     avl_tree *tree;
     avl_node *node;
+    void **keys;
 
     max_nodes = 25;
 
@@ -54,10 +76,621 @@ int main(int argc, char **argv)
     avl_print_tree(tree, _printer);
 
     avl_tree_free(tree, _free);
-    
+
+    printf("Building tree from sorted keys...\n");
+    keys = malloc(sizeof(*keys) * max_nodes);
+    for (i = 0; i < max_nodes; i++)
+        keys[i] = (void *)(long)(i * 2);
+    tree = avl_tree_new_from_sorted(_compare, NULL, keys, max_nodes);
+    if (!tree || avl_verify(tree) != 0) {
+        printf("...failed\n");
+        return 1;
+    }
+    avl_print_tree(tree, _printer);
+    avl_tree_free(tree, _free);
+    free(keys);
+
+    printf("Looking up keys of a hashed small tree...\n");
+    tree = avl_tree_new_small(_compare, NULL);
+    if (!tree) {
+        printf("...failed\n");
+        return 1;
+    }
+    /* node locked builds have no hash index, the lookups still have to work */
+    avl_tree_set_hash(tree, _hash);
+    /* getting the first node promotes the empty tree */
+    if (avl_get_first(tree) != NULL
+        || avl_get_by_key(tree, (void *)7L, (void **)&keys) == 0) {
+        printf("...failed\n");
+        return 1;
+    }
+    /* a NULL key can not be told from a miss */
+    for (i = 1; i <= max_nodes; i++)
+        avl_insert(tree, (void *)(long)i);
+    for (i = 1; i <= max_nodes; i++) {
+        void *found;
+
+        if (avl_get_by_key(tree, (void *)(long)i, &found) != 0 || (long)found != i) {
+            printf("...failed\n");
+            return 1;
+        }
+    }
+    avl_tree_free(tree, _free);
+
+    printf("Counting in many trees at once...\n");
+    {
+        /* more than there are thread specific keys */
+        static avl_tree *trees[2000];
+        avl_tree_stats stats;
+
+        for (i = 0; i < 2000; i++) {
+            trees[i] = avl_tree_new(_compare, NULL);
+            if (!trees[i] || avl_tree_set_stats(trees[i], 1) != 0) {
+                printf("...failed\n");
+                return 1;
+            }
+            avl_insert(trees[i], (void *)1L);
+        }
+        for (i = 0; i < 2000; i++) {
+            if (avl_tree_get_stats(trees[i], &stats) != 0 || stats.inserts != 1) {
+                printf("...failed\n");
+                return 1;
+            }
+            avl_tree_free(trees[i], _free);
+        }
+    }
+
+    printf("Walking a tree in parallel...\n");
+    tree = avl_tree_new(_compare, NULL);
+    for (i = 1; i <= 1000; i++)
+        avl_insert(tree, (void *)(long)i);
+    {
+        unsigned long runs[4][2] = {{0}};
+        void *args[4];
+
+        for (i = 0; i < 4; i++)
+            args[i] = runs[i];
+        if (avl_iterate_inorder_parallel(tree, _count, args, 4) != 0) {
+            printf("...failed\n");
+            return 1;
+        }
+        for (i = 0; i < 4; i++) {
+            if (runs[i][0] != 250 || runs[i][1] != 250UL * i + 249) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+    }
+    avl_tree_free(tree, _free);
+
+#ifndef HAVE_AVL_NODE_LOCK
+    /* there is no avl_split() with node locks */
+    printf("Splitting and joining a lockless tree...\n");
+    tree = avl_tree_new(_compare, NULL);
+    if (avl_tree_set_lockless(tree, NULL) == 0) {
+        avl_tree *upper, *plain;
+
+        for (i = 1; i <= max_nodes; i++)
+            avl_insert(tree, (void *)(long)i);
+        upper = avl_split(tree, (void *)(long)(max_nodes / 2 + 1));
+        plain = avl_tree_new(_compare, NULL);
+        if (!upper || !upper->lockless || avl_join(plain, upper) == 0
+                || avl_join(tree, upper) != 0 || avl_verify(tree) != 0
+                || tree->length != (unsigned int)max_nodes) {
+            printf("...failed\n");
+            return 1;
+        }
+        avl_tree_free(plain, _free);
+        avl_tree_free(upper, _free);
+    }
+    avl_tree_free(tree, _free);
+#endif
+
+#ifndef _WIN32
+    printf("Mapping a tree from a file...\n");
+    {
+        FILE *file = tmpfile();
+        avl_tree *mapped;
+        void *key;
+        long long size, at, offset;
+
+        tree = avl_tree_new(_compare, NULL);
+        for (i = 1; i <= max_nodes; i++)
+            avl_insert(tree, (void *)(long)i);
+        if (!file || avl_serialize(tree, fileno(file), _long_writer) != 0) {
+            printf("...failed\n");
+            return 1;
+        }
+        avl_tree_free(tree, _free);
+
+        mapped = avl_tree_new_mapped(fileno(file), _long_compare, NULL);
+        if (!mapped || mapped->length != (unsigned int)max_nodes || avl_verify(mapped) != 0) {
+            printf("...failed\n");
+            return 1;
+        }
+        for (i = 0; i < max_nodes; i++) {
+            long want = i + 1;
+
+            if (avl_get_by_index(mapped, i, &key) != 0 || *(long *)key != want
+                    || avl_get_by_key(mapped, &want, &key) != 0 || *(long *)key != want) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        avl_tree_free(mapped, NULL);
+
+        /* The keys take the last 8 bytes each, right before them is the
+         * offset of the last one.  Point it beyond the end, then put it
+         * back and cut the file short.
+         */
+        size = lseek(fileno(file), 0, SEEK_END);
+        at = size - 8L * max_nodes - 8;
+        if (pread(fileno(file), &offset, sizeof(offset), at) != sizeof(offset)
+                || pwrite(fileno(file), &size, sizeof(size), at) != sizeof(size)
+                || (mapped = avl_tree_new_mapped(fileno(file), _long_compare, NULL))
+                || pwrite(fileno(file), &offset, sizeof(offset), at) != sizeof(offset)
+                || ftruncate(fileno(file), size - 8) != 0
+                || (mapped = avl_tree_new_mapped(fileno(file), _long_compare, NULL))) {
+            printf("...failed\n");
+            return 1;
+        }
+        fclose(file);
+    }
+#endif
+
+    printf("Inserting and deleting batches...\n");
+    {
+        /* small batches go key by key, big ones rebuild the tree */
+        static const int sizes[] = {5, 300, 1, 200};
+        static long expected[1000];
+        static void *batch[300];
+        int counts[51] = {0}, round, n;
+
+        tree = avl_tree_new(_compare, NULL);
+        for (round = 0; round < 4; round++) {
+            for (n = 0; n < sizes[round]; n++) {
+                long key = rand() % 50 + 1;
+
+                batch[n] = (void *)key;
+                counts[key]++;
+            }
+            if (avl_insert_batch(tree, batch, n) != 0
+                    || !_check(tree, expected, _expected(counts, 51, expected))) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        for (round = 0; round < 4; round++) {
+            int wanted[51] = {0};
+            long deleted = 0;
+
+            for (n = 0; n < sizes[round]; n++) {
+                long key = rand() % 50 + 1;
+
+                batch[n] = (void *)key;
+                wanted[key]++;
+            }
+            /* every key in the batch takes away one copy */
+            for (i = 0; i < 51; i++) {
+                int gone = wanted[i] < counts[i] ? wanted[i] : counts[i];
+
+                counts[i] -= gone;
+                deleted += gone;
+            }
+            if (avl_delete_batch(tree, batch, n, _free) != deleted
+                    || !_check(tree, expected, _expected(counts, 51, expected))) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        avl_tree_free(tree, _free);
+    }
+
+    printf("Seeking with a cursor...\n");
+    {
+        static long expected[1000];
+        avl_cursor cursor;
+        void *key;
+        long k;
+        int n = max_nodes < 1000 ? max_nodes : 1000;
+
+        /* the even keys up to 2 * n */
+        tree = avl_tree_new(_compare, NULL);
+        for (i = 0; i < n; i++) {
+            expected[i] = 2 * i + 2;
+            avl_insert(tree, (void *)expected[i]);
+        }
+        avl_cursor_init(&cursor, tree);
+        for (i = 0; i < n; i++) {
+            if (avl_cursor_next(&cursor, &key) != 0 || (long)key != expected[i]) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        for (i = n - 2; i >= 0; i--) {
+            if (avl_cursor_prev(&cursor, &key) != 0 || (long)key != expected[i]) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        /* near and far, hits and misses */
+        for (i = 0; i < 4 * n; i++) {
+            k = rand() % (2 * n + 3);
+            if ((avl_cursor_seek(&cursor, (void *)k, &key) == 0) != (k > 0 && k % 2 == 0 && k <= 2 * n)
+                    || (k > 0 && k % 2 == 0 && k <= 2 * n && (long)key != k)) {
+                printf("...failed\n");
+                return 1;
+            }
+            if ((avl_cursor_seek_least(&cursor, (void *)k, &key) == 0) != (k <= 2 * n)
+                    || (k <= 2 * n && (long)key != (k < 2 ? 2 : k + k % 2))) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        /* deleting the key the cursor is on needs a fresh cursor */
+        avl_cursor_seek(&cursor, (void *)2L, &key);
+        avl_delete(tree, (void *)2L, _free);
+        avl_cursor_init(&cursor, tree);
+        if (!_check(tree, expected + 1, n - 1)
+                || (n > 1 && (avl_cursor_next(&cursor, &key) != 0 || (long)key != 4))) {
+            printf("...failed\n");
+            return 1;
+        }
+        avl_tree_free(tree, _free);
+    }
+
+    printf("Changing a B+tree...\n");
+    tree = avl_tree_new_btree(_compare, NULL);
+    if (!tree || !_mutate(tree, 1000) || avl_get_first(tree)) {
+        printf("...failed\n");
+        return 1;
+    }
+    avl_tree_free(tree, _free);
+
+    printf("Writing to a tree with a snapshot...\n");
+    {
+        static long expected[1000], seen[1000];
+        int counts[51] = {0}, old, deletes = 0;
+        avl_tree *snapshot;
+
+        tree = avl_tree_new(_compare, NULL);
+        for (i = 0; i < 300; i++) {
+            long key = rand() % 50 + 1;
+
+            avl_insert(tree, (void *)key);
+            counts[key]++;
+        }
+        old = _expected(counts, 51, seen);
+        snapshot = avl_snapshot(tree);
+#ifndef HAVE_AVL_NODE_LOCK
+        if (!snapshot) {
+            printf("...failed\n");
+            return 1;
+        }
+        /* deletes first, the snapshot still sees all those keys, then both */
+        freed = 0;
+        for (i = 0; i < 300; i++) {
+            long key = rand() % 50 + 1;
+
+            if (i < 100 || rand() % 2) {
+                if (avl_delete(tree, (void *)key, _free_count) == 0) {
+                    counts[key]--;
+                    deletes++;
+                }
+            } else {
+                avl_insert(tree, (void *)key);
+                counts[key]++;
+            }
+            if (!_check(tree, expected, _expected(counts, 51, expected)) || !_check(snapshot, seen, old)
+                    || (i < 100 && freed)) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        avl_snapshot_free(snapshot);
+        if (freed != deletes) {
+            printf("...failed\n");
+            return 1;
+        }
+        /* and on without it */
+        for (i = 0; i < 100; i++) {
+            long key = rand() % 50 + 1;
+
+            if (avl_delete(tree, (void *)key, _free) == 0)
+                counts[key]--;
+            if (!_check(tree, expected, _expected(counts, 51, expected))) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+#else
+        if (snapshot) {
+            printf("...failed\n");
+            return 1;
+        }
+#endif
+        avl_tree_free(tree, _free);
+    }
+
+    printf("Splitting, joining and deleting index ranges...\n");
+    {
+        static long expected[1000];
+        int counts[51] = {0}, n, low, high, j;
+
+        tree = avl_tree_new(_compare, NULL);
+        for (i = 0; i < 100; i++) {
+            for (j = 0; j < 5; j++) {
+                long key = rand() % 50 + 1;
+
+                avl_insert(tree, (void *)key);
+                counts[key]++;
+            }
+            n = _expected(counts, 51, expected);
+#ifndef HAVE_AVL_NODE_LOCK
+            {
+                long split = rand() % 52 + 1;
+                avl_tree *upper = avl_split(tree, (void *)split);
+
+                for (low = 0; low < n && expected[low] < split; low++)
+                    ;
+                if (!upper || !_check(tree, expected, low) || !_check(upper, expected + low, n - low)
+                        || avl_join(tree, upper) != 0 || !_check(tree, expected, n) || upper->length) {
+                    printf("...failed\n");
+                    return 1;
+                }
+                avl_tree_free(upper, _free);
+            }
+#endif
+            low = rand() % (n + 1);
+            high = low + rand() % (n - low + 1);
+            if (avl_delete_index_range(tree, low, high, _free) != 0) {
+                printf("...failed\n");
+                return 1;
+            }
+            for (j = low; j < high; j++)
+                counts[expected[j]]--;
+            if (!_check(tree, expected, _expected(counts, 51, expected))) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        if (avl_delete_index_range(tree, 1, 0, _free) == 0
+                || avl_delete_index_range(tree, 0, tree->length + 1, _free) == 0) {
+            printf("...failed\n");
+            return 1;
+        }
+        avl_tree_free(tree, _free);
+    }
+
+    printf("Changing a compact tree...\n");
+    tree = avl_tree_new_compact(_compare, NULL);
+    if (!tree || !_mutate(tree, 1000) || avl_get_first(tree)
+            || avl_delete_index_range(tree, 0, 0, _free) == 0) {
+        printf("...failed\n");
+        return 1;
+    }
+    avl_tree_free(tree, _free);
+
+    printf("Adding up ranges of an augmented tree...\n");
+    {
+        static const avl_augment augment = {sizeof(long), _lift, _combine, NULL};
+        static long expected[1000];
+        /* one more than the keys for ranges ending after the last */
+        int counts[52] = {0};
+
+        for (i = 0; i < 52; i++)
+            weights[i] = i;
+        tree = avl_tree_new_augmented(_compare, NULL, &augment);
+#ifndef HAVE_AVL_NODE_LOCK
+        if (!tree) {
+            printf("...failed\n");
+            return 1;
+        }
+        for (i = 0; i < 500; i++) {
+            long key = rand() % 50 + 1, low = rand() % 52, high = rand() % 52, sum = 0, k;
+            int found = 0;
+
+            if (rand() % 3) {
+                avl_insert(tree, (void *)key);
+                counts[key]++;
+            } else if (avl_delete(tree, (void *)key, _free) == 0) {
+                counts[key]--;
+            }
+            /* now and then a key that is in once adds up to something else */
+            key = rand() % 50 + 1;
+            if (rand() % 5 == 0 && counts[key] == 1) {
+                weights[key] = rand() % 1000;
+                if (avl_aggregate_update(tree, (void *)key) != 0) {
+                    printf("...failed\n");
+                    return 1;
+                }
+            }
+            /* 0 leaves that end open */
+            for (k = low ? low : 1; k <= (high ? high : 50); k++) {
+                sum += counts[k] * weights[k];
+                found |= counts[k] > 0;
+            }
+            if (!_check(tree, expected, _expected(counts, 51, expected))
+                    || avl_aggregate_range(tree, low ? (void *)low : NULL, high ? (void *)high : NULL, &k)
+                    != (found ? 0 : -1) || (found && k != sum)) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        if (avl_aggregate_update(tree, (void *)51L) == 0) {
+            printf("...failed\n");
+            return 1;
+        }
+        avl_tree_free(tree, _free);
+#else
+        if (tree) {
+            printf("...failed\n");
+            return 1;
+        }
+#endif
+    }
+
+    printf("Freezing a tree...\n");
+    {
+        static long expected[1000];
+        int counts[52] = {0}, n;
+        avl_tree *frozen;
+
+        tree = avl_tree_new(_compare, NULL);
+        for (i = 0; i < 300; i++) {
+            long key = rand() % 50 + 1;
+
+            avl_insert(tree, (void *)key);
+            counts[key]++;
+        }
+        n = _expected(counts, 51, expected);
+        frozen = avl_freeze(tree);
+        if (!frozen || !_check(frozen, expected, n)) {
+            printf("...failed\n");
+            return 1;
+        }
+        /* the copy stays as it was while the tree changes */
+        for (i = 0; i < 100; i++)
+            avl_delete(tree, (void *)(long)(rand() % 50 + 1), _free);
+        for (i = 1; i < 52; i++) {
+            void *found;
+
+            if ((avl_get_by_key(frozen, (void *)(long)i, &found) == 0) != (counts[i] > 0)
+                    || (counts[i] && (long)found != i)) {
+                printf("...failed\n");
+                return 1;
+            }
+        }
+        if (!_check(frozen, expected, n) || avl_get_first(frozen)) {
+            printf("...failed\n");
+            return 1;
+        }
+        /* the keys are the tree's */
+        avl_tree_free(frozen, NULL);
+        avl_tree_free(tree, _free);
+    }
+
     return 0;
 }
 
+/* the keys with <counts>[k] copies of each k, in order */
+int _expected(int *counts, int range, long *expected)
+{
+    int n = 0, k, c;
+
+    for (k = 0; k < range; k++) {
+        for (c = 0; c < counts[k]; c++)
+            expected[n++] = k;
+    }
+    return n;
+}
+
+/* compares the key with the one *iter_arg points to and moves on */
+int _next(void *key, void *iter_arg)
+{
+    long **at = iter_arg;
+
+    return (long)key != *(*at)++;
+}
+
+/* true if <tree> is sound and holds the <n> <expected> keys in order */
+int _check(avl_tree *tree, long *expected, int n)
+{
+    long *at = expected;
+    void *key;
+    int i;
+
+    if (avl_verify(tree) != 0 || tree->length != (unsigned int)n)
+        return 0;
+    for (i = 0; i < n; i++) {
+        if (avl_get_by_index(tree, i, &key) != 0 || (long)key != expected[i])
+            return 0;
+    }
+    return avl_iterate_inorder(tree, _next, &at) == 0 && at == expected + n;
+}
+
+/* random inserts and deletes of keys 1 to 50, many of them twice or more */
+int _mutate(avl_tree *tree, int ops)
+{
+    static long expected[1000];
+    int counts[51] = {0}, i;
+    void *found;
+
+    for (i = 0; i < ops; i++) {
+        long key = rand() % 50 + 1;
+
+        if (rand() % 3) {
+            if (avl_insert(tree, (void *)key) != 0)
+                return 0;
+            counts[key]++;
+        } else {
+            if ((avl_delete(tree, (void *)key, _free) == 0) != (counts[key] > 0))
+                return 0;
+            if (counts[key])
+                counts[key]--;
+        }
+        if (!_check(tree, expected, _expected(counts, 51, expected)))
+            return 0;
+        key = rand() % 50 + 1;
+        if ((avl_get_by_key(tree, (void *)key, &found) == 0) != (counts[key] > 0)
+                || (counts[key] && (long)found != key))
+            return 0;
+    }
+    return 1;
+}
+
+/* counts the keys it frees */
+int _free_count(void *key)
+{
+    freed++;
+    return 1;
+}
+
+/* sums up weights[key] */
+void _lift(void *arg, void *value, void *key)
+{
+    *(long *)value = weights[(long)key];
+}
+
+void _combine(void *arg, void *value, const void *next)
+{
+    *(long *)value += *(const long *)next;
+}
+
+unsigned long _hash(void *compare_arg, void *key)
+{
+    return (unsigned long)key * 2654435761UL;
+}
+
+/* counts the keys of a run, which have to come in order */
+int _count(unsigned long index, void *key, void *iter_arg)
+{
+    unsigned long *run = iter_arg;
+
+    if ((run[0] && index != run[1] + 1) || (unsigned long)key != index + 1)
+        return 1;
+    run[0]++;
+    run[1] = index;
+    return 0;
+}
+
+/* keys of mapped trees point to the bytes _long_writer() wrote */
+int _long_compare(void *compare_arg, void *a, void *b)
+{
+    long i = *(long *)a, j = *(long *)b;
+
+    return i < j ? -1 : i > j;
+}
+
+size_t _long_writer(void *key, char *buffer, size_t size)
+{
+    long value = (long)key;
+
+    if (size >= sizeof(value))
+        memcpy(buffer, &value, sizeof(value));
+    return sizeof(value);
+}
+
 int _compare(void *compare_arg, void *a, void *b)
 {
     int i, j;
@@ -0,0 +1,123 @@
+/*
+ * Test for the C++ front end in avl.hpp, checked against std::multiset.
+ *
+ *   cc -c -I.. avl*.c ../thread/thread.c && c++ -std=c++11 -I.. test.cpp *.o -lpthread
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <type_traits>
+
+#include "avl.hpp"
+
+typedef icecast::avl_tree<std::string> string_tree;
+
+static bool same(const string_tree &tree, const std::multiset<std::string> &ref)
+{
+    std::multiset<std::string>::const_iterator r = ref.begin();
+    unsigned long index = 0;
+
+    if (avl_verify(tree.c_tree()) != 0 || tree.size() != ref.size())
+        return false;
+    for (string_tree::iterator it = tree.begin(); it != tree.end(); ++it, ++r, ++index) {
+        const std::string *at = tree.at_index(index);
+
+        if (*it != *r || !at || *at != *r)
+            return false;
+    }
+    if (tree.at_index(index))
+        return false;
+
+    /* and backwards from end() */
+    std::multiset<std::string>::const_reverse_iterator b = ref.rbegin();
+    string_tree::iterator it = tree.end();
+
+    while (b != ref.rend()) {
+        if (it == tree.begin() || *--it != *b++)
+            return false;
+    }
+    return it == tree.begin();
+}
+
+int main(int argc, char **argv)
+{
+    string_tree tree;
+    std::multiset<std::string> ref;
+    int i, ops = 20000;
+
+    if (argc == 2)
+        ops = atoi(argv[1]);
+
+    printf("avl.hpp test... ops = %d...\n", ops);
+
+    printf("Inserting and erasing with duplicates...\n");
+    srand(3);
+    for (i = 0; i < ops; i++) {
+        std::string key = std::to_string(rand() % 500);
+
+        if (rand() % 3) {
+            const std::string *v = tree.insert(key);
+
+            if (!v || *v != key) {
+                printf("...failed\n");
+                return 1;
+            }
+            ref.insert(key);
+        } else {
+            std::multiset<std::string>::iterator r = ref.find(key);
+
+            if (tree.erase(key) != (r != ref.end())) {
+                printf("...failed\n");
+                return 1;
+            }
+            if (r != ref.end())
+                ref.erase(r);
+        }
+        if (i % 200 == 0 && !same(tree, ref)) {
+            printf("...failed\n");
+            return 1;
+        }
+    }
+
+    printf("Finding keys...\n");
+    static_assert(std::is_same<decltype(static_cast<const string_tree &>(tree).find("")),
+                const std::string *>::value, "find() const gives const values");
+    for (i = 0; i < 500; i++) {
+        const string_tree &const_tree = tree;
+        std::string key = std::to_string(i);
+        const std::string *v = const_tree.find(key);
+
+        if ((v != NULL) != (ref.count(key) != 0) || (v && *v != key)) {
+            printf("...failed\n");
+            return 1;
+        }
+    }
+
+    printf("Emplacing and erasing by iterator...\n");
+    tree.emplace(3, 'x');
+    tree.emplace(3, 'x');
+    ref.insert("xxx");
+    ref.insert("xxx");
+    if (!tree.find("xxx") || !same(tree, ref)) {
+        printf("...failed\n");
+        return 1;
+    }
+    for (string_tree::iterator it = tree.begin(); it != tree.end(); ) {
+        string_tree::iterator next = it;
+
+        ++next;
+        if (*it == "xxx")
+            tree.erase(it);
+        it = next;
+    }
+    ref.erase("xxx");
+    if (tree.find("xxx") || !same(tree, ref)) {
+        printf("...failed\n");
+        return 1;
+    }
+
+    printf("...done\n");
+    return 0;
+}
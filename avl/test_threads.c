@@ -0,0 +1,171 @@
+/*
+ * Stress test for the lock coupled readers of HAVE_AVL_NODE_LOCK.  One
+ * writer inserts and deletes while the readers look keys up and walk
+ * the tree without the tree lock, and every key a reader gets is
+ * checked.  Keys are malloc()ed and freed on delete through
+ * avl_tree_set_deferred_free(), so run it under a memory checker, e.g.
+ * -fsanitize=address.
+ *
+ *   cc -DHAVE_AVL_NODE_LOCK -I.. test_threads.c avl*.c ../thread/thread.c -lpthread
+ *   ./a.out [readers [writes]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <thread/thread.h>
+#include "avl.h"
+
+#ifndef HAVE_AVL_NODE_LOCK
+#error "test_threads.c needs HAVE_AVL_NODE_LOCK"
+#endif
+
+#define KEYS 20000
+
+typedef struct {
+    long value;
+    /* ~value while the key is alive */
+    long check;
+} test_key;
+
+static avl_tree *tree;
+static thread_epoch_t *epoch;
+static volatile int done;
+static long writes = 100000;
+
+static int _compare(void *compare_arg, void *a, void *b)
+{
+    long i = ((test_key *)a)->value, j = ((test_key *)b)->value;
+
+    (void)compare_arg;
+    return i < j ? -1 : i > j;
+}
+
+static int _free(void *key)
+{
+    ((test_key *)key)->check = 0;
+    free(key);
+    return 1;
+}
+
+static void _check(test_key *key)
+{
+    if (key->check != ~key->value || key->value < 0 || key->value >= KEYS) {
+        fprintf(stderr, "bad key %ld\n", key->value);
+        abort();
+    }
+}
+
+static void *reader(void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg;
+    long ops = 0;
+
+    while (!done) {
+        test_key want, *key;
+        void *found;
+
+        want.value = rand_r(&seed) % KEYS;
+
+        thread_epoch_enter(epoch);
+        if (avl_get_by_key(tree, &want, &found) == 0) {
+            key = found;
+            _check(key);
+            if (key->value != want.value)
+                abort();
+        }
+        if (avl_get_item_by_key_least(tree, &want, &found) == 0) {
+            key = found;
+            _check(key);
+            if (key->value < want.value)
+                abort();
+        }
+        if (avl_get_item_by_key_most(tree, &want, &found) == 0) {
+            key = found;
+            _check(key);
+            if (key->value > want.value)
+                abort();
+        }
+        if ((ops & 255) == 0) {
+            long last = -1;
+            avl_node *node = avl_get_first_locked(tree);
+
+            while (node) {
+                key = node->key;
+                _check(key);
+                if (key->value <= last)
+                    abort();
+                last = key->value;
+                node = avl_get_next_locked(node);
+            }
+        }
+        thread_epoch_leave(epoch);
+        ops++;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    thread_type *readers[64];
+    int i, count = 4;
+    unsigned int seed = 1;
+    long n;
+    time_t start;
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+    if (argc > 2)
+        writes = atol(argv[2]);
+    if (count < 0 || count > 64)
+        count = 4;
+
+    thread_initialize();
+    epoch = thread_epoch_new();
+    tree = avl_tree_new(_compare, NULL);
+    if (!epoch || !tree || avl_tree_set_deferred_free(tree, epoch) != 0) {
+        printf("setup failed\n");
+        return 1;
+    }
+
+    printf("%d readers, %ld writes...\n", count, writes);
+    start = time(NULL);
+    for (i = 0; i < count; i++)
+        readers[i] = thread_create("reader", reader, (void *)(long)(i + 1), THREAD_ATTACHED);
+
+    for (n = 0; n < writes; n++) {
+        test_key want, *key;
+        void *found;
+
+        want.value = rand_r(&seed) % KEYS;
+        avl_tree_wlock(tree);
+        if (rand_r(&seed) & 1) {
+            if (avl_get_by_key(tree, &want, &found) != 0) {
+                key = malloc(sizeof(*key));
+                key->value = want.value;
+                key->check = ~want.value;
+                avl_insert(tree, key);
+            }
+        } else {
+            avl_delete(tree, &want, _free);
+        }
+        avl_tree_unlock(tree);
+    }
+
+    done = 1;
+    for (i = 0; i < count; i++)
+        thread_join(readers[i]);
+
+    if (avl_verify(tree) != 0) {
+        printf("...failed\n");
+        return 1;
+    }
+    printf("...done in %lds, %u keys\n", (long)(time(NULL) - start), tree->length);
+
+    avl_tree_free(tree, _free);
+    thread_epoch_free(epoch);
+    thread_shutdown();
+
+    return 0;
+}
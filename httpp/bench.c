@@ -0,0 +1,107 @@
+/*
+ * Benchmark for the request parser: requests per second for a typical
+ * listener request, parsed at once and fed in small pieces the way they
+ * come in from a socket.  Build with optimizations, e.g.
+ *
+ *   cc -O2 -I.. bench.c httpp.c encoding.c ../avl/avl*.c ../thread/thread.c -lpthread
+ *   ./a.out [requests]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "httpp.h"
+
+static const char request[] =
+    "GET /stream.mp3 HTTP/1.1\r\n"
+    "Host: radio.example.com:8000\r\n"
+    "User-Agent: VLC/3.0.18 LibVLC/3.0.18\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en_US\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: close\r\n"
+    "Icy-MetaData: 1\r\n"
+    "Range: bytes=0-\r\n"
+    "Referer: http://example.com/player\r\n"
+    "Cookie: session=abcdef0123456789\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "DNT: 1\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "X-Forwarded-For: 10.0.0.1\r\n"
+    "\r\n";
+
+/* wall clock in seconds */
+static double bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* parses <request> fed in pieces of <chunk> bytes, all at once for 0 */
+static int bench_one(size_t chunk)
+{
+    http_parser_t *parser = httpp_create_parser();
+    size_t len = sizeof(request) - 1, done = 0;
+    int ok = 0;
+
+    if (!parser)
+        return 0;
+    httpp_initialize(parser, NULL);
+    if (!chunk) {
+        ok = httpp_parse(parser, request, len);
+    } else {
+        while (done < len) {
+            size_t n = len - done < chunk ? len - done : chunk;
+            long ret = httpp_feed(parser, request + done, n);
+
+            if (ret < 0)
+                break;
+            done += n;
+            if (ret > 0) {
+                ok = 1;
+                break;
+            }
+        }
+    }
+    ok = ok && httpp_getvar(parser, "user-agent") && httpp_getvar_id(parser, HTTPP_HDR_ICY_METADATA);
+    httpp_release(parser);
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t chunks[] = {0, 64, 16};
+    long requests = 1000000, r;
+    unsigned int c;
+
+    if (argc == 2)
+        requests = atol(argv[1]);
+    if (requests <= 0)
+        requests = 1000000;
+
+    printf("%lu byte request, %ld requests each\n", (unsigned long)sizeof(request) - 1, requests);
+    for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        double start = bench_now();
+
+        for (r = 0; r < requests; r++) {
+            if (!bench_one(chunks[c])) {
+                printf("parse failed\n");
+                return 1;
+            }
+        }
+        if (chunks[c])
+            printf("  fed %2lu bytes at a time: %8.0f requests/s\n", (unsigned long)chunks[c],
+                    requests / (bench_now() - start));
+        else
+            printf("  httpp_parse():           %8.0f requests/s\n",
+                    requests / (bench_now() - start));
+    }
+
+    return 0;
+}
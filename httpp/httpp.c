@@ -38,26 +38,96 @@
 #include <strings.h>
 #endif
 
-#include <avl/avl.h>
 #include "httpp.h"
 
 #define MAX_HEADERS 32
+/* room for the __ vars a request sets besides its headers */
+#define MAX_PARSED_VARS (MAX_HEADERS + 8)
+
+/* A parsed request is copied into one of these.  The vars set while
+ * parsing point into the copy and sit in the buffer as well, so a
+ * request costs one allocation however many headers it has.  Buffers
+ * stay with the parser until it is released.
+ */
+typedef struct httpp_buffer_tag {
+    struct httpp_buffer_tag *next;
+    /* first byte past the buffer */
+    char *end;
+    size_t vars;
+    http_var_t var[MAX_PARSED_VARS];
+    /* one value each */
+    char *value[MAX_PARSED_VARS];
+    /* the request, then as much space again for copies of parts of it */
+    char data[1];
+} httpp_buffer_t;
+
+/* the limit for httpp_feed(), a client sending more is up to no good */
+#define MAX_REQUEST_SIZE 8192
+
+/* a request httpp_feed() has not seen all of yet */
+typedef struct httpp_feed_tag {
+    int state;
+    /* a buffer for up to <size> bytes, <len> of which are there */
+    httpp_buffer_t *buffer;
+    unsigned long size;
+    unsigned long len;
+} httpp_feed_t;
+
+/* Well-known headers by the hash of their name.  The hash only looks
+ * at the length and the first and last byte, which tells all of them
+ * apart.  The compiler works out each slot from the same three, and
+ * -Woverride-init warns if a new name lands on a taken one.
+ */
+#define HTTPP_HDR_SLOTS 64
+#define HTTPP_HDR_HASH(len, first, last) (((len) + (first) * 4 + (last) * 30) & (HTTPP_HDR_SLOTS - 1))
+#define HTTPP_HDR_SLOT(id, name, first, last) [HTTPP_HDR_HASH(sizeof(name) - 1, first, last)] = {name, id}
+
+static const struct {
+    const char *name;
+    httpp_hdr_t id;
+} _httpp_hdr_slot[HTTPP_HDR_SLOTS] = {
+    HTTPP_HDR_SLOT(HTTPP_HDR_ACCEPT, "accept", 'a', 't'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_ACCEPT_ENCODING, "accept-encoding", 'a', 'g'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_AUTHORIZATION, "authorization", 'a', 'n'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_CACHE_CONTROL, "cache-control", 'c', 'l'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_CONNECTION, "connection", 'c', 'n'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_CONTENT_LENGTH, "content-length", 'c', 'h'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_CONTENT_TYPE, "content-type", 'c', 'e'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_COOKIE, "cookie", 'c', 'e'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_EXPECT, "expect", 'e', 't'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_HOST, "host", 'h', 't'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_ICE_AUDIO_INFO, "ice-audio-info", 'i', 'o'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_ICE_NAME, "ice-name", 'i', 'e'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_ICE_PUBLIC, "ice-public", 'i', 'c'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_ICY_METADATA, "icy-metadata", 'i', 'a'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_ORIGIN, "origin", 'o', 'n'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_RANGE, "range", 'r', 'e'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_REFERER, "referer", 'r', 'r'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_TRANSFER_ENCODING, "transfer-encoding", 't', 'g'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_UPGRADE, "upgrade", 'u', 'e'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_USER_AGENT, "user-agent", 'u', 't'),
+    HTTPP_HDR_SLOT(HTTPP_HDR_X_FORWARDED_FOR, "x-forwarded-for", 'x', 'r')
+};
 
 /* internal functions */
 
 /* misc */
 static char *_lowercase(char *str);
 
-/* for avl trees */
-static int _compare_vars(void *compare_arg, void *a, void *b);
+/* for var tables */
+static void _httpp_vartable_init(http_vartable_t *table);
+static http_var_t **_httpp_vartable_find(http_vartable_t *table, const char *name);
+static int _httpp_vartable_insert(http_vartable_t *table, http_var_t *var);
+static void _httpp_vartable_delete(http_vartable_t *table, http_var_t **slot);
+static void _httpp_vartable_free(http_vartable_t *table);
 static int _free_vars(void *key);
 
-/* For avl tree manipulation */
-static void parse_query(avl_tree *tree, const char *query, size_t len);
-static const char *_httpp_get_param(avl_tree *tree, const char *name);
-static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int replace);
-static void _httpp_set_param(avl_tree *tree, const char *name, const char *value);
-static http_var_t *_httpp_get_param_var(avl_tree *tree, const char *name);
+/* For var table manipulation */
+static void parse_query(http_vartable_t *table, const char *query, size_t len);
+static const char *_httpp_get_param(http_vartable_t *table, const char *name);
+static void _httpp_set_param_nocopy(http_vartable_t *table, char *name, char *value, int replace);
+static void _httpp_set_param(http_vartable_t *table, const char *name, const char *value);
+static http_var_t *_httpp_get_param_var(http_vartable_t *table, const char *name);
 
 httpp_request_info_t httpp_request_info(httpp_request_type_e req)
 {
@@ -123,9 +193,11 @@ http_parser_t *httpp_create_parser(void)
     parser->refc = 1;
     parser->req_type = httpp_req_none;
     parser->uri = NULL;
-    parser->vars = avl_tree_new(_compare_vars, NULL);
-    parser->queryvars = avl_tree_new(_compare_vars, NULL);
-    parser->postvars = avl_tree_new(_compare_vars, NULL);
+    parser->buffers = NULL;
+    parser->feed = NULL;
+    _httpp_vartable_init(&parser->vars);
+    _httpp_vartable_init(&parser->queryvars);
+    _httpp_vartable_init(&parser->postvars);
 
     return parser;
 }
@@ -147,92 +219,329 @@ void httpp_initialize(http_parser_t *parser, http_varlist_t *defaults)
     }
 }
 
-static int split_headers(char *data, unsigned long len, char **line)
+/* make room in <buffer> for a request of <len> bytes, NULL leaves it alone */
+static httpp_buffer_t *_httpp_buffer_resize(httpp_buffer_t *buffer, unsigned long len)
 {
-    /* first we count how many lines there are 
-    ** and set up the line[] array     
-    */
-    int lines = 0;
+    size_t size = sizeof(httpp_buffer_t) + (len + 1) * 2;
+
+    buffer = realloc(buffer, size);
+    if (buffer == NULL)
+        return NULL;
+
+    buffer->end = (char *)buffer + size;
+    return buffer;
+}
+
+/* hand <buffer> to the parser, it must not move anymore */
+static void _httpp_buffer_link(http_parser_t *parser, httpp_buffer_t *buffer)
+{
+    buffer->vars = 0;
+    buffer->next = parser->buffers;
+    parser->buffers = buffer;
+}
+
+static httpp_buffer_t *_httpp_buffer_new(http_parser_t *parser, const char *http_data, unsigned long len)
+{
+    httpp_buffer_t *buffer = _httpp_buffer_resize(NULL, len);
+
+    if (buffer == NULL)
+        return NULL;
+
+    /* the local copy of the data, including 0 terminator */
+    memcpy(buffer->data, http_data, len);
+    buffer->data[len] = 0;
+
+    _httpp_buffer_link(parser, buffer);
+
+    return buffer;
+}
+
+/* is <var> one of the vars in our buffers? Those are not freed one by one */
+static int _httpp_var_in_buffer(http_parser_t *parser, http_var_t *var)
+{
+    httpp_buffer_t *buffer;
+
+    for (buffer = parser->buffers; buffer; buffer = buffer->next) {
+        if ((char *)var >= (char *)buffer && (char *)var < buffer->end)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void _httpp_free_var(http_parser_t *parser, http_var_t *var)
+{
+    if (!_httpp_var_in_buffer(parser, var))
+        _free_vars(var);
+}
+
+/* the httpp_hdr_t for <name>, HTTPP_HDR_MAX if it is not well-known */
+static httpp_hdr_t _httpp_hdr_id(const char *name)
+{
+    size_t len = strlen(name);
+    unsigned int slot;
+
+    if (len == 0)
+        return HTTPP_HDR_MAX;
+
+    slot = HTTPP_HDR_HASH(len, (unsigned char)name[0], (unsigned char)name[len - 1]);
+    if (_httpp_hdr_slot[slot].name && strcmp(_httpp_hdr_slot[slot].name, name) == 0)
+        return _httpp_hdr_slot[slot].id;
+
+    return HTTPP_HDR_MAX;
+}
+
+/* insert <var> into parser->vars, replacing a var of the same name */
+static void _httpp_replace_var(http_parser_t *parser, http_var_t *var)
+{
+    http_var_t **slot = _httpp_vartable_find(&parser->vars, var->name);
+    httpp_hdr_t id = _httpp_hdr_id(var->name);
+
+    if (slot) {
+        _httpp_free_var(parser, *slot);
+        *slot = var;
+    } else if (_httpp_vartable_insert(&parser->vars, var) != 0) {
+        _httpp_free_var(parser, var);
+        var = NULL;
+    }
+
+    if (id != HTTPP_HDR_MAX)
+        parser->header[id] = var;
+}
+
+/* like httpp_setvar(), but <name> and <value> must live as long as <buffer> */
+static void _httpp_setvar_nocopy(http_parser_t *parser, httpp_buffer_t *buffer, const char *name, const char *value)
+{
+    http_var_t *var;
+
+    if (buffer->vars == MAX_PARSED_VARS) {
+        httpp_setvar(parser, name, value);
+        return;
+    }
+
+    var = &buffer->var[buffer->vars];
+    var->name = (char *)name;
+    var->values = 1;
+    var->value = &buffer->value[buffer->vars];
+    var->value[0] = (char *)value;
+    buffer->vars++;
+
+    _httpp_replace_var(parser, var);
+}
+
+static void _httpp_feed_free(http_parser_t *parser)
+{
+    if (parser->feed == NULL)
+        return;
+
+    free(parser->feed->buffer);
+    free(parser->feed);
+    parser->feed = NULL;
+}
+
+/*
+ * Find the bytes split_headers() cares about: NUL, CR, LF and ':'.  Each
+ * scanner looks at 32 bytes and sets bit i of its result if p[i] is one
+ * of them.  The fastest one the CPU has is picked on first use.
+ */
+
+typedef unsigned int (*httpp_scan_fun)(const char *p);
+
+static unsigned int _httpp_scan_scalar_n(const char *p, unsigned long n)
+{
+    unsigned int mask = 0;
     unsigned long i;
-    line[lines] = data;
-    for (i = 0; i < len && lines < MAX_HEADERS; i++) {
-        if (data[i] == '\r')
-            data[i] = '\0';
-        if (data[i] == '\n') {
-            lines++;
-            data[i] = '\0';
-            if (lines >= MAX_HEADERS)
-                return MAX_HEADERS;
-            if (i + 1 < len) {
-                if (data[i + 1] == '\n' || data[i + 1] == '\r')
-                    break;
-                line[lines] = &data[i + 1];
-            }
+
+    for (i = 0; i < n; i++) {
+        switch (p[i]) {
+            case '\0':
+            case '\r':
+            case '\n':
+            case ':':
+                mask |= 1U << i;
+            break;
         }
     }
 
-    i++;
-    while (i < len && data[i] == '\n') i++;
+    return mask;
+}
+
+static unsigned int _httpp_scan_scalar(const char *p)
+{
+    return _httpp_scan_scalar_n(p, 32);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_HTTPP_SCAN_X86
+
+__attribute__((target("sse2")))
+static unsigned int _httpp_scan_sse2_16(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i hit = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8(':'))));
+
+    return (unsigned int)_mm_movemask_epi8(hit);
+}
+
+__attribute__((target("sse2")))
+static unsigned int _httpp_scan_sse2(const char *p)
+{
+    return _httpp_scan_sse2_16(p) | (_httpp_scan_sse2_16(p + 16) << 16);
+}
+
+__attribute__((target("avx2")))
+static unsigned int _httpp_scan_avx2(const char *p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hit = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':'))));
+
+    return (unsigned int)_mm256_movemask_epi8(hit);
+}
+#endif
+
+static httpp_scan_fun _httpp_scan_select(void)
+{
+#ifdef HAVE_HTTPP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return _httpp_scan_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return _httpp_scan_sse2;
+#endif
+    return _httpp_scan_scalar;
+}
+
+/* the scanner to use, parsers run in many threads at once */
+static httpp_scan_fun _httpp_scan(void)
+{
+#ifdef HAVE_HTTPP_SCAN_X86
+    static httpp_scan_fun scan = NULL;
+    httpp_scan_fun fun = __atomic_load_n(&scan, __ATOMIC_ACQUIRE);
+
+    /* threads racing here all pick the same one */
+    if (fun == NULL) {
+        fun = _httpp_scan_select();
+        __atomic_store_n(&scan, fun, __ATOMIC_RELEASE);
+    }
+
+    return fun;
+#else
+    return _httpp_scan_select();
+#endif
+}
+
+/* index of the lowest bit set in <mask>, which is not 0 */
+static int _httpp_lowest_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+
+    while (!(mask & 1U)) {
+        mask >>= 1;
+        i++;
+    }
+
+    return i;
+#endif
+}
+
+/* Cut <data> into lines and find the first ':' of each, in one pass.  A
+ * line ends at its LF, the lines end at an empty one.  CR become NUL,
+ * so like a NUL they end the line early and hide what follows.
+ */
+static int split_headers(char *data, unsigned long len, char **line, char **colon)
+{
+    httpp_scan_fun scan = _httpp_scan();
+    int lines = 0;
+    int cut = 0;
+    unsigned long base;
+
+    line[0] = data;
+    colon[0] = NULL;
+    for (base = 0; base < len; base += 32) {
+        unsigned int mask = len - base >= 32 ? scan(&data[base]) : _httpp_scan_scalar_n(&data[base], len - base);
+
+        while (mask) {
+            unsigned long i = base + _httpp_lowest_bit(mask);
+
+            mask &= mask - 1;
+            switch (data[i]) {
+                case ':':
+                    if (!cut && colon[lines] == NULL)
+                        colon[lines] = &data[i];
+                break;
+                case '\r':
+                    data[i] = '\0';
+                    cut = 1;
+                break;
+                case '\0':
+                    cut = 1;
+                break;
+                case '\n':
+                    lines++;
+                    data[i] = '\0';
+                    if (lines >= MAX_HEADERS)
+                        return MAX_HEADERS;
+                    colon[lines] = NULL;
+                    cut = 0;
+                    if (i + 1 < len) {
+                        if (data[i + 1] == '\n' || data[i + 1] == '\r')
+                            return lines;
+                        line[lines] = &data[i + 1];
+                    }
+                break;
+            }
+        }
+    }
 
     return lines;
 }
 
-static void parse_headers(http_parser_t *parser, char **line, int lines)
+static void parse_headers(http_parser_t *parser, httpp_buffer_t *buffer, char **line, char **colon, int lines)
 {
-    int i, l;
-    int whitespace, slen;
-    char *name = NULL;
-    char *value = NULL;
+    int l;
 
     /* parse the name: value lines. */
     for (l = 1; l < lines; l++) {
-        whitespace = 0;
-        name = line[l];
-        value = NULL;
-        slen = strlen(line[l]);
-        for (i = 0; i < slen; i++) {
-            if (line[l][i] == ':') {
-                whitespace = 1;
-                line[l][i] = '\0';
-            } else {
-                if (whitespace) {
-                    whitespace = 0;
-                    while (i < slen && line[l][i] == ' ')
-                        i++;
-
-                    if (i < slen)
-                        value = &line[l][i];
-                    
-                    break;
-                }
-            }
-        }
-        
-        if (name != NULL && value != NULL) {
-            httpp_setvar(parser, _lowercase(name), value);
-            name = NULL; 
-            value = NULL;
-        }
+        char *value = colon[l];
+
+        if (value == NULL)
+            continue;
+
+        while (*value == ':')
+            *value++ = '\0';
+        while (*value == ' ')
+            value++;
+
+        if (*value)
+            _httpp_setvar_nocopy(parser, buffer, _lowercase(line[l]), value);
     }
 }
 
 int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned long len, const char *uri)
 {
+    httpp_buffer_t *buffer;
     char *data;
     char *line[MAX_HEADERS];
+    char *colon[MAX_HEADERS];
     int lines, slen,i, whitespace=0, where=0,code;
     char *version=NULL, *resp_code=NULL, *message=NULL;
     
     if(http_data == NULL)
         return 0;
 
-    /* make a local copy of the data, including 0 terminator */
-    data = (char *)malloc(len+1);
-    if (data == NULL) return 0;
-    memcpy(data, http_data, len);
-    data[len] = 0;
+    buffer = _httpp_buffer_new(parser, http_data, len);
+    if (buffer == NULL) return 0;
+    data = buffer->data;
 
-    lines = split_headers(data, len, line);
+    lines = split_headers(data, len, line, colon);
 
     /* In this case, the first line contains:
      * VERSION RESPONSE_CODE MESSAGE, such as HTTP/1.0 200 OK
@@ -256,29 +565,26 @@ int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned
     }
 
     if(version == NULL || resp_code == NULL || message == NULL) {
-        free(data);
         return 0;
     }
 
-    httpp_setvar(parser, HTTPP_VAR_ERROR_CODE, resp_code);
+    _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_ERROR_CODE, resp_code);
     code = atoi(resp_code);
     if(code < 200 || code >= 300) {
-        httpp_setvar(parser, HTTPP_VAR_ERROR_MESSAGE, message);
+        _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_ERROR_MESSAGE, message);
     }
 
     httpp_setvar(parser, HTTPP_VAR_URI, uri);
-    httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "NONE");
+    _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "NONE");
 
-    parse_headers(parser, line, lines);
-
-    free(data);
+    parse_headers(parser, buffer, line, colon, lines);
 
     return 1;
 }
 
 int httpp_parse_postdata(http_parser_t *parser, const char *body_data, size_t len)
 {
-    const char *header = httpp_getvar(parser, "content-type");
+    const char *header = httpp_getvar_id(parser, HTTPP_HDR_CONTENT_TYPE);
 
     if (!header)
         return -1;
@@ -287,7 +593,7 @@ int httpp_parse_postdata(http_parser_t *parser, const char *body_data, size_t le
         return -1;
     }
 
-    parse_query(parser->postvars, body_data, len);
+    parse_query(&parser->postvars, body_data, len);
 
     return 0;
 }
@@ -353,7 +659,7 @@ static char *url_unescape(const char *src, size_t len)
     return (char *)decoded;
 }
 
-static void parse_query_element(avl_tree *tree, const char *start, const char *mid, const char *end)
+static void parse_query_element(http_vartable_t *table, const char *start, const char *mid, const char *end)
 {
     size_t keylen;
     char *key;
@@ -379,10 +685,10 @@ static void parse_query_element(avl_tree *tree, const char *start, const char *m
 
     value = url_unescape(mid + 1, valuelen);
 
-    _httpp_set_param_nocopy(tree, key, value, 0);
+    _httpp_set_param_nocopy(table, key, value, 0);
 }
 
-static void parse_query(avl_tree *tree, const char *query, size_t len)
+static void parse_query(http_vartable_t *table, const char *query, size_t len)
 {
     const char *start = query;
     const char *mid = NULL;
@@ -394,7 +700,7 @@ static void parse_query(avl_tree *tree, const char *query, size_t len)
     for (i = 0; i < len; i++) {
         switch (query[i]) {
             case '&':
-                parse_query_element(tree, start, mid, &(query[i]));
+                parse_query_element(table, start, mid, &(query[i]));
                 start = &(query[i + 1]);
                 mid = NULL;
             break;
@@ -404,13 +710,15 @@ static void parse_query(avl_tree *tree, const char *query, size_t len)
         }
     }
 
-    parse_query_element(tree, start, mid, &(query[i]));
+    parse_query_element(table, start, mid, &(query[i]));
 }
 
-int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
+/* parse the request of <len> bytes in <buffer> */
+static int _httpp_parse_request(http_parser_t *parser, httpp_buffer_t *buffer, unsigned long len)
 {
-    char *data, *tmp;
+    char *data = buffer->data, *tmp;
     char *line[MAX_HEADERS]; /* limited to 32 lines, should be more than enough */
+    char *colon[MAX_HEADERS];
     int i;
     int lines;
     char *req_type = NULL;
@@ -418,16 +726,7 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
     char *version = NULL;
     int whitespace, where, slen;
 
-    if (http_data == NULL)
-        return 0;
-
-    /* make a local copy of the data, including 0 terminator */
-    data = (char *)malloc(len+1);
-    if (data == NULL) return 0;
-    memcpy(data, http_data, len);
-    data[len] = 0;
-
-    lines = split_headers(data, len, line);
+    lines = split_headers(data, len, line, colon);
 
     /* parse the first line special
     ** the format is:
@@ -457,7 +756,6 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
                     break;
                     case 3:
                         /* There is an extra element in the request line. This is not HTTP. */
-                        free(data);
                         return 0;
                     break;
                 }
@@ -470,101 +768,210 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
     if (uri != NULL && strlen(uri) > 0) {
         char *query;
         if((query = strchr(uri, '?')) != NULL) {
-            httpp_setvar(parser, HTTPP_VAR_RAWURI, uri);
-            httpp_setvar(parser, HTTPP_VAR_QUERYARGS, query);
+            /* the raw uri keeps its query, so it goes behind the request */
+            char *rawuri = &data[len + 1];
+
+            strcpy(rawuri, uri);
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_RAWURI, rawuri);
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_QUERYARGS, rawuri + (query - uri));
             *query = 0;
             query++;
-            parse_query(parser->queryvars, query, strlen(query));
+            parse_query(&parser->queryvars, query, strlen(query));
         }
 
-        parser->uri = strdup(uri);
+        parser->uri = uri;
     } else {
-        free(data);
         return 0;
     }
 
     if ((version != NULL) && ((tmp = strchr(version, '/')) != NULL)) {
         tmp[0] = '\0';
         if ((strlen(version) > 0) && (strlen(&tmp[1]) > 0)) {
-            httpp_setvar(parser, HTTPP_VAR_PROTOCOL, version);
-            httpp_setvar(parser, HTTPP_VAR_VERSION, &tmp[1]);
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_PROTOCOL, version);
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_VERSION, &tmp[1]);
         } else {
-            free(data);
             return 0;
         }
     } else {
-        free(data);
         return 0;
     }
 
     if (parser->req_type != httpp_req_none && parser->req_type != httpp_req_unknown) {
         switch (parser->req_type) {
         case httpp_req_get:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "GET");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "GET");
             break;
         case httpp_req_post:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "POST");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "POST");
             break;
         case httpp_req_put:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "PUT");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "PUT");
             break;
         case httpp_req_head:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "HEAD");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "HEAD");
             break;
         case httpp_req_options:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "OPTIONS");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "OPTIONS");
             break;
         case httpp_req_delete:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "DELETE");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "DELETE");
             break;
         case httpp_req_trace:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "TRACE");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "TRACE");
             break;
         case httpp_req_connect:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "CONNECT");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "CONNECT");
             break;
         case httpp_req_source:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "SOURCE");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "SOURCE");
             break;
         case httpp_req_play:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "PLAY");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "PLAY");
             break;
         case httpp_req_stats:
-            httpp_setvar(parser, HTTPP_VAR_REQ_TYPE, "STATS");
+            _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_REQ_TYPE, "STATS");
             break;
         default:
             break;
         }
     } else {
-        free(data);
         return 0;
     }
 
     if (parser->uri != NULL) {
-        httpp_setvar(parser, HTTPP_VAR_URI, parser->uri);
+        _httpp_setvar_nocopy(parser, buffer, HTTPP_VAR_URI, parser->uri);
     } else {
-        free(data);
         return 0;
     }
 
-    parse_headers(parser, line, lines);
-
-    free(data);
+    parse_headers(parser, buffer, line, colon, lines);
 
     return 1;
 }
 
+int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
+{
+    httpp_buffer_t *buffer;
+
+    if (http_data == NULL)
+        return 0;
+
+    buffer = _httpp_buffer_new(parser, http_data, len);
+    if (buffer == NULL) return 0;
+
+    return _httpp_parse_request(parser, buffer, len);
+}
+
+/* where httpp_feed() is: in a line, just past its LF, or past LF CR */
+#define FEED_LINE   0
+#define FEED_LF     1
+#define FEED_LF_CR  2
+
+long httpp_feed(http_parser_t *parser, const char *data, unsigned long len)
+{
+    httpp_feed_t *feed = parser->feed;
+    unsigned long i = 0;
+    int done = 0;
+
+    if (feed == NULL) {
+        feed = calloc(1, sizeof(httpp_feed_t));
+        if (feed == NULL)
+            return -1;
+        parser->feed = feed;
+    }
+
+    /* every byte is looked at once, the state carries over between calls */
+    while (i < len && !done) {
+        switch (feed->state) {
+            case FEED_LINE: {
+                const char *lf = memchr(&data[i], '\n', len - i);
+
+                if (lf == NULL) {
+                    i = len;
+                } else {
+                    i = lf - data + 1;
+                    feed->state = FEED_LF;
+                }
+            }
+            break;
+            case FEED_LF:
+                if (data[i] == '\n') {
+                    done = 1;
+                } else if (data[i] == '\r') {
+                    feed->state = FEED_LF_CR;
+                } else {
+                    /* the next line starts here */
+                    feed->state = FEED_LINE;
+                    continue;
+                }
+                i++;
+            break;
+            case FEED_LF_CR:
+                if (data[i] != '\n') {
+                    _httpp_feed_free(parser);
+                    return -1;
+                }
+                done = 1;
+                i++;
+            break;
+        }
+    }
+
+    if (feed->len + i > MAX_REQUEST_SIZE) {
+        _httpp_feed_free(parser);
+        return -1;
+    }
+    if (feed->buffer == NULL || feed->len + i > feed->size) {
+        unsigned long size = feed->size ? feed->size * 2 : 1024;
+        httpp_buffer_t *buffer;
+
+        if (size < feed->len + i)
+            size = feed->len + i;
+        buffer = _httpp_buffer_resize(feed->buffer, size);
+        if (buffer == NULL) {
+            _httpp_feed_free(parser);
+            return -1;
+        }
+        feed->buffer = buffer;
+        feed->size = size;
+    }
+    memcpy(&feed->buffer->data[feed->len], data, i);
+    feed->len += i;
+
+    if (!done)
+        return 0;
+
+    {
+        httpp_buffer_t *buffer = feed->buffer;
+        unsigned long request_len = feed->len;
+
+        buffer->data[request_len] = 0;
+        feed->buffer = NULL;
+        _httpp_feed_free(parser);
+        _httpp_buffer_link(parser, buffer);
+        if (!_httpp_parse_request(parser, buffer, request_len))
+            return -1;
+    }
+
+    return i;
+}
+
 void httpp_deletevar(http_parser_t *parser, const char *name)
 {
-    http_var_t var;
+    http_var_t **slot;
 
     if (parser == NULL || name == NULL)
         return;
-    memset(&var, 0, sizeof(var));
 
-    var.name = (char*)name;
+    slot = _httpp_vartable_find(&parser->vars, name);
+    if (slot) {
+        httpp_hdr_t id = _httpp_hdr_id(name);
 
-    avl_delete(parser->vars, (void *)&var, _free_vars);
+        if (id != HTTPP_HDR_MAX)
+            parser->header[id] = NULL;
+        _httpp_free_var(parser, *slot);
+        _httpp_vartable_delete(&parser->vars, slot);
+    }
 }
 
 void httpp_setvar(http_parser_t *parser, const char *name, const char *value)
@@ -587,45 +994,43 @@ void httpp_setvar(http_parser_t *parser, const char *name, const char *value)
     var->values = 1;
     var->value[0] = strdup(value);
 
-    if (httpp_getvar(parser, name) == NULL) {
-        avl_insert(parser->vars, (void *)var);
-    } else {
-        avl_delete(parser->vars, (void *)var, _free_vars);
-        avl_insert(parser->vars, (void *)var);
-    }
+    _httpp_replace_var(parser, var);
 }
 
 const char *httpp_getvar(http_parser_t *parser, const char *name)
 {
-    http_var_t var;
-    http_var_t *found;
-    void *fp;
-
     if (parser == NULL || name == NULL)
         return NULL;
 
-    fp = &found;
-    memset(&var, 0, sizeof(var));
-    var.name = (char*)name;
+    return _httpp_get_param(&parser->vars, name);
+}
 
-    if (avl_get_by_key(parser->vars, &var, fp) == 0) {
-        if (!found->values)
-            return NULL;
-        return found->value[0];
-    } else {
+const char *httpp_getvar_id(http_parser_t *parser, httpp_hdr_t id)
+{
+    http_var_t *var;
+
+    if (parser == NULL || (unsigned int)id >= HTTPP_HDR_MAX)
         return NULL;
-    }
+
+    var = parser->header[id];
+    if (var == NULL || !var->values)
+        return NULL;
+
+    return var->value[0];
 }
 
-static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int replace)
+static void _httpp_set_param_nocopy(http_vartable_t *table, char *name, char *value, int replace)
 {
-    http_var_t *var, *found;
+    http_var_t *var, *found = NULL;
+    http_var_t **slot;
     char **n;
 
     if (name == NULL || value == NULL)
         return;
 
-    found = _httpp_get_param_var(tree, name);
+    slot = _httpp_vartable_find(table, name);
+    if (slot)
+        found = *slot;
 
     if (replace || !found) {
         var = (http_var_t *)calloc(1, sizeof(http_var_t));
@@ -655,39 +1060,35 @@ static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int
     var->value[var->values++] = value;
 
     if (replace && found) {
-        avl_delete(tree, (void *)found, _free_vars);
-        avl_insert(tree, (void *)var);
+        *slot = var;
+        _free_vars(found);
     } else if (!found) {
-        avl_insert(tree, (void *)var);
+        if (_httpp_vartable_insert(table, var) != 0)
+            _free_vars(var);
     }
 }
 
-static void _httpp_set_param(avl_tree *tree, const char *name, const char *value)
+static void _httpp_set_param(http_vartable_t *table, const char *name, const char *value)
 {
     if (name == NULL || value == NULL)
         return;
 
-    _httpp_set_param_nocopy(tree, strdup(name), url_unescape(value, strlen(value)), 1);
+    _httpp_set_param_nocopy(table, strdup(name), url_unescape(value, strlen(value)), 1);
 }
 
-static http_var_t *_httpp_get_param_var(avl_tree *tree, const char *name)
+static http_var_t *_httpp_get_param_var(http_vartable_t *table, const char *name)
 {
-    http_var_t var;
-    http_var_t *found;
-    void *fp;
-
-    fp = &found;
-    memset(&var, 0, sizeof(var));
-    var.name = (char *)name;
+    http_var_t **slot = _httpp_vartable_find(table, name);
 
-    if (avl_get_by_key(tree, (void *)&var, fp) == 0)
-        return found;
+    if (slot)
+        return *slot;
     else
         return NULL;
 }
-static const char *_httpp_get_param(avl_tree *tree, const char *name)
+
+static const char *_httpp_get_param(http_vartable_t *table, const char *name)
 {
-    http_var_t *res = _httpp_get_param_var(tree, name);
+    http_var_t *res = _httpp_get_param_var(table, name);
 
     if (!res)
         return NULL;
@@ -700,37 +1101,37 @@ static const char *_httpp_get_param(avl_tree *tree, const char *name)
 
 void httpp_set_query_param(http_parser_t *parser, const char *name, const char *value)
 {
-    return _httpp_set_param(parser->queryvars, name, value);
+    return _httpp_set_param(&parser->queryvars, name, value);
 }
 
 const char *httpp_get_query_param(http_parser_t *parser, const char *name)
 {
-    return _httpp_get_param(parser->queryvars, name);
+    return _httpp_get_param(&parser->queryvars, name);
 }
 
 void httpp_set_post_param(http_parser_t *parser, const char *name, const char *value)
 {
-    return _httpp_set_param(parser->postvars, name, value);
+    return _httpp_set_param(&parser->postvars, name, value);
 }
 
 const char *httpp_get_post_param(http_parser_t *parser, const char *name)
 {
-    return _httpp_get_param(parser->postvars, name);
+    return _httpp_get_param(&parser->postvars, name);
 }
 
 const http_var_t *httpp_get_param_var(http_parser_t *parser, const char *name)
 {
-    http_var_t *ret = _httpp_get_param_var(parser->postvars, name);
+    http_var_t *ret = _httpp_get_param_var(&parser->postvars, name);
 
     if (ret)
         return ret;
 
-    return _httpp_get_param_var(parser->queryvars, name);
+    return _httpp_get_param_var(&parser->queryvars, name);
 }
 
 const http_var_t *httpp_get_any_var(http_parser_t *parser, httpp_ns_t ns, const char *name)
 {
-    avl_tree *tree = NULL;
+    http_vartable_t *table = NULL;
 
     if (!parser || !name)
         return NULL;
@@ -739,31 +1140,31 @@ const http_var_t *httpp_get_any_var(http_parser_t *parser, httpp_ns_t ns, const
         case HTTPP_NS_VAR:
             if (name[0] != '_' || name[1] != '_')
                 return NULL;
-            tree = parser->vars;
+            table = &parser->vars;
         break;
         case HTTPP_NS_HEADER:
             if (name[0] == '_' && name[1] == '_')
                 return NULL;
-            tree = parser->vars;
+            table = &parser->vars;
         break;
         case HTTPP_NS_QUERY_STRING:
-            tree = parser->queryvars;
+            table = &parser->queryvars;
         break;
         case HTTPP_NS_POST_BODY:
-            tree = parser->postvars;
+            table = &parser->postvars;
         break;
     }
 
-    if (!tree)
+    if (!table)
         return NULL;
 
-    return _httpp_get_param_var(tree, name);
+    return _httpp_get_param_var(table, name);
 }
 
 char ** httpp_get_any_key(http_parser_t *parser, httpp_ns_t ns)
 {
-    avl_tree *tree = NULL;
-    avl_node *avlnode;
+    http_vartable_t *table = NULL;
+    size_t i;
     char **ret;
     size_t len;
     size_t pos = 0;
@@ -774,17 +1175,17 @@ char ** httpp_get_any_key(http_parser_t *parser, httpp_ns_t ns)
     switch (ns) {
         case HTTPP_NS_VAR:
         case HTTPP_NS_HEADER:
-            tree = parser->vars;
+            table = &parser->vars;
         break;
         case HTTPP_NS_QUERY_STRING:
-            tree = parser->queryvars;
+            table = &parser->queryvars;
         break;
         case HTTPP_NS_POST_BODY:
-            tree = parser->postvars;
+            table = &parser->postvars;
         break;
     }
 
-    if (!tree)
+    if (!table)
         return NULL;
 
     ret = calloc(8, sizeof(*ret));
@@ -793,8 +1194,8 @@ char ** httpp_get_any_key(http_parser_t *parser, httpp_ns_t ns)
 
     len = 8;
 
-    for (avlnode = avl_get_first(tree); avlnode; avlnode = avl_get_next(avlnode)) {
-        http_var_t *var = avlnode->key;
+    for (i = 0; i < table->len; i++) {
+        http_var_t *var = HTTPP_VARTABLE_VARS(table)[i];
 
         if (ns == HTTPP_NS_VAR) {
             if (var->name[0] != '_' || var->name[1] != '_') {
@@ -844,24 +1245,36 @@ void httpp_free_any_key(char **keys)
 
 const char *httpp_get_param(http_parser_t *parser, const char *name)
 {
-    const char *ret = _httpp_get_param(parser->postvars, name);
+    const char *ret = _httpp_get_param(&parser->postvars, name);
 
     if (ret)
         return ret;
 
-    return _httpp_get_param(parser->queryvars, name);
+    return _httpp_get_param(&parser->queryvars, name);
 }
 
 static void httpp_clear(http_parser_t *parser)
 {
+    size_t i;
+
     parser->req_type = httpp_req_none;
-    if (parser->uri)
-        free(parser->uri);
     parser->uri = NULL;
-    avl_tree_free(parser->vars, _free_vars);
-    avl_tree_free(parser->queryvars, _free_vars);
-    avl_tree_free(parser->postvars, _free_vars);
-    parser->vars = NULL;
+    for (i = 0; i < parser->vars.len; i++)
+        _httpp_free_var(parser, HTTPP_VARTABLE_VARS(&parser->vars)[i]);
+    for (i = 0; i < parser->queryvars.len; i++)
+        _free_vars(HTTPP_VARTABLE_VARS(&parser->queryvars)[i]);
+    for (i = 0; i < parser->postvars.len; i++)
+        _free_vars(HTTPP_VARTABLE_VARS(&parser->postvars)[i]);
+    _httpp_vartable_free(&parser->vars);
+    _httpp_vartable_free(&parser->queryvars);
+    _httpp_vartable_free(&parser->postvars);
+    memset(parser->header, 0, sizeof(parser->header));
+    _httpp_feed_free(parser);
+    while (parser->buffers) {
+        httpp_buffer_t *next = parser->buffers->next;
+        free(parser->buffers);
+        parser->buffers = next;
+    }
 }
 
 int httpp_addref(http_parser_t *parser)
@@ -898,14 +1311,90 @@ static char *_lowercase(char *str)
     return str;
 }
 
-static int _compare_vars(void *compare_arg, void *a, void *b)
+static void _httpp_vartable_init(http_vartable_t *table)
+{
+    table->len = 0;
+    table->size = HTTPP_VARTABLE_LOCAL;
+    table->heap = NULL;
+}
+
+/* the first slot whose var is not before <name> */
+static size_t _httpp_vartable_slot(http_vartable_t *table, const char *name)
+{
+    http_var_t **var = HTTPP_VARTABLE_VARS(table);
+    size_t low = 0, high = table->len;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (strcmp(var[mid]->name, name) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static http_var_t **_httpp_vartable_find(http_vartable_t *table, const char *name)
+{
+    http_var_t **var = HTTPP_VARTABLE_VARS(table);
+    size_t i = _httpp_vartable_slot(table, name);
+
+    if (i < table->len && strcmp(var[i]->name, name) == 0)
+        return &var[i];
+
+    return NULL;
+}
+
+/* <var> must not be in <table> yet */
+static int _httpp_vartable_insert(http_vartable_t *table, http_var_t *var)
+{
+    http_var_t **vars;
+    size_t i;
+
+    if (table->len == table->size) {
+        size_t size = table->size * 2;
+        http_var_t **n;
+
+        if (table->heap == NULL) {
+            n = malloc(sizeof(*n) * size);
+            if (n)
+                memcpy(n, table->local, sizeof(*n) * table->len);
+        } else {
+            n = realloc(table->heap, sizeof(*n) * size);
+        }
+        if (!n)
+            return -1;
+
+        table->heap = n;
+        table->size = size;
+    }
+
+    vars = HTTPP_VARTABLE_VARS(table);
+    i = _httpp_vartable_slot(table, var->name);
+    memmove(&vars[i + 1], &vars[i], sizeof(*vars) * (table->len - i));
+    vars[i] = var;
+    table->len++;
+
+    return 0;
+}
+
+/* remove the var at <slot>, freeing it is up to the caller */
+static void _httpp_vartable_delete(http_vartable_t *table, http_var_t **slot)
 {
-    http_var_t *vara, *varb;
+    size_t i = slot - HTTPP_VARTABLE_VARS(table);
 
-    vara = (http_var_t *)a;
-    varb = (http_var_t *)b;
+    memmove(slot, slot + 1, sizeof(*slot) * (table->len - i - 1));
+    table->len--;
+}
 
-    return strcmp(vara->name, varb->name);
+/* drop the vars of <table> without freeing them */
+static void _httpp_vartable_free(http_vartable_t *table)
+{
+    free(table->heap);
+    _httpp_vartable_init(table);
 }
 
 static int _free_vars(void *key)
@@ -27,6 +27,7 @@
 #ifndef __HTTPP_H
 #define __HTTPP_H
 
+/* not used here anymore, but users may still expect it */
 #include <avl/avl.h>
 
 #define HTTPP_VAR_PROTOCOL "__protocol"
@@ -46,6 +47,33 @@ typedef enum {
     HTTPP_NS_POST_BODY
 } httpp_ns_t;
 
+/* Well-known headers, for httpp_getvar_id() */
+typedef enum {
+    HTTPP_HDR_ACCEPT,
+    HTTPP_HDR_ACCEPT_ENCODING,
+    HTTPP_HDR_AUTHORIZATION,
+    HTTPP_HDR_CACHE_CONTROL,
+    HTTPP_HDR_CONNECTION,
+    HTTPP_HDR_CONTENT_LENGTH,
+    HTTPP_HDR_CONTENT_TYPE,
+    HTTPP_HDR_COOKIE,
+    HTTPP_HDR_EXPECT,
+    HTTPP_HDR_HOST,
+    HTTPP_HDR_ICE_AUDIO_INFO,
+    HTTPP_HDR_ICE_NAME,
+    HTTPP_HDR_ICE_PUBLIC,
+    HTTPP_HDR_ICY_METADATA,
+    HTTPP_HDR_ORIGIN,
+    HTTPP_HDR_RANGE,
+    HTTPP_HDR_REFERER,
+    HTTPP_HDR_TRANSFER_ENCODING,
+    HTTPP_HDR_UPGRADE,
+    HTTPP_HDR_USER_AGENT,
+    HTTPP_HDR_X_FORWARDED_FOR,
+    /* Number of the above. MUST BE LAST ONE IN LIST. */
+    HTTPP_HDR_MAX
+} httpp_hdr_t;
+
 typedef enum httpp_request_type_tag {
     /* Initial and internally used state of the engine */
     httpp_req_none = 0,
@@ -88,13 +116,42 @@ typedef struct http_varlist_tag {
     struct http_varlist_tag *next;
 } http_varlist_t;
 
+/* The vars of one namespace, sorted by name.  The first few sit in
+ * <local>, a table that outgrows them moves to <heap>.  Walk them with
+ * HTTPP_VARTABLE_VARS(table)[0] to [len - 1].
+ */
+#define HTTPP_VARTABLE_LOCAL 16
+
+typedef struct http_vartable_tag {
+    size_t len;
+    size_t size;
+    /* NULL while the vars fit into <local> */
+    http_var_t **heap;
+    http_var_t *local[HTTPP_VARTABLE_LOCAL];
+} http_vartable_t;
+
+#define HTTPP_VARTABLE_VARS(table) ((table)->heap ? (table)->heap : (table)->local)
+
+/* copies of parsed requests and the state of httpp_feed(), private to httpp.c */
+struct httpp_buffer_tag;
+struct httpp_feed_tag;
+
+/* A parser owns its vars and buffers and is reference counted, share
+ * it with httpp_addref() and never copy the structure.
+ */
 typedef struct http_parser_tag {
     size_t refc;
     httpp_request_type_e req_type;
+    /* points into the parsed request */
     char *uri;
-    avl_tree *vars;
-    avl_tree *queryvars;
-    avl_tree *postvars;
+    http_vartable_t vars;
+    http_vartable_t queryvars;
+    http_vartable_t postvars;
+    /* the vars of well-known headers, NULL if not set */
+    http_var_t *header[HTTPP_HDR_MAX];
+    /* the vars set while parsing live in here */
+    struct httpp_buffer_tag *buffers;
+    struct httpp_feed_tag *feed;
 } http_parser_t;
 
 #ifdef _mangle
@@ -102,11 +159,13 @@ typedef struct http_parser_tag {
 # define httpp_create_parser _mangle(httpp_create_parser)
 # define httpp_initialize _mangle(httpp_initialize)
 # define httpp_parse _mangle(httpp_parse)
+# define httpp_feed _mangle(httpp_feed)
 # define httpp_parse_icy _mangle(httpp_parse_icy)
 # define httpp_parse_response _mangle(httpp_parse_response)
 # define httpp_parse_postdata _mangle(httpp_parse_postdata)
 # define httpp_setvar _mangle(httpp_setvar)
 # define httpp_getvar _mangle(httpp_getvar)
+# define httpp_getvar_id _mangle(httpp_getvar_id)
 # define httpp_set_query_param _mangle(httpp_set_query_param)
 # define httpp_get_query_param _mangle(httpp_get_query_param)
 # define httpp_set_post_param _mangle(httpp_set_post_param)
@@ -125,12 +184,19 @@ httpp_request_info_t httpp_request_info(httpp_request_type_e req);
 http_parser_t *httpp_create_parser(void);
 void httpp_initialize(http_parser_t *parser, http_varlist_t *defaults);
 int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len);
+/* Parse a request as it comes in.  Returns 0 if all <len> bytes were
+ * taken and more are needed, -1 on errors and once the request is
+ * complete and parsed, how many of the <len> bytes belonged to it.
+ */
+long httpp_feed(http_parser_t *parser, const char *data, unsigned long len);
 int httpp_parse_icy(http_parser_t *parser, const char *http_data, unsigned long len);
 int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned long len, const char *uri);
 int httpp_parse_postdata(http_parser_t *parser, const char *body_data, size_t len);
 void httpp_setvar(http_parser_t *parser, const char *name, const char *value);
 void httpp_deletevar(http_parser_t *parser, const char *name);
 const char *httpp_getvar(http_parser_t *parser, const char *name);
+/* httpp_getvar() for a well-known header, without looking up its name */
+const char *httpp_getvar_id(http_parser_t *parser, httpp_hdr_t id);
 void httpp_set_query_param(http_parser_t *parser, const char *name, const char *value);
 const char *httpp_get_query_param(http_parser_t *parser, const char *name);
 void httpp_set_post_param(http_parser_t *parser, const char *name, const char *value);
@@ -1,57 +1,234 @@
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 
-#include <avl/avl.h>
 #include "httpp.h"
 
+static const char request[] =
+    "GET /stream.mp3?id=7 HTTP/1.1\r\n"
+    "Host: radio.example.com:8000\r\n"
+    "User-Agent: VLC/3.0.18\r\n"
+    "Icy-MetaData: 1\r\n"
+    "Content-Length: 4\r\n"
+    "\r\n";
 
-int main(int argc, char **argv)
+static http_parser_t *_new_parser(void)
+{
+    http_parser_t *parser = httpp_create_parser();
+
+    if (parser)
+        httpp_initialize(parser, NULL);
+    return parser;
+}
+
+/* both parsers have the same vars with the same values */
+static int _same_table(http_vartable_t *a, http_vartable_t *b)
+{
+    size_t i, j;
+
+    if (a->len != b->len)
+        return 0;
+    for (i = 0; i < a->len; i++) {
+        http_var_t *va = HTTPP_VARTABLE_VARS(a)[i], *vb = HTTPP_VARTABLE_VARS(b)[i];
+
+        if (strcmp(va->name, vb->name) != 0 || va->values != vb->values)
+            return 0;
+        for (j = 0; j < va->values; j++) {
+            if (strcmp(va->value[j], vb->value[j]) != 0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int _same(http_parser_t *a, http_parser_t *b)
+{
+    return a->req_type == b->req_type && _same_table(&a->vars, &b->vars)
+        && _same_table(&a->queryvars, &b->queryvars);
+}
+
+/* feeds <request> and a body, <first> bytes and then pieces of <chunk> */
+static int _feed(http_parser_t *whole, size_t first, size_t chunk)
+{
+    char data[sizeof(request) - 1 + 4];
+    size_t len = sizeof(request) - 1, done = 0, n = first, last = 0;
+    http_parser_t *parser = _new_parser();
+    long ret = 0;
+    int ok;
+
+    if (!parser)
+        return 0;
+    memcpy(data, request, len);
+    memcpy(data + len, "BODY", 4);
+    while (ret == 0 && done < sizeof(data)) {
+        if (n > sizeof(data) - done)
+            n = sizeof(data) - done;
+        ret = httpp_feed(parser, data + done, n);
+        last = done;
+        done += n;
+        n = chunk;
+    }
+    /* the request ends after the empty line, the body is left alone */
+    ok = ret > 0 && last + ret == len;
+    ok = ok && _same(parser, whole);
+    httpp_release(parser);
+
+    return ok;
+}
+
+/* how the well-known headers are spelled on the wire */
+static const char *const _hdr_names[HTTPP_HDR_MAX] = {
+    [HTTPP_HDR_ACCEPT] = "Accept",
+    [HTTPP_HDR_ACCEPT_ENCODING] = "Accept-Encoding",
+    [HTTPP_HDR_AUTHORIZATION] = "Authorization",
+    [HTTPP_HDR_CACHE_CONTROL] = "Cache-Control",
+    [HTTPP_HDR_CONNECTION] = "Connection",
+    [HTTPP_HDR_CONTENT_LENGTH] = "Content-Length",
+    [HTTPP_HDR_CONTENT_TYPE] = "Content-Type",
+    [HTTPP_HDR_COOKIE] = "Cookie",
+    [HTTPP_HDR_EXPECT] = "Expect",
+    [HTTPP_HDR_HOST] = "Host",
+    [HTTPP_HDR_ICE_AUDIO_INFO] = "Ice-Audio-Info",
+    [HTTPP_HDR_ICE_NAME] = "Ice-Name",
+    [HTTPP_HDR_ICE_PUBLIC] = "Ice-Public",
+    [HTTPP_HDR_ICY_METADATA] = "Icy-MetaData",
+    [HTTPP_HDR_ORIGIN] = "Origin",
+    [HTTPP_HDR_RANGE] = "Range",
+    [HTTPP_HDR_REFERER] = "Referer",
+    [HTTPP_HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [HTTPP_HDR_UPGRADE] = "Upgrade",
+    [HTTPP_HDR_USER_AGENT] = "User-Agent",
+    [HTTPP_HDR_X_FORWARDED_FOR] = "X-Forwarded-For"
+};
+
+/* not well-known, the second has the hash of user-agent */
+static const char unknown[] =
+    "GET / HTTP/1.1\r\n"
+    "X-Custom: a\r\n"
+    "UxxxxxxxxT: b\r\n"
+    "\r\n";
+
+/* sends every well-known header with its id as value, names as given,
+ * all upper or all lower case for <spelling> 0, 1 and 2
+ */
+static int _getvar_id(int spelling)
+{
+    char data[2048], name[32], value[8];
+    size_t len;
+    http_parser_t *parser = _new_parser();
+    int id, ok = 1;
+
+    if (!parser)
+        return 0;
+    len = snprintf(data, sizeof(data), "GET / HTTP/1.1\r\n");
+    for (id = 0; id < HTTPP_HDR_MAX; id++) {
+        const char *p;
+        size_t i;
+
+        for (p = _hdr_names[id], i = 0; *p; p++, i++)
+            name[i] = spelling == 1 ? toupper(*p) : spelling == 2 ? tolower(*p) : *p;
+        name[i] = 0;
+        len += snprintf(data + len, sizeof(data) - len, "%s: %d\r\n", name, id);
+    }
+    len += snprintf(data + len, sizeof(data) - len, "\r\n");
+
+    ok = httpp_parse(parser, data, len);
+    for (id = 0; ok && id < HTTPP_HDR_MAX; id++) {
+        const char *p = httpp_getvar_id(parser, id);
+        size_t i;
+
+        for (i = 0; _hdr_names[id][i]; i++)
+            name[i] = tolower(_hdr_names[id][i]);
+        name[i] = 0;
+        snprintf(value, sizeof(value), "%d", id);
+        ok = p && strcmp(p, value) == 0 && p == httpp_getvar(parser, name);
+    }
+    ok = ok && !httpp_getvar_id(parser, HTTPP_HDR_MAX);
+    httpp_release(parser);
+
+    return ok;
+}
+
+int main(void)
 {
     char buff[8192];
     int readed;
-    http_parser_t parser;
-    avl_node *node;
+    http_parser_t *parser;
+    size_t i;
     http_var_t *var;
 
-    httpp_initialize(&parser, NULL);
+    printf("Feeding a request in pieces...\n");
+    parser = _new_parser();
+    if (!parser || !httpp_parse(parser, request, sizeof(request) - 1)) {
+        printf("...failed\n");
+        return 1;
+    }
+    /* one byte at a time, and in two pieces split anywhere */
+    for (i = 0; i < sizeof(request) + 4; i++) {
+        if (!_feed(parser, i ? i : 1, i ? 8192 : 1)) {
+            printf("...failed\n");
+            return 1;
+        }
+    }
+    httpp_release(parser);
+
+    printf("Looking up headers by id...\n");
+    for (i = 0; i < 3; i++) {
+        if (!_getvar_id(i)) {
+            printf("...failed\n");
+            return 1;
+        }
+    }
+    parser = _new_parser();
+    if (!parser || !httpp_parse(parser, unknown, sizeof(unknown) - 1)
+            || strcmp(httpp_getvar(parser, "x-custom"), "a") != 0
+            || strcmp(httpp_getvar(parser, "uxxxxxxxxt"), "b") != 0) {
+        printf("...failed\n");
+        return 1;
+    }
+    for (i = 0; i < HTTPP_HDR_MAX; i++) {
+        if (httpp_getvar_id(parser, i)) {
+            printf("...failed\n");
+            return 1;
+        }
+    }
+    /* ids follow vars that are set and deleted later on */
+    httpp_setvar(parser, "user-agent", "c");
+    if (!httpp_getvar_id(parser, HTTPP_HDR_USER_AGENT)
+            || strcmp(httpp_getvar_id(parser, HTTPP_HDR_USER_AGENT), "c") != 0) {
+        printf("...failed\n");
+        return 1;
+    }
+    httpp_deletevar(parser, "user-agent");
+    if (httpp_getvar_id(parser, HTTPP_HDR_USER_AGENT)) {
+        printf("...failed\n");
+        return 1;
+    }
+    httpp_release(parser);
+
+    parser = httpp_create_parser();
+    if (!parser)
+        return 1;
+    httpp_initialize(parser, NULL);
 
     readed = fread(buff, 1, 8192, stdin);
-    if (httpp_parse(&parser, buff, readed)) {
+    if (httpp_parse(parser, buff, readed)) {
         printf("Parse succeeded...\n\n");
-        printf("Request was ");
-        switch (parser.req_type) {
-        case httpp_req_none:
-            printf(" none\n");
-            break;
-        case httpp_req_unknown:
-            printf(" unknown\n");
-            break;
-        case httpp_req_get:
-            printf(" get\n");
-            break;
-        case httpp_req_post:
-            printf(" post\n");
-            break;
-        case httpp_req_head:
-            printf(" head\n");
-            break;
-        }
-        printf("Version was 1.%d\n", parser.version);
+        printf("Request was %s\n", httpp_getvar(parser, HTTPP_VAR_REQ_TYPE));
+        printf("Version was %s\n", httpp_getvar(parser, HTTPP_VAR_VERSION));
         
-        node = avl_get_first(parser.vars);
-        while (node) {
-            var = (http_var_t *)node->key;
+        for (i = 0; i < parser->vars.len; i++) {
+            var = HTTPP_VARTABLE_VARS(&parser->vars)[i];
             
             if (var)
-                printf("Iterating variable(s): %s = %s\n", var->name, var->value);
-            
-            node = avl_get_next(node);
+                printf("Iterating variable(s): %s = %s\n", var->name, var->values ? var->value[0] : "");
         }
     } else {
         printf("Parse failed...\n");
     }
 
     printf("Destroying parser...\n");
-    httpp_destroy(&parser);
+    httpp_destroy(parser);
 
     return 0;
 }
@@ -583,6 +583,16 @@ void thread_rwlock_wlock_c(rwlock_t *rwlock, int line, char *file)
     pthread_rwlock_wrlock(&rwlock->sys_rwlock);
 }
 
+int thread_rwlock_tryrlock_c(rwlock_t *rwlock, int line, char *file)
+{
+    return pthread_rwlock_tryrdlock(&rwlock->sys_rwlock) == 0 ? 0 : -1;
+}
+
+int thread_rwlock_trywlock_c(rwlock_t *rwlock, int line, char *file)
+{
+    return pthread_rwlock_trywrlock(&rwlock->sys_rwlock) == 0 ? 0 : -1;
+}
+
 void thread_rwlock_unlock_c(rwlock_t *rwlock, int line, char *file)
 {
     pthread_rwlock_unlock(&rwlock->sys_rwlock);
@@ -777,6 +787,173 @@ void thread_join(thread_type *thread)
     _mutex_unlock(&_threadtree_mutex);
 }
 
+/* EPOCH BASED RECLAMATION */
+
+/* one per thread and domain, sized to have a cache line for itself */
+typedef struct thread_epoch_record_tag {
+    struct thread_epoch_record_tag *next;
+    /* (epoch << 1) | 1 while the thread is in a read section, 0 otherwise */
+    unsigned long state;
+    unsigned int nesting;
+    int in_use;
+    char pad[64 - 2 * sizeof(void *) - 2 * sizeof(int)];
+} thread_epoch_record_t;
+
+struct thread_epoch_tag {
+    unsigned long global;
+    pthread_key_t key;
+    mutex_t records_mutex;
+    /* records are never taken off this list before the domain is freed */
+    thread_epoch_record_t *records;
+};
+
+static thread_epoch_t *_default_epoch = NULL;
+static pthread_once_t _default_epoch_once = PTHREAD_ONCE_INIT;
+
+static void _epoch_record_release(void *arg)
+{
+    thread_epoch_record_t *rec = (thread_epoch_record_t *)arg;
+
+    rec->nesting = 0;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+thread_epoch_t *thread_epoch_new(void)
+{
+    thread_epoch_t *epoch = calloc(1, sizeof(thread_epoch_t));
+
+    if (!epoch)
+        return NULL;
+
+    if (pthread_key_create(&epoch->key, _epoch_record_release) != 0) {
+        free(epoch);
+        return NULL;
+    }
+
+    epoch->global = 1;
+    thread_mutex_create(&epoch->records_mutex);
+
+    return epoch;
+}
+
+void thread_epoch_free(thread_epoch_t *epoch)
+{
+    thread_epoch_record_t *rec;
+
+    if (!epoch)
+        return;
+
+    pthread_key_delete(epoch->key);
+    while ((rec = epoch->records)) {
+        epoch->records = rec->next;
+        free(rec);
+    }
+    thread_mutex_destroy(&epoch->records_mutex);
+    free(epoch);
+}
+
+static void _create_default_epoch(void)
+{
+    _default_epoch = thread_epoch_new();
+}
+
+thread_epoch_t *thread_epoch_default(void)
+{
+    pthread_once(&_default_epoch_once, _create_default_epoch);
+    return _default_epoch;
+}
+
+static thread_epoch_record_t *_epoch_record(thread_epoch_t *epoch)
+{
+    thread_epoch_record_t *rec = pthread_getspecific(epoch->key);
+
+    if (rec)
+        return rec;
+
+    thread_mutex_lock(&epoch->records_mutex);
+    /* reuse the record of a thread that is gone */
+    for (rec = epoch->records; rec; rec = rec->next) {
+        if (!__atomic_load_n(&rec->in_use, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (rec) {
+        rec->in_use = 1;
+    } else {
+        rec = calloc(1, sizeof(thread_epoch_record_t));
+        if (!rec) {
+            thread_mutex_unlock(&epoch->records_mutex);
+            abort();
+        }
+        rec->in_use = 1;
+        rec->next = epoch->records;
+        __atomic_store_n(&epoch->records, rec, __ATOMIC_RELEASE);
+    }
+    thread_mutex_unlock(&epoch->records_mutex);
+
+    pthread_setspecific(epoch->key, rec);
+
+    return rec;
+}
+
+void thread_epoch_enter(thread_epoch_t *epoch)
+{
+    thread_epoch_record_t *rec = _epoch_record(epoch);
+
+    if (rec->nesting++)
+        return;
+
+    __atomic_store_n(&rec->state, (__atomic_load_n(&epoch->global, __ATOMIC_RELAXED) << 1) | 1UL, __ATOMIC_RELAXED);
+    /* our state must be visible before we look at any shared data */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void thread_epoch_leave(thread_epoch_t *epoch)
+{
+    thread_epoch_record_t *rec = pthread_getspecific(epoch->key);
+
+    if (!rec || !rec->nesting)
+        return;
+
+    if (--rec->nesting)
+        return;
+
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+unsigned long thread_epoch_current(thread_epoch_t *epoch)
+{
+    return __atomic_load_n(&epoch->global, __ATOMIC_SEQ_CST);
+}
+
+unsigned long thread_epoch_safe(thread_epoch_t *epoch)
+{
+    thread_epoch_record_t *rec;
+    unsigned long safe;
+
+    /* Readers entering from now on see a newer epoch. The atomic
+    ** increment also orders the caller's unlinking before the scan.
+    */
+    safe = __atomic_add_fetch(&epoch->global, 1, __ATOMIC_SEQ_CST);
+
+    for (rec = __atomic_load_n(&epoch->records, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+
+        if ((state & 1UL) && (state >> 1) < safe)
+            safe = state >> 1;
+    }
+
+    return safe;
+}
+
+void thread_epoch_synchronize(thread_epoch_t *epoch)
+{
+    unsigned long tag = thread_epoch_current(epoch);
+
+    while (thread_epoch_safe(epoch) <= tag)
+        thread_sleep(1000);
+}
+
 /* AVL tree functions */
 
 #ifdef DEBUG_MUTEXES
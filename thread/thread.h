@@ -112,6 +112,9 @@ typedef mutex_t spin_t;
 #define thread_spin_unlock(x)    thread_mutex_unlock(x)
 #endif
 
+/* epoch based reclamation, see thread_epoch_new() */
+typedef struct thread_epoch_tag thread_epoch_t;
+
 #define thread_create(n,x,y,z) thread_create_c(n,x,y,z,__LINE__,__FILE__)
 #define thread_mutex_create(x) thread_mutex_create_c(x,__LINE__,__FILE__)
 #define thread_mutex_lock(x) thread_mutex_lock_c(x,__LINE__,__FILE__)
@@ -124,6 +127,8 @@ typedef mutex_t spin_t;
 #define thread_rwlock_create(x) thread_rwlock_create_c(x,__LINE__,__FILE__)
 #define thread_rwlock_rlock(x) thread_rwlock_rlock_c(x,__LINE__,__FILE__)
 #define thread_rwlock_wlock(x) thread_rwlock_wlock_c(x,__LINE__,__FILE__)
+#define thread_rwlock_tryrlock(x) thread_rwlock_tryrlock_c(x,__LINE__,__FILE__)
+#define thread_rwlock_trywlock(x) thread_rwlock_trywlock_c(x,__LINE__,__FILE__)
 #define thread_rwlock_unlock(x) thread_rwlock_unlock_c(x,__LINE__,__FILE__)
 #define thread_exit(x) thread_exit_c(x,__LINE__,__FILE__)
 
@@ -151,6 +156,8 @@ typedef mutex_t spin_t;
 # define thread_rwlock_create_c _mangle(thread_rwlock_create_c)
 # define thread_rwlock_rlock_c _mangle(thread_rwlock_rlock_c)
 # define thread_rwlock_wlock_c _mangle(thread_rwlock_wlock_c)
+# define thread_rwlock_tryrlock_c _mangle(thread_rwlock_tryrlock_c)
+# define thread_rwlock_trywlock_c _mangle(thread_rwlock_trywlock_c)
 # define thread_rwlock_unlock_c _mangle(thread_rwlock_unlock_c)
 # define thread_rwlock_destroy _mangle(thread_rwlock_destroy)
 # define thread_exit_c _mangle(thread_exit_c)
@@ -160,6 +167,14 @@ typedef mutex_t spin_t;
 # define thread_self _mangle(thread_self)
 # define thread_rename _mangle(thread_rename)
 # define thread_join _mangle(thread_join)
+# define thread_epoch_new _mangle(thread_epoch_new)
+# define thread_epoch_free _mangle(thread_epoch_free)
+# define thread_epoch_default _mangle(thread_epoch_default)
+# define thread_epoch_enter _mangle(thread_epoch_enter)
+# define thread_epoch_leave _mangle(thread_epoch_leave)
+# define thread_epoch_current _mangle(thread_epoch_current)
+# define thread_epoch_safe _mangle(thread_epoch_safe)
+# define thread_epoch_synchronize _mangle(thread_epoch_synchronize)
 #endif
 
 /* init/shutdown of the library */
@@ -183,6 +198,9 @@ void thread_cond_destroy(cond_t *cond);
 void thread_rwlock_create_c(rwlock_t *rwlock, int line, char *file);
 void thread_rwlock_rlock_c(rwlock_t *rwlock, int line, char *file);
 void thread_rwlock_wlock_c(rwlock_t *rwlock, int line, char *file);
+/* return 0 if the lock was taken, never block */
+int thread_rwlock_tryrlock_c(rwlock_t *rwlock, int line, char *file);
+int thread_rwlock_trywlock_c(rwlock_t *rwlock, int line, char *file);
 void thread_rwlock_unlock_c(rwlock_t *rwlock, int line, char *file);
 void thread_rwlock_destroy(rwlock_t *rwlock);
 void thread_exit_c(long val, int line, char *file);
@@ -204,4 +222,25 @@ void thread_rename(const char *name);
 /* waits until thread_exit is called for another thread */
 void thread_join(thread_type *thread);
 
+/* epoch based reclamation
+**
+** Readers wrap their accesses to shared data in thread_epoch_enter() and
+** thread_epoch_leave(), which only touch per thread state.  A writer that
+** unlinks an object tags it with thread_epoch_current() and may free it
+** once thread_epoch_safe() returns a value greater than that tag, as no
+** reader can still see it then.  Sections can be nested.
+*/
+thread_epoch_t *thread_epoch_new(void);
+void thread_epoch_free(thread_epoch_t *epoch);
+/* process wide domain, created on first use */
+thread_epoch_t *thread_epoch_default(void);
+void thread_epoch_enter(thread_epoch_t *epoch);
+void thread_epoch_leave(thread_epoch_t *epoch);
+unsigned long thread_epoch_current(thread_epoch_t *epoch);
+unsigned long thread_epoch_safe(thread_epoch_t *epoch);
+/* waits until everything retired so far is safe, must not be called
+** from within a read section
+*/
+void thread_epoch_synchronize(thread_epoch_t *epoch);
+
 #endif  /* __THREAD_H__ */